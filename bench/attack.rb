@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+# Builds attack strings for a handful of patterns with Onigmo.attack_strings,
+# then times Regexp#match? on each one as the pump count doubles. A ratio
+# near 2 between rows is linear, near 4 is quadratic, and a timeout is worse.
+# Ruby 3.2 and later memoize backtracking for most patterns, so many of
+# these stay linear there even though the interpreter behind Onigmo.profile
+# shows them growing.
+#
+#     ruby -Ilib bench/attack.rb [timeout]
+
+require "onigmo"
+
+timeout = Float(ARGV.fetch(0, 1.0))
+sources = ["(a+)+$", "(a|a)*$", "^(\\w+\\s?)*$", "\\d+\\d+x", "(x+x+)+y", ".*.*=.*", "x(a+)+y", "(a|a)*\\1$"]
+
+sources.each do |source|
+  Onigmo.attack_strings(source, length: 40).each do |attack|
+    puts format("%-16s %-24s %p + %p * n + %p", source, attack.finding.kind, attack.prefix, attack.pump, attack.suffix)
+
+    previous = nil
+    attack.timings(timeout: timeout).each do |count, seconds|
+      if seconds.nil?
+        puts format("  n=%-8d timeout", count)
+        break
+      end
+
+      ratio = previous ? format("x%.1f", seconds / previous) : ""
+      puts format("  n=%-8d %.6fs %s", count, seconds, ratio)
+      previous = seconds
+    end
+  end
+end
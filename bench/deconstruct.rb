@@ -0,0 +1,25 @@
+# frozen_string_literal: true
+
+# Compares pattern matching against a 10k-branch alternation using the
+# key-aware deconstruct_keys with matching against the fully converted hash,
+# which is what deconstruct_keys used to return.
+#
+#     ruby -Ilib bench/deconstruct.rb
+
+require "benchmark"
+require "onigmo"
+
+node = Onigmo.parse(Array.new(10_000) { |index| "branch#{index}" }.join("|"))
+visitor = Onigmo::DeconstructVisitor.new
+iterations = 100
+
+def find_last(deconstructed)
+  case deconstructed
+  in { nodes: [*, { value: "branch9999" }] } then :found
+  end
+end
+
+Benchmark.bm(20) do |x|
+  x.report("deconstruct_keys") { iterations.times { find_last(node) } }
+  x.report("converted hash") { iterations.times { find_last(node.accept(visitor)) } }
+end
@@ -0,0 +1,26 @@
+# frozen_string_literal: true
+
+# Deduplicates a corpus of 100k parsed patterns, written in a handful of
+# equivalent spellings, using the native structural hash and comparing it
+# against keying on the JSON of each tree.
+#
+#     ruby -Ilib bench/hash.rb [count]
+
+require "benchmark"
+require "json"
+require "onigmo"
+
+count = Integer(ARGV.fetch(0, 100_000))
+spellings = ["\\x61", "a", "[a]"]
+trees =
+  count.times.map do |index|
+    Onigmo.parse("#{spellings[index % spellings.size]}b(?:c|d#{index % 1_000})+\\d{2,3}[\\u3042-\\u3093]")
+  end
+
+Benchmark.bm(16) do |x|
+  x.report("uniq (first)") { trees.uniq }
+  x.report("uniq (memoized)") { trees.uniq }
+  x.report("uniq by to_json") { trees.uniq(&:to_json) }
+end
+
+puts "#{trees.uniq.size} distinct trees"
@@ -0,0 +1,33 @@
+# frozen_string_literal: true
+
+# Parses a corpus of patterns that repeat the same fragments, with and without
+# an Onigmo::Interner, and reports how many objects the resulting trees keep
+# alive along with the interner's own estimates.
+#
+#     ruby -Ilib bench/interner.rb [count]
+
+require "benchmark"
+require "onigmo"
+
+count = Integer(ARGV.fetch(0, 20_000))
+fragments = ["[0-9]+", "\\s*", "[a-z0-9._%+-]+@[a-z0-9-]+\\.[a-z]{2,}", "\\h{8}-\\h{4}-\\h{4}-\\h{4}-\\h{12}"]
+corpus = count.times.map { |index| "id#{index % 500}:#{fragments.rotate(index % fragments.size).join}" }
+
+def live_objects
+  GC.start
+  ObjectSpace.count_objects[:TOTAL] - ObjectSpace.count_objects[:FREE]
+end
+
+interner = Onigmo::Interner.new
+results = {}
+
+[["plain", {}], ["interned", { interner: interner }]].each do |label, options|
+  before = live_objects
+  trees = nil
+  seconds = Benchmark.realtime { trees = corpus.map { |source| Onigmo.parse(source, **options) } }
+  results[label] = trees
+
+  puts format("%-10s %10.4fs %10d live objects", label, seconds, live_objects - before)
+end
+
+puts interner.stats
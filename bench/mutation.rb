@@ -0,0 +1,55 @@
+# frozen_string_literal: true
+
+# Replaces one leaf of a tree of about 100k nodes with a MutationVisitor,
+# which only rebuilds the path from that leaf to the root, and compares it
+# against a deep copy that rebuilds every node. Reports the time and the
+# objects allocated for each.
+#
+#     ruby -Ilib bench/mutation.rb
+
+require "benchmark"
+require "onigmo"
+
+# A balanced tree of atomic groups over 2^15 strings.
+def source(depth, prefix = "")
+  return "s#{prefix}" if depth == 0
+
+  "(?>#{source(depth - 1, "#{prefix}0")}|#{source(depth - 1, "#{prefix}1")})"
+end
+
+class ReplaceVisitor < Onigmo::MutationVisitor
+  def initialize(target)
+    @target = target
+  end
+
+  def visit_string_node(node)
+    node.value == @target ? node.copy(value: "replaced") : node
+  end
+end
+
+class DeepCopyVisitor < Onigmo::MutationVisitor
+  def visit_alternation_node(node)
+    node.copy(nodes: node.nodes.map { |child_node| visit(child_node) })
+  end
+
+  def visit_enclose_stop_backtrack_node(node)
+    node.copy(node: visit(node.node))
+  end
+
+  def visit_string_node(node)
+    node.copy
+  end
+end
+
+tree = Onigmo.parse(source(15))
+target = "s#{"01" * 7}0"
+puts "#{tree.each_node.count} nodes"
+
+[["mutation", ReplaceVisitor.new(target)], ["deep copy", DeepCopyVisitor.new]].each do |label, visitor|
+  GC.start
+  before = GC.stat(:total_allocated_objects)
+  seconds = Benchmark.realtime { tree.accept(visitor) }
+  allocations = GC.stat(:total_allocated_objects) - before
+
+  puts format("%-10s %10.4fs %10d allocations", label, seconds, allocations)
+end
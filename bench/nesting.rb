@@ -0,0 +1,42 @@
+# frozen_string_literal: true
+
+# Compares building and walking deeply nested trees iteratively against doing
+# the same recursively, for nesting depths from 10 to 100k.
+#
+#     ruby -Ilib bench/nesting.rb
+
+require "benchmark"
+require "onigmo"
+
+# Builds a lazy tree all the way down by recursing through child_nodes, which
+# is how the tree used to be built.
+def build_recursive(node)
+  node.child_nodes.each { |child_node| build_recursive(child_node) }
+end
+
+def walk_recursive(node, &block)
+  yield node
+  node.child_nodes.each { |child_node| walk_recursive(child_node, &block) }
+end
+
+def measure
+  Benchmark.realtime { yield }.then { |seconds| format("%10.4fs", seconds) }
+rescue SystemStackError
+  format("%11s", "overflow")
+end
+
+puts format("%8s %11s %11s %11s %11s", "depth", "build", "build (rec)", "each_node", "walk (rec)")
+
+[10, 100, 1_000, 10_000, 100_000].each do |depth|
+  source = "a#{"{1,2}" * depth}"
+  node = Onigmo.parse(source)
+
+  puts format(
+    "%8d %s %s %s %s",
+    depth,
+    measure { Onigmo.parse(source) },
+    measure { build_recursive(Onigmo.parse(source, lazy: true)) },
+    measure { node.each_node { nil } },
+    measure { walk_recursive(node) { nil } }
+  )
+end
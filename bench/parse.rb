@@ -0,0 +1,30 @@
+# frozen_string_literal: true
+
+# Parses a corpus of patterns and reports throughput along with the number of
+# objects allocated per parse.
+#
+#     ruby -Ilib bench/parse.rb [iterations]
+
+require "benchmark"
+require "onigmo"
+
+iterations = Integer(ARGV.fetch(0, 20))
+corpus =
+  2_000.times.map do |index|
+    "\\A(?<user#{index}>[a-z0-9._%+-]+)@(?:[a-z0-9-]+\\.)+[a-z]{2,}\\z|" \
+      "^\\s*(\\d{1,3})\\.(\\d{1,3})\\b.*?$|(?i:foo|bar)\\w+\\W*\\G\\K(?=x)(?!y)"
+  end
+
+corpus.each { |source| Onigmo.parse(source) }
+
+GC.start
+GC.disable
+before = GC.stat(:total_allocated_objects)
+corpus.each { |source| Onigmo.parse(source) }
+allocations = GC.stat(:total_allocated_objects) - before
+GC.enable
+
+seconds = Benchmark.realtime { iterations.times { corpus.each { |source| Onigmo.parse(source) } } }
+
+puts format("allocations per parse: %.1f", allocations / corpus.size.to_f)
+puts format("parses per second:     %.0f", iterations * corpus.size / seconds)
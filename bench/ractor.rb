@@ -0,0 +1,29 @@
+# frozen_string_literal: true
+
+# Compares parsing and compiling a corpus of patterns on the main Ractor with
+# splitting the same corpus across several Ractors.
+#
+#     ruby -Ilib bench/ractor.rb [ractors]
+
+require "benchmark"
+require "onigmo"
+
+Warning[:experimental] = false
+
+ractors = Integer(ARGV.fetch(0, 4))
+patterns =
+  Ractor.make_shareable(
+    20_000.times.map { |index| "(?<word#{index}>[a-z]+)\\s+(foo|bar|baz#{index}){2,5}\\d*$" }
+  )
+
+Benchmark.bm(12) do |x|
+  x.report("sequential") do
+    patterns.each { |pattern| Onigmo.parse(pattern); Onigmo.compile(pattern) }.size
+  end
+  x.report("ractors x#{ractors}") do
+    patterns
+      .each_slice((patterns.size / ractors.to_f).ceil)
+      .map { |slice| Ractor.new(Ractor.make_shareable(slice)) { |slice| slice.each { |pattern| Onigmo.parse(pattern); Onigmo.compile(pattern) }.size } }
+      .sum(&:take)
+  end
+end
@@ -0,0 +1,18 @@
+# frozen_string_literal: true
+
+# Runs Onigmo.analyze_redos over a corpus of patterns, roughly what an
+# application would do if it checked every regex it loads at boot.
+#
+#     ruby -Ilib bench/redos.rb [count]
+
+require "benchmark"
+require "onigmo"
+
+count = Integer(ARGV.fetch(0, 2_000))
+fragments = ["(a+)+", "[0-9]+", "\\s*", "(\\w+\\s?)*", "[a-z0-9._%+-]+@[a-z0-9-]+\\.[a-z]{2,}", "(ab|ac)*", "\\h{8}-\\h{4}"]
+corpus = count.times.map { |index| "id#{index}:#{fragments.rotate(index % fragments.size).first(4).join}" }
+
+findings = 0
+seconds = Benchmark.realtime { corpus.each { |source| findings += Onigmo.analyze_redos(source).size } }
+
+puts format("%d patterns in %.4fs (%.0f patterns/s), %d findings", count, seconds, count / seconds, findings)
@@ -0,0 +1,62 @@
+# frozen_string_literal: true
+
+# Visits every node of a corpus of parsed patterns with a visitor that only
+# overrides visit_string_node, comparing the native traversal against calling
+# accept on each element of child_nodes, which is how Visitor used to descend.
+# Also reports the objects allocated per visit.
+#
+#     ruby -Ilib bench/visit.rb [iterations]
+
+require "benchmark"
+require "onigmo"
+
+class CountingVisitor < Onigmo::Visitor
+  attr_reader :count
+
+  def initialize
+    @count = 0
+  end
+
+  def visit_string_node(node)
+    @count += 1
+  end
+end
+
+class RubyCountingVisitor < CountingVisitor
+  (Onigmo::Visitor.instance_methods(false).grep(/\Avisit_\w+_node\z/) - [:visit_string_node]).each do |name|
+    define_method(name) { |node| node.child_nodes.each { |child_node| child_node.accept(self) } }
+  end
+end
+
+iterations = Integer(ARGV.fetch(0, 20))
+trees =
+  2_000.times.map do |index|
+    Onigmo.parse(
+      "\\A(?<user#{index}>[a-z0-9._%+-]+)@(?:[a-z0-9-]+\\.)+[a-z]{2,}\\z|" \
+        "^\\s*(\\d{1,3})\\.(\\d{1,3})\\b.*?$|(?i:foo|bar)\\w+\\W*\\G\\K(?=x)(?!y)"
+    )
+  end
+
+def allocations(trees, visitor)
+  trees.each { |tree| tree.accept(visitor) }
+
+  GC.start
+  GC.disable
+  before = GC.stat(:total_allocated_objects)
+  trees.each { |tree| tree.accept(visitor) }
+  (GC.stat(:total_allocated_objects) - before) / trees.size.to_f
+ensure
+  GC.enable
+end
+
+[["native", CountingVisitor], ["child_nodes", RubyCountingVisitor]].each do |label, visitor_class|
+  visitor = visitor_class.new
+  seconds = Benchmark.realtime { iterations.times { trees.each { |tree| tree.accept(visitor) } } }
+
+  puts format(
+    "%-12s %10.0f visits/s %8.1f allocations/visit",
+    label,
+    iterations * trees.size / seconds,
+    allocations(trees, visitor_class.new)
+  )
+end
@@ -3,5 +3,8 @@
 require "mkmf"
 
 append_cflags("-Wno-missing-noreturn")
+have_header("pthread.h")
+have_header("sys/mman.h")
+have_func("rb_ext_ractor_safe", "ruby.h")
 
 create_makefile("onigmo/onigmo")
@@ -1,6 +1,19 @@
 #include <ruby.h>
 #include <ruby/onigmo.h>
 #include <ruby/encoding.h>
+#include <ruby/thread.h>
+#include <ruby/ractor.h>
+#include <ruby/atomic.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#include <unistd.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include "regint.h"
 #include "regparse.h"
@@ -35,10 +48,88 @@ VALUE rb_cOnigmoQuantifierNode;
 VALUE rb_cOnigmoStringNode;
 VALUE rb_cOnigmoWordNode;
 VALUE rb_cOnigmoWordInvertNode;
+VALUE rb_cOnigmoCodepointRangeSet;
+VALUE rb_cOnigmoTree;
+VALUE rb_cOnigmoProgram;
+VALUE rb_cOnigmoFlatTree;
+VALUE rb_cOnigmoMappedFile;
+VALUE rb_cOnigmoWalkEvent;
+VALUE rb_cOnigmoVisitor;
+VALUE rb_cOnigmoRedosFinding;
+VALUE rb_cOnigmoProfile;
+VALUE rb_cOnigmoSafeRegex;
+VALUE rb_eOnigmoBudgetExceeded;
+VALUE rb_eOnigmoUnsupportedPattern;
+
+// Codes for each kind of node in a flat tree. The order here matches the
+// order of Onigmo::FlatTree::TYPES, which is built from the same classes.
+typedef enum {
+    FLAT_ALTERNATION,
+    FLAT_ANCHOR_BUFFER_BEGIN,
+    FLAT_ANCHOR_BUFFER_END,
+    FLAT_ANCHOR_KEEP,
+    FLAT_ANCHOR_LINE_BEGIN,
+    FLAT_ANCHOR_LINE_END,
+    FLAT_ANCHOR_POSITION_BEGIN,
+    FLAT_ANCHOR_SEMI_END,
+    FLAT_ANCHOR_WORD_BOUNDARY,
+    FLAT_ANCHOR_WORD_BOUNDARY_INVERT,
+    FLAT_ANY,
+    FLAT_BACKREF,
+    FLAT_CALL,
+    FLAT_CCLASS,
+    FLAT_CCLASS_INVERT,
+    FLAT_ENCLOSE_ABSENT,
+    FLAT_ENCLOSE_CONDITION,
+    FLAT_ENCLOSE_MEMORY,
+    FLAT_ENCLOSE_OPTIONS,
+    FLAT_ENCLOSE_STOP_BACKTRACK,
+    FLAT_LIST,
+    FLAT_LOOK_AHEAD,
+    FLAT_LOOK_AHEAD_INVERT,
+    FLAT_LOOK_BEHIND,
+    FLAT_LOOK_BEHIND_INVERT,
+    FLAT_QUANTIFIER,
+    FLAT_STRING,
+    FLAT_WORD,
+    FLAT_WORD_INVERT,
+    FLAT_TYPE_COUNT
+} flat_type_t;
+
+// Nodes without any fields are frozen singletons, indexed by their type.
+static VALUE leaf_nodes[FLAT_TYPE_COUNT];
+
+// Allocates an object and sets its fields directly rather than calling
+// initialize, in the same order that initialize would so that every instance
+// of a class shares the same shape.
+static VALUE
+build_object(VALUE klass, int count, const ID *names, const VALUE *values) {
+    VALUE object = rb_obj_alloc(klass);
+
+    for (int index = 0; index < count; index++) {
+        rb_ivar_set(object, names[index], values[index]);
+    }
+
+    return object;
+}
+
+// Option arrays are frozen and memoized per bitmask. The pool is a plain
+// Hash, so each Ractor keeps its own.
+static rb_ractor_local_key_t options_pool_key;
 
 static VALUE
 build_options(OnigOptionType option) {
-    VALUE options = rb_ary_new();
+    VALUE pool;
+    if (!rb_ractor_local_storage_value_lookup(options_pool_key, &pool)) {
+        pool = rb_hash_new();
+        rb_ractor_local_storage_value_set(options_pool_key, pool);
+    }
+
+    VALUE key = UINT2NUM(option);
+    VALUE options = rb_hash_lookup2(pool, key, Qundef);
+    if (options != Qundef) return options;
+
+    options = rb_ary_new();
 
     if (option & ONIG_OPTION_NONE) rb_ary_push(options, ID2SYM(rb_intern("none")));
     if (option & ONIG_OPTION_IGNORECASE) rb_ary_push(options, ID2SYM(rb_intern("ignorecase")));
@@ -60,62 +151,120 @@ build_options(OnigOptionType option) {
     if (option & ONIG_OPTION_WORD_BOUND_ALL_RANGE) rb_ary_push(options, ID2SYM(rb_intern("word_bound_all_range")));
     if (option & ONIG_OPTION_NEWLINE_CRLF) rb_ary_push(options, ID2SYM(rb_intern("newline_crlf")));
 
+    rb_hash_aset(pool, key, rb_obj_freeze(options));
     return options;
 }
 
+// Every single byte character of an encoding is allocated once as a frozen
+// string, the first time a class in that encoding is built. The pool is an
+// array indexed by encoding, kept per Ractor like the option pool.
+static rb_ractor_local_key_t characters_pool_key;
+
+static VALUE
+build_characters(OnigEncoding encoding) {
+    VALUE pool;
+    if (!rb_ractor_local_storage_value_lookup(characters_pool_key, &pool)) {
+        pool = rb_ary_new();
+        rb_ractor_local_storage_value_set(characters_pool_key, pool);
+    }
+
+    int encindex = rb_enc_to_index(encoding);
+    VALUE characters = rb_ary_entry(pool, encindex);
+    if (!NIL_P(characters)) return characters;
+
+    characters = rb_ary_new_capa(SINGLE_BYTE_SIZE);
+    for (int index = 0; index < SINGLE_BYTE_SIZE; index++) {
+        const char character = (const char) index;
+        rb_ary_push(characters, rb_obj_freeze(rb_enc_str_new(&character, 1, encoding)));
+    }
+
+    rb_ary_store(pool, encindex, rb_obj_freeze(characters));
+    return characters;
+}
+
 static VALUE
 build_bitset(BitSetRef ref, OnigEncoding encoding) {
+    VALUE characters = build_characters(encoding);
     VALUE values = rb_ary_new();
 
     for (int index = 0; index < SINGLE_BYTE_SIZE; index++) {
         if (BITSET_AT(ref, index) != 0) {
-            const char character = (const char) index;
-            rb_ary_push(values, rb_enc_str_new(&character, 1, encoding));
+            rb_ary_push(values, RARRAY_AREF(characters, index));
         }
     }
 
     return values;
 }
 
+// The multi-byte buffer holds a count followed by inclusive codepoint pairs.
+static VALUE
+build_ranges(BBuf *bbuf) {
+    VALUE pairs = rb_ary_new();
+
+    if (bbuf != NULL) {
+        OnigCodePoint *data = (OnigCodePoint *) bbuf->p;
+        OnigCodePoint *end = (OnigCodePoint *) (bbuf->p + bbuf->used);
+
+        for (++data; data < end; data += 2) {
+            rb_ary_push(pairs, UINT2NUM(data[0]));
+            rb_ary_push(pairs, UINT2NUM(data[1]));
+        }
+    }
+
+    ID names[] = { rb_intern("@pairs") };
+    VALUE values[] = { rb_obj_freeze(pairs) };
+    return build_object(rb_cOnigmoCodepointRangeSet, 1, names, values);
+}
+
+static VALUE build_node(Node *node, OnigEncoding encoding, VALUE tree);
+
+static VALUE
+build_nodes(Node *node, OnigEncoding encoding, VALUE tree) {
+    VALUE nodes = rb_ary_new();
+    rb_ary_push(nodes, build_node(NCAR(node), encoding, tree));
+
+    while (IS_NOT_NULL(node = NCDR(node))) {
+        rb_ary_push(nodes, build_node(NCAR(node), encoding, tree));
+    }
+
+    return rb_obj_freeze(nodes);
+}
+
+// Builds a single node without any of its children, which are attached
+// afterward. Character classes only get their values when not lazy.
 static VALUE
-build_node(Node *node, OnigEncoding encoding) {
+build_node_fields(Node *node, OnigEncoding encoding, VALUE tree) {
     int type = NTYPE(node);
 
     switch (type) {
         case NT_STR: {
             VALUE value = rb_enc_str_new((const char *) NSTR(node)->s, NSTR(node)->end - NSTR(node)->s, encoding);
-            VALUE argv[] = { value };
-            return rb_class_new_instance(1, argv, rb_cOnigmoStringNode);
+            ID names[] = { rb_intern("@value") };
+            VALUE values[] = { value };
+            return build_object(rb_cOnigmoStringNode, 1, names, values);
         }
         case NT_CCLASS: {
             CClassNode* cclass_node = NCCLASS(node);
-            VALUE values = build_bitset(cclass_node->bs, encoding);
-
-            if (cclass_node->mbuf != NULL) {
-                BBuf *bbuf = cclass_node->mbuf;
-                OnigCodePoint *data = (OnigCodePoint *) bbuf->p;
-                OnigCodePoint *end = (OnigCodePoint *) (bbuf->p + bbuf->used);
+            ID names[] = { rb_intern("@characters"), rb_intern("@ranges") };
+            VALUE values[] = { Qnil, Qnil };
 
-                for (++data; data < end; data += 2) {
-                    for (OnigCodePoint code = data[0]; code < data[1]; code++) {
-                        rb_ary_push(values, INT2NUM(code));
-                    }
-                }
+            if (NIL_P(tree)) {
+                values[0] = build_bitset(cclass_node->bs, encoding);
+                values[1] = build_ranges(cclass_node->mbuf);
             }
 
-            VALUE argv[] = { values };
             if (IS_NCCLASS_NOT(cclass_node)) {
-                return rb_class_new_instance(1, argv, rb_cOnigmoCClassInvertNode);
+                return build_object(rb_cOnigmoCClassInvertNode, 2, names, values);
             } else {
-                return rb_class_new_instance(1, argv, rb_cOnigmoCClassNode);
+                return build_object(rb_cOnigmoCClassNode, 2, names, values);
             }
         }
         case NT_CTYPE: {
             if (NCTYPE(node)->ctype == ONIGENC_CTYPE_WORD) {
                 if (NCTYPE(node)->not == 0) {
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoWordNode);
+                    return leaf_nodes[FLAT_WORD];
                 } else {
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoWordInvertNode);
+                    return leaf_nodes[FLAT_WORD_INVERT];
                 }
             } else {
                 RUBY_ASSERT("unknown ctype");
@@ -123,56 +272,60 @@ build_node(Node *node, OnigEncoding encoding) {
             }
         }
         case NT_CANY: {
-            return rb_class_new_instance(0, NULL, rb_cOnigmoAnyNode);
+            return leaf_nodes[FLAT_ANY];
         }
         case NT_BREF: {
             BRefNode *backref_node = NBREF(node);   
             int *backrefs = BACKREFS_P(backref_node);
 
-            VALUE values = rb_ary_new();
+            VALUE backref_values = rb_ary_new_capa(backref_node->back_num);
             for (int index = 0; index < backref_node->back_num; index++) {
-                rb_ary_push(values, INT2NUM(backrefs[index]));
+                rb_ary_push(backref_values, INT2NUM(backrefs[index]));
             }
 
-            VALUE argv[] = { values };
-            return rb_class_new_instance(1, argv, rb_cOnigmoBackrefNode);
+            ID names[] = { rb_intern("@values") };
+            VALUE values[] = { backref_values };
+            return build_object(rb_cOnigmoBackrefNode, 1, names, values);
         }
         case NT_QTFR: {
             int lower = NQTFR(node)->lower;
             int upper = NQTFR(node)->upper;
 
-            VALUE argv[] = {
+            ID names[] = { rb_intern("@lower"), rb_intern("@upper"), rb_intern("@greedy"), rb_intern("@node") };
+            VALUE values[] = {
                 lower == -1 ? Qnil : INT2NUM(lower),
-                upper = -1 ? Qnil : INT2NUM(upper),
+                upper == -1 ? Qnil : INT2NUM(upper),
                 (NQTFR(node)->greedy ? Qtrue : Qfalse),
-                build_node(NQTFR(node)->target, encoding)
+                Qnil
             };
 
-            return rb_class_new_instance(4, argv, rb_cOnigmoQuantifierNode);
+            return build_object(rb_cOnigmoQuantifierNode, 4, names, values);
         }
         case NT_ENCLOSE: {
-            VALUE target = build_node(NENCLOSE(node)->target, encoding);
+            ID number_names[] = { rb_intern("@number"), rb_intern("@node") };
+            ID node_names[] = { rb_intern("@node") };
 
             switch (NENCLOSE(node)->type) {
                 case ENCLOSE_OPTION: {
-                    VALUE argv[] = { build_options(NENCLOSE(node)->option), target };
-                    return rb_class_new_instance(2, argv, rb_cOnigmoEncloseOptionsNode);
+                    ID names[] = { rb_intern("@options"), rb_intern("@node") };
+                    VALUE values[] = { build_options(NENCLOSE(node)->option), Qnil };
+                    return build_object(rb_cOnigmoEncloseOptionsNode, 2, names, values);
                 }
                 case ENCLOSE_MEMORY: {
-                    VALUE argv[] = { INT2NUM(NENCLOSE(node)->regnum), target };
-                    return rb_class_new_instance(2, argv, rb_cOnigmoEncloseMemoryNode);
+                    VALUE values[] = { INT2NUM(NENCLOSE(node)->regnum), Qnil };
+                    return build_object(rb_cOnigmoEncloseMemoryNode, 2, number_names, values);
                 }
                 case ENCLOSE_STOP_BACKTRACK: {
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoEncloseStopBacktrackNode);
+                    VALUE values[] = { Qnil };
+                    return build_object(rb_cOnigmoEncloseStopBacktrackNode, 1, node_names, values);
                 }
                 case ENCLOSE_CONDITION: {
-                    VALUE argv[] = { INT2NUM(NENCLOSE(node)->regnum), target };
-                    return rb_class_new_instance(2, argv, rb_cOnigmoEncloseConditionNode);
+                    VALUE values[] = { INT2NUM(NENCLOSE(node)->regnum), Qnil };
+                    return build_object(rb_cOnigmoEncloseConditionNode, 2, number_names, values);
                 }
                 case ENCLOSE_ABSENT: {
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoEncloseAbsentNode);
+                    VALUE values[] = { Qnil };
+                    return build_object(rb_cOnigmoEncloseAbsentNode, 1, node_names, values);
                 }
                 default:
                     RUBY_ASSERT("unknown enclose type");
@@ -180,73 +333,50 @@ build_node(Node *node, OnigEncoding encoding) {
             }
         }
         case NT_ANCHOR: {
+            ID names[] = { rb_intern("@node") };
+            VALUE values[] = { Qnil };
+
             switch (NANCHOR(node)->type) {
                 case ANCHOR_BEGIN_BUF:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorBufferBeginNode);
+                    return leaf_nodes[FLAT_ANCHOR_BUFFER_BEGIN];
                 case ANCHOR_END_BUF:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorBufferEndNode);
+                    return leaf_nodes[FLAT_ANCHOR_BUFFER_END];
                 case ANCHOR_BEGIN_LINE:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorLineBeginNode);
+                    return leaf_nodes[FLAT_ANCHOR_LINE_BEGIN];
                 case ANCHOR_END_LINE:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorLineEndNode);
+                    return leaf_nodes[FLAT_ANCHOR_LINE_END];
                 case ANCHOR_SEMI_END_BUF:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorSemiEndNode);
+                    return leaf_nodes[FLAT_ANCHOR_SEMI_END];
                 case ANCHOR_BEGIN_POSITION:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorPositionBeginNode);
+                    return leaf_nodes[FLAT_ANCHOR_POSITION_BEGIN];
                 case ANCHOR_WORD_BOUND:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorWordBoundaryNode);
+                    return leaf_nodes[FLAT_ANCHOR_WORD_BOUNDARY];
                 case ANCHOR_NOT_WORD_BOUND:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorWordBoundaryInvertNode);
-                case ANCHOR_PREC_READ: {
-                    VALUE target = build_node(NANCHOR(node)->target, encoding);
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoLookAheadNode);
-                }
-                case ANCHOR_PREC_READ_NOT: {
-                    VALUE target = build_node(NANCHOR(node)->target, encoding);
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoLookAheadInvertNode);
-                }
-                case ANCHOR_LOOK_BEHIND: {
-                    VALUE target = build_node(NANCHOR(node)->target, encoding);
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoLookBehindNode);
-                }
-                case ANCHOR_LOOK_BEHIND_NOT: {
-                    VALUE target = build_node(NANCHOR(node)->target, encoding);
-                    VALUE argv[] = { target };
-                    return rb_class_new_instance(1, argv, rb_cOnigmoLookBehindInvertNode);
-                }
+                    return leaf_nodes[FLAT_ANCHOR_WORD_BOUNDARY_INVERT];
+                case ANCHOR_PREC_READ:
+                    return build_object(rb_cOnigmoLookAheadNode, 1, names, values);
+                case ANCHOR_PREC_READ_NOT:
+                    return build_object(rb_cOnigmoLookAheadInvertNode, 1, names, values);
+                case ANCHOR_LOOK_BEHIND:
+                    return build_object(rb_cOnigmoLookBehindNode, 1, names, values);
+                case ANCHOR_LOOK_BEHIND_NOT:
+                    return build_object(rb_cOnigmoLookBehindInvertNode, 1, names, values);
                 case ANCHOR_KEEP:
-                    return rb_class_new_instance(0, NULL, rb_cOnigmoAnchorKeepNode);
+                    return leaf_nodes[FLAT_ANCHOR_KEEP];
                 default:
                     RUBY_ASSERT("unknown anchor type");
                     return Qnil;
             }
         }
         case NT_LIST: {
-            VALUE nodes = rb_ary_new();
-            rb_ary_push(nodes, build_node(NCAR(node), encoding));
-
-            while (IS_NOT_NULL(node = NCDR(node))) {
-                RUBY_ASSERT(NTYPE(node) == type);
-                rb_ary_push(nodes, build_node(NCAR(node), encoding));
-            }
-
-            VALUE argv[] = { nodes };
-            return rb_class_new_instance(1, argv, rb_cOnigmoListNode);
+            ID names[] = { rb_intern("@nodes") };
+            VALUE values[] = { Qnil };
+            return build_object(rb_cOnigmoListNode, 1, names, values);
         }
         case NT_ALT: {
-            VALUE nodes = rb_ary_new();
-            rb_ary_push(nodes, build_node(NCAR(node), encoding));
-
-            while (IS_NOT_NULL(node = NCDR(node))) {
-                RUBY_ASSERT(NTYPE(node) == type);
-                rb_ary_push(nodes, build_node(NCAR(node), encoding));
-            }
-
-            VALUE argv[] = { nodes };
-            return rb_class_new_instance(1, argv, rb_cOnigmoAlternationNode);
+            ID names[] = { rb_intern("@nodes") };
+            VALUE values[] = { Qnil };
+            return build_object(rb_cOnigmoAlternationNode, 1, names, values);
         }
         case NT_CALL: {
             CallNode *call_node = NCALL(node);
@@ -260,8 +390,9 @@ build_node(Node *node, OnigEncoding encoding) {
                 name = Qnil;
             }
 
-            VALUE argv[] = { INT2NUM(call_node->group_num), name };
-            return rb_class_new_instance(2, argv, rb_cOnigmoCallNode);
+            ID names[] = { rb_intern("@number"), rb_intern("@name") };
+            VALUE values[] = { INT2NUM(call_node->group_num), name };
+            return build_object(rb_cOnigmoCallNode, 2, names, values);
         }
         default: {
             RUBY_ASSERT("unknown node type");
@@ -270,689 +401,4857 @@ build_node(Node *node, OnigEncoding encoding) {
     }
 }
 
+// Owns the native tree for nodes returned from a lazy parse. Nodes that have
+// not built their children yet hold on to this object and a handle, which is
+// an index into the list of native nodes that have been handed out.
+typedef struct {
+    regex_t *regex;
+    Node *root;
+    VALUE source;
+    const OnigUChar *pattern;
+    long pattern_length;
+    size_t node_count;
+    Node **handles;
+    long handles_size;
+    long handles_capa;
+} parse_tree_t;
+
 static void
-fail(int result, regex_t *regex, OnigErrorInfo *einfo) {
-    OnigUChar message[ONIG_MAX_ERROR_MESSAGE_LEN];
-    onig_error_code_to_str(message, result, einfo);
+parse_tree_mark(void *data) {
+    rb_gc_mark(((parse_tree_t *) data)->source);
+}
 
-    onig_free(regex);
-    onig_end();
+static void
+parse_tree_free(void *data) {
+    parse_tree_t *parse_tree = (parse_tree_t *) data;
 
-    rb_raise(rb_eArgError, "%s", message);
+    if (parse_tree->root != NULL) onig_node_free(parse_tree->root);
+    if (parse_tree->regex != NULL) onig_free(parse_tree->regex);
+
+    if (NIL_P(parse_tree->source)) xfree((void *) parse_tree->pattern);
+    xfree(parse_tree->handles);
+    xfree(parse_tree);
 }
 
-static VALUE
-parse(VALUE self, VALUE string) {
-    const OnigUChar *pattern = (const OnigUChar *) StringValueCStr(string); 
-    const OnigUChar *pattern_end = pattern + strlen((const char *) pattern);
+static size_t
+parse_tree_memsize(const void *data) {
+    const parse_tree_t *parse_tree = (const parse_tree_t *) data;
 
-    regex_t *regex = calloc(1, sizeof(regex_t));
-    if (regex == NULL) {
-        rb_raise(rb_eNoMemError, "failed to allocate memory");
-        return Qnil;
-    }
+    return (
+        sizeof(parse_tree_t) +
+        (parse_tree->regex != NULL ? onig_memsize(parse_tree->regex) : 0) +
+        (parse_tree->node_count * sizeof(Node)) +
+        (parse_tree->handles_capa * sizeof(Node *)) +
+        (NIL_P(parse_tree->source) ? parse_tree->pattern_length : 0)
+    );
+}
 
-    int result;
-    OnigEncoding encoding = rb_enc_get(string);
+static const rb_data_type_t parse_tree_type = {
+    .wrap_struct_name = "Onigmo::Tree",
+    .function = {
+        .dmark = parse_tree_mark,
+        .dfree = parse_tree_free,
+        .dsize = parse_tree_memsize
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-    if ((result = onig_reg_init(regex, ONIG_OPTION_DEFAULT, ONIGENC_CASE_FOLD_DEFAULT, encoding, ONIG_SYNTAX_DEFAULT)) != ONIG_NORMAL) {
-        fail(result, regex, NULL);
-        return Qnil;
-    }
+static size_t
+count_nodes(Node *node) {
+    if (node == NULL) return 0;
 
-    OnigDistance init_size = (pattern_end - pattern) * 2;
-    result = BBUF_INIT(regex, init_size);
+    switch (NTYPE(node)) {
+        case NT_QTFR:
+            return 1 + count_nodes(NQTFR(node)->target);
+        case NT_ENCLOSE:
+            return 1 + count_nodes(NENCLOSE(node)->target);
+        case NT_ANCHOR:
+            return 1 + count_nodes(NANCHOR(node)->target);
+        case NT_LIST:
+        case NT_ALT:
+            return 1 + count_nodes(NCAR(node)) + count_nodes(NCDR(node));
+        default:
+            return 1;
+    }
+}
 
-    if (result != ONIG_NORMAL) {
-        fail(result, regex, NULL);
-        return Qnil;
+static bool
+has_children(Node *node) {
+    switch (NTYPE(node)) {
+        case NT_CCLASS:
+        case NT_QTFR:
+        case NT_ENCLOSE:
+        case NT_LIST:
+        case NT_ALT:
+            return true;
+        case NT_ANCHOR:
+            return NANCHOR(node)->target != NULL;
+        default:
+            return false;
     }
+}
 
+// A node that still has to be built, along with where to attach it: either
+// appended to an array of siblings or set as the single child of a node. The
+// array of siblings is frozen once the last of them is appended.
+typedef struct {
+    Node *node;
+    VALUE owner;
+    bool append;
+    bool last;
+} build_frame_t;
+
+typedef struct {
     Node *root;
-    ScanEnv scan_env = { 0 };
+    OnigEncoding encoding;
+    build_frame_t *frames;
+} build_tree_t;
 
-    result = onig_parse_make_tree(&root, pattern, pattern_end, regex, &scan_env);
-    if (result != ONIG_NORMAL) {
-        fail(result, regex, NULL);
-        return Qnil;
-    }
+// Builds a whole tree with an explicit stack instead of recursion, so that
+// deeply nested patterns cannot exhaust the C stack. Each object is attached
+// to its parent as soon as it is built, which keeps everything still on the
+// stack reachable from the root.
+static VALUE
+build_tree_run(VALUE data) {
+    build_tree_t *build_tree = (build_tree_t *) data;
+    OnigEncoding encoding = build_tree->encoding;
 
-    VALUE node = build_node(root, encoding);
+    long size = 0;
+    long capa = 16;
+    build_frame_t *frames = build_tree->frames = ALLOC_N(build_frame_t, capa);
+    frames[size++] = (build_frame_t) { .node = build_tree->root, .owner = Qnil };
 
-    onig_node_free(root);
-    onig_free(regex);
-    onig_end();
+    VALUE result = Qnil;
+
+    while (size > 0) {
+        build_frame_t frame = frames[--size];
+        VALUE object = build_node_fields(frame.node, encoding, Qnil);
+
+        if (NIL_P(frame.owner)) {
+            result = object;
+        } else if (frame.append) {
+            rb_ary_push(frame.owner, object);
+            if (frame.last) rb_obj_freeze(frame.owner);
+        } else {
+            rb_ivar_set(frame.owner, rb_intern("@node"), object);
+        }
+
+        Node *node = frame.node;
+        Node *target = NULL;
+
+        switch (NTYPE(node)) {
+            case NT_QTFR:
+                target = NQTFR(node)->target;
+                break;
+            case NT_ENCLOSE:
+                target = NENCLOSE(node)->target;
+                break;
+            case NT_ANCHOR:
+                target = NANCHOR(node)->target;
+                break;
+            case NT_LIST:
+            case NT_ALT: {
+                long count = 0;
+                for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) count++;
+
+                if (size + count > capa) {
+                    while (size + count > capa) capa *= 2;
+                    REALLOC_N(frames, build_frame_t, capa);
+                    build_tree->frames = frames;
+                }
+
+                // Siblings are pushed in reverse so that they pop in order.
+                VALUE nodes = rb_ary_new_capa(count);
+                rb_ivar_set(object, rb_intern("@nodes"), nodes);
+
+                long index = size + count;
+                for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                    frames[--index] = (build_frame_t) { .node = NCAR(cursor), .owner = nodes, .append = true, .last = IS_NULL(NCDR(cursor)) };
+                }
+
+                size += count;
+                break;
+            }
+        }
+
+        if (target != NULL) {
+            if (size == capa) {
+                REALLOC_N(frames, build_frame_t, capa *= 2);
+                build_tree->frames = frames;
+            }
+            frames[size++] = (build_frame_t) { .node = target, .owner = object, .append = false };
+        }
+    }
 
-    return node;
+    RB_GC_GUARD(result);
+    return result;
 }
 
+// Frees the frames even when building a node raises.
 static VALUE
-read_memnum(const unsigned char **cursor) {
-    MemNumType memnum = *((MemNumType *) *cursor);
-    *cursor += SIZE_MEMNUM;
-    return INT2NUM(memnum);
+build_tree_free(VALUE data) {
+    xfree(((build_tree_t *) data)->frames);
+    return Qnil;
 }
 
 static VALUE
-read_reladdr(const unsigned char **cursor) {
-    RelAddrType address;
-    GET_RELADDR_INC(address, *cursor);
-    return INT2NUM(address);
+build_tree(Node *root, OnigEncoding encoding) {
+    build_tree_t build_tree = { .root = root, .encoding = encoding };
+    return rb_ensure(build_tree_run, (VALUE) &build_tree, build_tree_free, (VALUE) &build_tree);
 }
 
 static VALUE
-read_absaddr(const unsigned char **cursor) {
-    AbsAddrType address;
-    GET_ABSADDR_INC(address, *cursor);
-    return INT2NUM(address);
+build_node(Node *node, OnigEncoding encoding, VALUE tree) {
+    if (NIL_P(tree)) return build_tree(node, encoding);
+
+    VALUE object = build_node_fields(node, encoding, tree);
+
+    if (has_children(node)) {
+        parse_tree_t *parse_tree;
+        TypedData_Get_Struct(tree, parse_tree_t, &parse_tree_type, parse_tree);
+
+        if (parse_tree->handles_size == parse_tree->handles_capa) {
+            parse_tree->handles_capa = parse_tree->handles_capa == 0 ? 16 : parse_tree->handles_capa * 2;
+            REALLOC_N(parse_tree->handles, Node *, parse_tree->handles_capa);
+        }
+
+        rb_ivar_set(object, rb_intern("@tree"), tree);
+        rb_ivar_set(object, rb_intern("@handle"), LONG2NUM(parse_tree->handles_size));
+        parse_tree->handles[parse_tree->handles_size++] = node;
+    }
+
+    return object;
 }
 
 static VALUE
-read_exact(const unsigned char **cursor, int length, OnigEncoding encoding) {
-    VALUE exact = rb_enc_str_new((const char *) *cursor, length, encoding);
-    *cursor += length;
-    return exact;
+node_load_children(VALUE self) {
+    VALUE tree = rb_ivar_get(self, rb_intern("@tree"));
+    if (NIL_P(tree)) return self;
+
+    parse_tree_t *parse_tree;
+    TypedData_Get_Struct(tree, parse_tree_t, &parse_tree_type, parse_tree);
+
+    long handle = NUM2LONG(rb_ivar_get(self, rb_intern("@handle")));
+    if (handle < 0 || handle >= parse_tree->handles_size) {
+        rb_raise(rb_eIndexError, "invalid node handle %ld", handle);
+    }
+
+    Node *node = parse_tree->handles[handle];
+    OnigEncoding encoding = parse_tree->regex->enc;
+
+    switch (NTYPE(node)) {
+        case NT_CCLASS:
+            rb_ivar_set(self, rb_intern("@characters"), build_bitset(NCCLASS(node)->bs, encoding));
+            rb_ivar_set(self, rb_intern("@ranges"), build_ranges(NCCLASS(node)->mbuf));
+            break;
+        case NT_QTFR:
+            rb_ivar_set(self, rb_intern("@node"), build_node(NQTFR(node)->target, encoding, tree));
+            break;
+        case NT_ENCLOSE:
+            rb_ivar_set(self, rb_intern("@node"), build_node(NENCLOSE(node)->target, encoding, tree));
+            break;
+        case NT_ANCHOR:
+            rb_ivar_set(self, rb_intern("@node"), build_node(NANCHOR(node)->target, encoding, tree));
+            break;
+        case NT_LIST:
+        case NT_ALT:
+            rb_ivar_set(self, rb_intern("@nodes"), build_nodes(node, encoding, tree));
+            break;
+    }
+
+    // Once loaded the node is indistinguishable from an eagerly built one.
+    rb_obj_remove_instance_variable(self, ID2SYM(rb_intern("@tree")));
+    rb_obj_remove_instance_variable(self, ID2SYM(rb_intern("@handle")));
+    return self;
 }
 
-static VALUE
-read_length(const unsigned char **cursor) {
-    LengthType length;
-    GET_LENGTH_INC(length, *cursor);
-    return INT2NUM(length);
+static void
+fail(int result, regex_t *regex, OnigErrorInfo *einfo) {
+    OnigUChar message[ONIG_MAX_ERROR_MESSAGE_LEN];
+    onig_error_code_to_str(message, result, einfo);
+
+    onig_free(regex);
+
+    rb_raise(rb_eArgError, "%s", message);
 }
 
-static VALUE
-read_bitset(const unsigned char **cursor, OnigEncoding encoding) {
-    VALUE bitset = build_bitset((BitSetRef) (*cursor), encoding);
-    *cursor += SIZE_BITSET;
-    return bitset;
+// Some errors from onig_parse_make_tree include part of the pattern in their
+// message, like the name in an undefined name reference, which the scan
+// environment points at.
+static OnigErrorInfo
+parse_error_info(const ScanEnv *scan_env) {
+    return (OnigErrorInfo) { .enc = scan_env->enc, .par = scan_env->error, .par_end = scan_env->error_end };
 }
 
-static VALUE
-read_option(const unsigned char **cursor) {
-    OnigOptionType option = *((OnigOptionType *) cursor);
-	*cursor += SIZE_OPTION;
-    return build_options(option);
+// Frozen strings whose bytes live outside of the object slot can neither be
+// mutated nor moved by compaction, so their bytes can be borrowed for as long
+// as the string itself is kept alive instead of being copied.
+static bool
+pattern_borrowable(VALUE string) {
+    return OBJ_FROZEN(string) && RB_FL_TEST_RAW(string, RSTRING_NOEMBED);
 }
 
+// Both parse and compile accept either a String or a Regexp. For a Regexp the
+// source, encoding and options all come from the Regexp itself.
 static VALUE
-read_state_check(const unsigned char **cursor) {
-    StateCheckNumType state_check = *((StateCheckNumType *) cursor);
-    *cursor += SIZE_STATE_CHECK_NUM;
-    return INT2NUM(state_check);
+resolve_source(VALUE source, OnigEncoding *encoding, OnigOptionType *options) {
+    if (RB_TYPE_P(source, T_REGEXP)) {
+        *encoding = rb_enc_get(source);
+        *options = rb_reg_options(source) & (ONIG_OPTION_IGNORECASE | ONIG_OPTION_EXTEND | ONIG_OPTION_MULTILINE);
+        return RREGEXP_SRC(source);
+    }
+
+    StringValue(source);
+    *encoding = rb_enc_get(source);
+    *options = ONIG_OPTION_DEFAULT;
+    return source;
 }
 
-static VALUE
-read_codepoint(const unsigned char **cursor, LengthType length) {
-    const unsigned char *buffer = *cursor;
+// An opt-in, process-wide cache of frozen parse and compile results. Entries
+// live in an insertion-ordered Hash, so the least recently used entry is
+// always the first one. A limit of 0 (the default) disables the cache. The
+// Hash is not safe to share, so it is only used from the main Ractor.
+typedef enum {
+    CACHE_KIND_PARSE,
+    CACHE_KIND_COMPILE
+} cache_kind_t;
 
-#ifndef PLATFORM_UNALIGNED_WORD_ACCESS
-    ALIGNMENT_RIGHT(buffer);
-#endif
+static VALUE cache_entries;
+static rb_ractor_local_key_t cache_ractor_key;
+static size_t cache_limit;
+static size_t cache_bytes;
+static size_t cache_hits;
+static size_t cache_misses;
+static size_t cache_evictions;
 
-    OnigCodePoint code = *((OnigCodePoint *) buffer);
-    *cursor += length;
+static size_t cache_freeze(VALUE object);
+static long node_digest(VALUE root);
+static VALUE interner_intern(VALUE interner, VALUE root);
+
+static bool
+cache_available(void) {
+    VALUE available;
+    return rb_ractor_local_storage_value_lookup(cache_ractor_key, &available);
+}
 
-    return INT2NUM(code);
+static bool
+cache_enabled(void) {
+    return cache_limit > 0 && cache_available();
 }
 
+static void
+cache_check_ractor(void) {
+    if (!cache_available()) rb_raise(rb_eRuntimeError, "the cache can only be used from the main Ractor");
+}
+
+static int
+cache_freeze_ivar(ID key, VALUE value, st_data_t data) {
+    *((size_t *) data) += sizeof(VALUE) + cache_freeze(value);
+    return ST_CONTINUE;
+}
+
+// Deep freezes a result and returns a rough estimate of the bytes it retains.
+static size_t
+cache_freeze(VALUE object) {
+    if (SPECIAL_CONST_P(object)) return 0;
+
+    size_t size = sizeof(VALUE) * 5;
+
+    switch (BUILTIN_TYPE(object)) {
+        case T_STRING:
+            size += RSTRING_LEN(object);
+            break;
+        case T_ARRAY:
+            for (long index = 0; index < RARRAY_LEN(object); index++) {
+                size += sizeof(VALUE) + cache_freeze(RARRAY_AREF(object, index));
+            }
+            break;
+        case T_OBJECT:
+            rb_ivar_foreach(object, cache_freeze_ivar, (st_data_t) &size);
+            break;
+        default:
+            break;
+    }
+
+    rb_obj_freeze(object);
+    return size;
+}
+
+// Frozen sources are used in the key as-is. Anything else gets a frozen
+// copy, which shares the original buffer where possible.
 static VALUE
-compile(VALUE self, VALUE string) {
-    const OnigUChar *pattern = (const OnigUChar *) StringValueCStr(string);
+cache_key(cache_kind_t kind, OnigOptionType options, OnigEncoding encoding, VALUE string) {
+    VALUE source = OBJ_FROZEN(string) ? string : rb_str_new_frozen(string);
+    VALUE key = rb_ary_new_from_args(4, INT2FIX(kind), UINT2NUM(options), INT2FIX(rb_enc_to_index(encoding)), source);
 
-    regex_t *regex;
-    OnigErrorInfo einfo;
+    return rb_obj_freeze(key);
+}
 
-    OnigEncoding encoding = rb_enc_get(string);
-    int result = onig_new(&regex, pattern, pattern + strlen((const char *) pattern), ONIG_OPTION_DEFAULT, encoding, ONIG_SYNTAX_DEFAULT, &einfo);
+static VALUE
+cache_fetch(VALUE key) {
+    VALUE entry = rb_hash_delete(cache_entries, key);
 
-    if (result != ONIG_NORMAL) {
-        fail(result, regex, &einfo);
-        return Qnil;
+    if (NIL_P(entry)) {
+        cache_misses++;
+        return Qundef;
     }
 
-    VALUE insns = rb_ary_new();
-    const unsigned char *cursor = regex->p;
-    const unsigned char *end = cursor + regex->used;
-    LengthType length;
+    rb_hash_aset(cache_entries, key, entry);
+    cache_hits++;
 
-    while (cursor < end) {
-        VALUE insn = rb_ary_new();
+    return RARRAY_AREF(entry, 0);
+}
 
-        switch (*cursor++) {
-            case OP_FINISH: {
-                rb_ary_push(insn, ID2SYM(rb_intern("finish")));
-                break;
-            }
-            case OP_END: {
-                rb_ary_push(insn, ID2SYM(rb_intern("end")));
-                break;
-            }
-            case OP_EXACT1: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact1")));
-                rb_ary_push(insn, read_exact(&cursor, 1, encoding));
-                break;
-            }
-            case OP_EXACT2: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact2")));
-                rb_ary_push(insn, read_exact(&cursor, 2, encoding));
-                break;
-            }
-            case OP_EXACT3: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact3")));
-                rb_ary_push(insn, read_exact(&cursor, 3, encoding));
-                break;
-            }
-            case OP_EXACT4: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact4")));
-                rb_ary_push(insn, read_exact(&cursor, 4, encoding));
-                break;
-            }
-            case OP_EXACT5: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact5")));
-                rb_ary_push(insn, read_exact(&cursor, 5, encoding));
-                break;
-            }
-            case OP_EXACTN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactn")));
-                rb_ary_push(insn, read_length(&cursor));
-                break;
-            }
-            case OP_EXACTMB2N1: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmb2n1")));
-                rb_ary_push(insn, read_exact(&cursor, 2, encoding));
-                break;
-            }
-            case OP_EXACTMB2N2: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmb2n2")));
-                rb_ary_push(insn, read_exact(&cursor, 4, encoding));
-                break;
-            }
-            case OP_EXACTMB2N3: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmb2n3")));
-                rb_ary_push(insn, read_exact(&cursor, 6, encoding));
-                break;
-            }
-            case OP_EXACTMB2N: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmb2n")));
+static int
+cache_oldest_key(VALUE key, VALUE value, VALUE data) {
+    *((VALUE *) data) = key;
+    return ST_STOP;
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+static void
+cache_evict(size_t limit) {
+    while (cache_bytes > limit) {
+        VALUE key = Qundef;
+        rb_hash_foreach(cache_entries, cache_oldest_key, (VALUE) &key);
+        if (key == Qundef) break;
 
-                rb_ary_push(insn, read_exact(&cursor, NUM2INT(length) * 2, encoding));
-                break;
-            }
-            case OP_EXACTMB3N: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmb3n")));
+        VALUE entry = rb_hash_delete(cache_entries, key);
+        cache_bytes -= NUM2SIZET(RARRAY_AREF(entry, 1));
+        cache_evictions++;
+    }
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+static VALUE
+cache_store(VALUE key, VALUE result) {
+    size_t size = RSTRING_LEN(RARRAY_AREF(key, 3)) + cache_freeze(result);
+    rb_ractor_make_shareable(result);
 
-                rb_ary_push(insn, read_exact(&cursor, NUM2INT(length) * 3, encoding));
-                break;
-            }
-            case OP_EXACTMBN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactmbn")));
+    if (size <= cache_limit) {
+        cache_evict(cache_limit - size);
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+        VALUE entry = rb_ary_new_from_args(2, result, SIZET2NUM(size));
+        rb_hash_aset(cache_entries, key, rb_obj_freeze(entry));
+        cache_bytes += size;
+    }
 
-                rb_ary_push(insn, read_exact(&cursor, NUM2INT(length) * 2, encoding));
-                break;
-            }
-            case OP_EXACT1_IC: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exact1_ic")));
-                length = enclen(encoding, cursor, end);
-                rb_ary_push(insn, read_exact(&cursor, length, encoding));
-                break;
-            }
-            case OP_EXACTN_IC: {
-                rb_ary_push(insn, ID2SYM(rb_intern("exactn_ic")));
-                length = enclen(encoding, cursor, end);
-                rb_ary_push(insn, read_exact(&cursor, length, encoding));
-                break;
-            }
-            case OP_CCLASS: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass")));
-                rb_ary_push(insn, read_bitset(&cursor, encoding));
-                break;
-            }
-            case OP_CCLASS_MB: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass_mb")));
+    return result;
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
-                rb_ary_push(insn, read_codepoint(&cursor, NUM2INT(length)));
+static VALUE
+get_cache_limit(VALUE self) {
+    return SIZET2NUM(cache_limit);
+}
 
-                break;
-            }
-            case OP_CCLASS_MB_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass_mb_not")));
+static VALUE
+set_cache_limit(VALUE self, VALUE limit) {
+    cache_check_ractor();
+    cache_limit = NUM2SIZET(limit);
+    cache_evict(cache_limit);
+    return limit;
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
-                rb_ary_push(insn, read_codepoint(&cursor, NUM2INT(length)));
+static VALUE
+cache_stats(VALUE self) {
+    cache_check_ractor();
+    VALUE stats = rb_hash_new();
 
-                break;
-            }
-            case OP_CCLASS_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass_not")));
-                rb_ary_push(insn, read_bitset(&cursor, encoding));
-                break;
-            }
-            case OP_CCLASS_MIX: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass_mix")));
-                rb_ary_push(insn, read_bitset(&cursor, encoding));
+    rb_hash_aset(stats, ID2SYM(rb_intern("limit")), SIZET2NUM(cache_limit));
+    rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(cache_bytes));
+    rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(RHASH_SIZE(cache_entries)));
+    rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(cache_hits));
+    rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(cache_misses));
+    rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), SIZET2NUM(cache_evictions));
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
-                rb_ary_push(insn, read_codepoint(&cursor, NUM2INT(length)));
+    return stats;
+}
 
-                break;
-            }
-            case OP_CCLASS_MIX_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("cclass_mix_not")));
-                rb_ary_push(insn, read_bitset(&cursor, encoding));
+static VALUE
+clear_cache(VALUE self) {
+    cache_check_ractor();
+    rb_hash_clear(cache_entries);
+    cache_bytes = 0;
+    cache_hits = 0;
+    cache_misses = 0;
+    cache_evictions = 0;
+    return Qnil;
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
-                rb_ary_push(insn, read_codepoint(&cursor, NUM2INT(length)));
+static VALUE
+parse(int argc, VALUE *argv, VALUE self) {
+    VALUE source, keywords;
+    rb_scan_args(argc, argv, "1:", &source, &keywords);
 
-                break;
-            }
-            case OP_ANYCHAR: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar")));
-                break;
-            }
-            case OP_ANYCHAR_ML: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar_ml")));
-                break;
-            }
-            case OP_ANYCHAR_STAR: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar_star")));
-                break;
-            }
-            case OP_ANYCHAR_ML_STAR: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar_ml_star")));
-                break;
+    bool lazy = false;
+    VALUE interner = Qnil;
+    if (!NIL_P(keywords)) {
+        ID keyword_ids[] = { rb_intern("lazy"), rb_intern("interner") };
+        VALUE keyword_values[2];
+        rb_get_kwargs(keywords, keyword_ids, 0, 2, keyword_values);
+        lazy = keyword_values[0] != Qundef && RTEST(keyword_values[0]);
+        if (keyword_values[1] != Qundef) interner = keyword_values[1];
+    }
+
+    if (lazy && !NIL_P(interner)) {
+        rb_raise(rb_eArgError, "lazy trees cannot be interned");
+    }
+
+    OnigEncoding encoding;
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &encoding, &options);
+
+    const OnigUChar *pattern = (const OnigUChar *) RSTRING_PTR(string);
+    const OnigUChar *pattern_end = pattern + RSTRING_LEN(string);
+
+    VALUE key = Qnil;
+    if (!lazy && NIL_P(interner) && cache_enabled()) {
+        key = cache_key(CACHE_KIND_PARSE, options, encoding, string);
+
+        VALUE cached = cache_fetch(key);
+        if (cached != Qundef) return cached;
+    }
+
+    regex_t *regex = calloc(1, sizeof(regex_t));
+    if (regex == NULL) {
+        rb_raise(rb_eNoMemError, "failed to allocate memory");
+        return Qnil;
+    }
+
+    int result;
+
+    if ((result = onig_reg_init(regex, options, ONIGENC_CASE_FOLD_DEFAULT, encoding, ONIG_SYNTAX_DEFAULT)) != ONIG_NORMAL) {
+        fail(result, regex, NULL);
+        return Qnil;
+    }
+
+    OnigDistance init_size = (pattern_end - pattern) * 2;
+    result = BBUF_INIT(regex, init_size);
+
+    if (result != ONIG_NORMAL) {
+        fail(result, regex, NULL);
+        return Qnil;
+    }
+
+    // Lazy trees outlive this call, and call nodes point into the pattern for
+    // their names, so the pattern is either borrowed or copied.
+    parse_tree_t *parse_tree = NULL;
+    VALUE tree = Qnil;
+
+    if (lazy) {
+        tree = TypedData_Make_Struct(rb_cOnigmoTree, parse_tree_t, &parse_tree_type, parse_tree);
+        parse_tree->source = Qnil;
+        parse_tree->pattern_length = pattern_end - pattern;
+
+        if (pattern_borrowable(string)) {
+            parse_tree->source = string;
+            parse_tree->pattern = pattern;
+        } else {
+            OnigUChar *copy = ALLOC_N(OnigUChar, parse_tree->pattern_length);
+            memcpy(copy, pattern, parse_tree->pattern_length);
+            parse_tree->pattern = pattern = copy;
+        }
+
+        pattern_end = pattern + parse_tree->pattern_length;
+    }
+
+    Node *root;
+    ScanEnv scan_env = { 0 };
+
+    result = onig_parse_make_tree(&root, pattern, pattern_end, regex, &scan_env);
+    if (result != ONIG_NORMAL) {
+        OnigErrorInfo einfo = parse_error_info(&scan_env);
+        fail(result, regex, &einfo);
+        return Qnil;
+    }
+
+    if (lazy) {
+        parse_tree->regex = regex;
+        parse_tree->root = root;
+        parse_tree->node_count = count_nodes(root);
+        return build_node(root, encoding, tree);
+    }
+
+    VALUE node = build_node(root, encoding, Qnil);
+
+    onig_node_free(root);
+    onig_free(regex);
+
+    if (!NIL_P(interner)) return interner_intern(interner, node);
+    if (NIL_P(key)) return node;
+
+    // Cached trees are frozen, so their digests are memoized beforehand.
+    node_digest(node);
+    return cache_store(key, node);
+}
+
+// A single entry in a batch parse. Everything up to and including
+// onig_reg_init happens while holding the GVL, only the call to
+// onig_parse_make_tree happens on the worker threads.
+typedef struct {
+    const OnigUChar *pattern;
+    const OnigUChar *pattern_end;
+    bool borrowed;
+    OnigEncoding encoding;
+    regex_t *regex;
+    Node *root;
+    ScanEnv scan_env;
+    int result;
+    bool parsed;
+} parse_job_t;
+
+typedef struct {
+    VALUE patterns;
+    parse_job_t *jobs;
+    long size;
+    long next;
+    int threads;
+    volatile int interrupted;
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_t lock;
+#endif
+} parse_batch_t;
+
+// The syntax used for batch parses, which is the default syntax without any of
+// the warnings. Warnings call back into Ruby, which is not allowed without the
+// GVL.
+static OnigSyntaxType parse_batch_syntax;
+
+static parse_job_t *
+parse_batch_next(parse_batch_t *batch) {
+    parse_job_t *job = NULL;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&batch->lock);
+#endif
+    if (!batch->interrupted && batch->next < batch->size) {
+        job = &batch->jobs[batch->next++];
+    }
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&batch->lock);
+#endif
+
+    return job;
+}
+
+static void *
+parse_batch_worker(void *data) {
+    parse_batch_t *batch = (parse_batch_t *) data;
+    parse_job_t *job;
+
+    while ((job = parse_batch_next(batch)) != NULL) {
+        if (job->result == ONIG_NORMAL) {
+            job->result = onig_parse_make_tree(&job->root, job->pattern, job->pattern_end, job->regex, &job->scan_env);
+        }
+        job->parsed = true;
+    }
+
+    return NULL;
+}
+
+static void *
+parse_batch_run(void *data) {
+    parse_batch_t *batch = (parse_batch_t *) data;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_t *threads = malloc(sizeof(pthread_t) * (batch->threads - 1));
+    int spawned = 0;
+
+    if (threads != NULL) {
+        for (; spawned < batch->threads - 1; spawned++) {
+            if (pthread_create(&threads[spawned], NULL, parse_batch_worker, batch) != 0) break;
+        }
+    }
+
+    parse_batch_worker(batch);
+
+    for (int index = 0; index < spawned; index++) {
+        pthread_join(threads[index], NULL);
+    }
+
+    free(threads);
+#else
+    parse_batch_worker(batch);
+#endif
+
+    return NULL;
+}
+
+static void
+parse_batch_interrupt(void *data) {
+    ((parse_batch_t *) data)->interrupted = 1;
+}
+
+// Everything that can raise happens here, under the rb_ensure in parse_all,
+// so that parse_batch_free cleans up whatever was set up before the error.
+static void
+parse_batch_setup(parse_batch_t *batch) {
+    for (long index = 0; index < batch->size; index++) {
+        parse_job_t *job = &batch->jobs[index];
+
+        OnigOptionType options;
+        VALUE string = resolve_source(RARRAY_AREF(batch->patterns, index), &job->encoding, &options);
+        rb_ary_store(batch->patterns, index, string);
+
+        long length = RSTRING_LEN(string);
+
+        // Patterns that could be moved or mutated while the GVL is released
+        // are copied. The tree keeps pointers into them for names.
+        if ((job->borrowed = pattern_borrowable(string))) {
+            job->pattern = (const OnigUChar *) RSTRING_PTR(string);
+        } else {
+            OnigUChar *copy = ALLOC_N(OnigUChar, length);
+            memcpy(copy, RSTRING_PTR(string), length);
+            job->pattern = copy;
+        }
+
+        job->pattern_end = job->pattern + length;
+
+        if ((job->regex = calloc(1, sizeof(regex_t))) == NULL) {
+            job->result = ONIGERR_MEMORY;
+        } else if ((job->result = onig_reg_init(job->regex, options, ONIGENC_CASE_FOLD_DEFAULT, job->encoding, &parse_batch_syntax)) == ONIG_NORMAL) {
+            job->result = BBUF_INIT(job->regex, length * 2);
+        }
+    }
+}
+
+static VALUE
+parse_batch_build(VALUE data) {
+    parse_batch_t *batch = (parse_batch_t *) data;
+    parse_batch_setup(batch);
+
+    if (!RTEST(ruby_verbose)) {
+        // An interrupt stops the workers before the batch is done. If checking
+        // for it does not raise (a signal trap, for example), the remaining
+        // jobs still need to be parsed.
+        do {
+            rb_thread_call_without_gvl(parse_batch_run, batch, parse_batch_interrupt, batch);
+            rb_thread_check_ints();
+            batch->interrupted = 0;
+        } while (batch->next < batch->size);
+    } else {
+        // In verbose mode onigmo emits warnings that are not gated by the
+        // syntax, so everything gets parsed while holding the GVL instead.
+        for (long index = 0; index < batch->size; index++) {
+            parse_job_t *job = &batch->jobs[index];
+            if (job->regex != NULL) job->regex->syntax = ONIG_SYNTAX_DEFAULT;
+        }
+        parse_batch_worker(batch);
+        rb_thread_check_ints();
+    }
+
+    VALUE results = rb_ary_new_capa(batch->size);
+    for (long index = 0; index < batch->size; index++) {
+        parse_job_t *job = &batch->jobs[index];
+
+        // A job that never reached a worker has no tree to build from.
+        if (!job->parsed) job->result = ONIGERR_PARSER_BUG;
+
+        if (job->result == ONIG_NORMAL) {
+            rb_ary_push(results, build_node(job->root, job->encoding, Qnil));
+        } else {
+            OnigUChar message[ONIG_MAX_ERROR_MESSAGE_LEN];
+            OnigErrorInfo einfo = parse_error_info(&job->scan_env);
+            onig_error_code_to_str(message, job->result, &einfo);
+            rb_ary_push(results, rb_exc_new_cstr(rb_eArgError, (const char *) message));
+        }
+    }
+
+    return results;
+}
+
+static VALUE
+parse_batch_free(VALUE data) {
+    parse_batch_t *batch = (parse_batch_t *) data;
+
+    for (long index = 0; index < batch->size; index++) {
+        parse_job_t *job = &batch->jobs[index];
+
+        if (job->root != NULL) onig_node_free(job->root);
+        if (job->regex != NULL) onig_free(job->regex);
+        if (!job->borrowed) xfree((void *) job->pattern);
+    }
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_destroy(&batch->lock);
+#endif
+
+    xfree(batch->jobs);
+
+    return Qnil;
+}
+
+static int
+parse_batch_default_threads(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) return (int) count;
+#endif
+    return 1;
+}
+
+static VALUE
+parse_all(int argc, VALUE *argv, VALUE self) {
+    VALUE patterns, keywords;
+    rb_scan_args(argc, argv, "1:", &patterns, &keywords);
+
+    int threads = parse_batch_default_threads();
+    if (!NIL_P(keywords)) {
+        ID keyword_ids[] = { rb_intern("threads") };
+        VALUE keyword_values[1];
+        rb_get_kwargs(keywords, keyword_ids, 0, 1, keyword_values);
+
+        if (keyword_values[0] != Qundef) {
+            threads = NUM2INT(keyword_values[0]);
+            if (threads < 1) rb_raise(rb_eArgError, "threads must be positive");
+        }
+    }
+
+    // Our own copy of the list keeps every borrowed pattern alive even if the
+    // caller changes theirs while the GVL is released.
+    patterns = rb_ary_dup(rb_Array(patterns));
+    long size = RARRAY_LEN(patterns);
+
+    parse_batch_t batch = { .patterns = patterns, .jobs = ZALLOC_N(parse_job_t, size), .size = size, .threads = threads };
+    if (batch.threads > size) batch.threads = size > 0 ? (int) size : 1;
+
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_init(&batch.lock, NULL);
+#endif
+
+    VALUE results = rb_ensure(parse_batch_build, (VALUE) &batch, parse_batch_free, (VALUE) &batch);
+    RB_GC_GUARD(patterns);
+
+    return results;
+}
+
+// A tree flattened into parallel buffers in preorder. Every node has one type
+// byte, three int32 links (-1 for none), and an int32 offset into the payload
+// buffer. The offsets buffer has one trailing entry for the end of the last
+// payload.
+typedef struct {
+    VALUE types;
+    VALUE parents;
+    VALUE first_children;
+    VALUE next_siblings;
+    VALUE payload;
+    VALUE offsets;
+    int32_t size;
+} flat_tree_t;
+
+static void
+flat_push(VALUE buffer, int32_t value) {
+    rb_str_cat(buffer, (const char *) &value, sizeof(int32_t));
+}
+
+static void
+flat_patch(VALUE buffer, int32_t index, int32_t value) {
+    memcpy(RSTRING_PTR(buffer) + index * sizeof(int32_t), &value, sizeof(int32_t));
+}
+
+static flat_type_t
+flat_type(Node *node) {
+    switch (NTYPE(node)) {
+        case NT_STR:
+            return FLAT_STRING;
+        case NT_CCLASS:
+            return IS_NCCLASS_NOT(NCCLASS(node)) ? FLAT_CCLASS_INVERT : FLAT_CCLASS;
+        case NT_CTYPE:
+            return NCTYPE(node)->not == 0 ? FLAT_WORD : FLAT_WORD_INVERT;
+        case NT_CANY:
+            return FLAT_ANY;
+        case NT_BREF:
+            return FLAT_BACKREF;
+        case NT_QTFR:
+            return FLAT_QUANTIFIER;
+        case NT_ENCLOSE:
+            switch (NENCLOSE(node)->type) {
+                case ENCLOSE_OPTION: return FLAT_ENCLOSE_OPTIONS;
+                case ENCLOSE_MEMORY: return FLAT_ENCLOSE_MEMORY;
+                case ENCLOSE_STOP_BACKTRACK: return FLAT_ENCLOSE_STOP_BACKTRACK;
+                case ENCLOSE_CONDITION: return FLAT_ENCLOSE_CONDITION;
+                default: return FLAT_ENCLOSE_ABSENT;
             }
-            case OP_ANYCHAR_STAR_PEEK_NEXT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar_star_peek_next")));
-                rb_ary_push(insn, read_exact(&cursor, 1, encoding));
-                break;
+        case NT_ANCHOR:
+            switch (NANCHOR(node)->type) {
+                case ANCHOR_BEGIN_BUF: return FLAT_ANCHOR_BUFFER_BEGIN;
+                case ANCHOR_END_BUF: return FLAT_ANCHOR_BUFFER_END;
+                case ANCHOR_BEGIN_LINE: return FLAT_ANCHOR_LINE_BEGIN;
+                case ANCHOR_END_LINE: return FLAT_ANCHOR_LINE_END;
+                case ANCHOR_SEMI_END_BUF: return FLAT_ANCHOR_SEMI_END;
+                case ANCHOR_BEGIN_POSITION: return FLAT_ANCHOR_POSITION_BEGIN;
+                case ANCHOR_WORD_BOUND: return FLAT_ANCHOR_WORD_BOUNDARY;
+                case ANCHOR_NOT_WORD_BOUND: return FLAT_ANCHOR_WORD_BOUNDARY_INVERT;
+                case ANCHOR_PREC_READ: return FLAT_LOOK_AHEAD;
+                case ANCHOR_PREC_READ_NOT: return FLAT_LOOK_AHEAD_INVERT;
+                case ANCHOR_LOOK_BEHIND: return FLAT_LOOK_BEHIND;
+                case ANCHOR_LOOK_BEHIND_NOT: return FLAT_LOOK_BEHIND_INVERT;
+                default: return FLAT_ANCHOR_KEEP;
             }
-            case OP_ANYCHAR_ML_STAR_PEEK_NEXT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("anychar_ml_star_peek_next")));
-                rb_ary_push(insn, read_exact(&cursor, 1, encoding));
-                break;
+        case NT_LIST:
+            return FLAT_LIST;
+        case NT_ALT:
+            return FLAT_ALTERNATION;
+        default:
+            return FLAT_CALL;
+    }
+}
+
+// Appends the payload of a single node. Strings are their raw bytes, classes
+// are the 256-bit single byte set followed by uint32 codepoint pairs, and
+// everything else is a short run of int32 values.
+static void
+flat_payload(VALUE payload, Node *node) {
+    switch (NTYPE(node)) {
+        case NT_STR:
+            rb_str_cat(payload, (const char *) NSTR(node)->s, NSTR(node)->end - NSTR(node)->s);
+            break;
+        case NT_CCLASS: {
+            CClassNode *cclass_node = NCCLASS(node);
+            rb_str_cat(payload, (const char *) cclass_node->bs, sizeof(BitSet));
+
+            if (cclass_node->mbuf != NULL) {
+                BBuf *bbuf = cclass_node->mbuf;
+                rb_str_cat(payload, (const char *) (bbuf->p + sizeof(OnigCodePoint)), bbuf->used - sizeof(OnigCodePoint));
             }
-            case OP_WORD: {
-                rb_ary_push(insn, ID2SYM(rb_intern("word")));
-                break;
+            break;
+        }
+        case NT_BREF: {
+            BRefNode *backref_node = NBREF(node);
+            int *backrefs = BACKREFS_P(backref_node);
+            rb_str_cat(payload, (const char *) backrefs, backref_node->back_num * sizeof(int));
+            break;
+        }
+        case NT_QTFR:
+            flat_push(payload, NQTFR(node)->lower);
+            flat_push(payload, NQTFR(node)->upper);
+            flat_push(payload, NQTFR(node)->greedy ? 1 : 0);
+            break;
+        case NT_ENCLOSE:
+            switch (NENCLOSE(node)->type) {
+                case ENCLOSE_OPTION:
+                    flat_push(payload, (int32_t) NENCLOSE(node)->option);
+                    break;
+                case ENCLOSE_MEMORY:
+                case ENCLOSE_CONDITION:
+                    flat_push(payload, NENCLOSE(node)->regnum);
+                    break;
+            }
+            break;
+        case NT_CALL:
+            flat_push(payload, NCALL(node)->group_num);
+            rb_str_cat(payload, (const char *) NCALL(node)->name, NCALL(node)->name_end - NCALL(node)->name);
+            break;
+    }
+}
+
+static int32_t
+flat_node(flat_tree_t *flat, Node *node, int32_t parent) {
+    int32_t index = flat->size++;
+    const char type = (char) flat_type(node);
+
+    rb_str_cat(flat->types, &type, 1);
+    flat_push(flat->parents, parent);
+    flat_push(flat->first_children, -1);
+    flat_push(flat->next_siblings, -1);
+    flat_push(flat->offsets, (int32_t) RSTRING_LEN(flat->payload));
+    flat_payload(flat->payload, node);
+
+    Node *target = NULL;
+    switch (NTYPE(node)) {
+        case NT_QTFR:
+            target = NQTFR(node)->target;
+            break;
+        case NT_ENCLOSE:
+            target = NENCLOSE(node)->target;
+            break;
+        case NT_ANCHOR:
+            target = NANCHOR(node)->target;
+            break;
+        case NT_LIST:
+        case NT_ALT: {
+            int32_t previous = -1;
+
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                int32_t child = flat_node(flat, NCAR(cursor), index);
+
+                if (previous == -1) {
+                    flat_patch(flat->first_children, index, child);
+                } else {
+                    flat_patch(flat->next_siblings, previous, child);
+                }
+
+                previous = child;
+            }
+            break;
+        }
+    }
+
+    if (target != NULL) flat_patch(flat->first_children, index, flat_node(flat, target, index));
+    return index;
+}
+
+// Parses a pattern into a native tree that the caller is responsible for
+// freeing, along with the regex that owns its parse state.
+static Node *
+parse_native(VALUE string, OnigEncoding encoding, OnigOptionType options, regex_t **regex_result) {
+    const OnigUChar *pattern = (const OnigUChar *) RSTRING_PTR(string);
+    const OnigUChar *pattern_end = pattern + RSTRING_LEN(string);
+
+    regex_t *regex = calloc(1, sizeof(regex_t));
+    if (regex == NULL) {
+        rb_raise(rb_eNoMemError, "failed to allocate memory");
+        return NULL;
+    }
+
+    int result;
+
+    if ((result = onig_reg_init(regex, options, ONIGENC_CASE_FOLD_DEFAULT, encoding, ONIG_SYNTAX_DEFAULT)) != ONIG_NORMAL) {
+        fail(result, regex, NULL);
+        return NULL;
+    }
+
+    if ((result = BBUF_INIT(regex, (pattern_end - pattern) * 2)) != ONIG_NORMAL) {
+        fail(result, regex, NULL);
+        return NULL;
+    }
+
+    Node *root;
+    ScanEnv scan_env = { 0 };
+
+    result = onig_parse_make_tree(&root, pattern, pattern_end, regex, &scan_env);
+    if (result != ONIG_NORMAL) {
+        OnigErrorInfo einfo = parse_error_info(&scan_env);
+        fail(result, regex, &einfo);
+        return NULL;
+    }
+
+    *regex_result = regex;
+    return root;
+}
+
+static VALUE
+parse_flat(VALUE self, VALUE source) {
+    OnigEncoding encoding;
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &encoding, &options);
+
+    regex_t *regex;
+    Node *root = parse_native(string, encoding, options, &regex);
+
+    long capa = (long) count_nodes(root);
+    flat_tree_t flat = {
+        .types = rb_str_buf_new(capa),
+        .parents = rb_str_buf_new(capa * sizeof(int32_t)),
+        .first_children = rb_str_buf_new(capa * sizeof(int32_t)),
+        .next_siblings = rb_str_buf_new(capa * sizeof(int32_t)),
+        .payload = rb_str_buf_new(RSTRING_LEN(string)),
+        .offsets = rb_str_buf_new((capa + 1) * sizeof(int32_t)),
+        .size = 0
+    };
+
+    flat_node(&flat, root, -1);
+    flat_push(flat.offsets, (int32_t) RSTRING_LEN(flat.payload));
+
+    onig_node_free(root);
+    onig_free(regex);
+
+    VALUE argv[] = {
+        flat.types,
+        flat.parents,
+        flat.first_children,
+        flat.next_siblings,
+        flat.payload,
+        flat.offsets,
+        rb_enc_from_encoding(encoding)
+    };
+
+    return rb_class_new_instance(7, argv, rb_cOnigmoFlatTree);
+}
+
+// The visitor method for each kind of node, used by Onigmo.walk.
+static const char *const walk_method_names[] = {
+    [FLAT_ALTERNATION] = "visit_alternation_node",
+    [FLAT_ANCHOR_BUFFER_BEGIN] = "visit_anchor_buffer_begin_node",
+    [FLAT_ANCHOR_BUFFER_END] = "visit_anchor_buffer_end_node",
+    [FLAT_ANCHOR_KEEP] = "visit_anchor_keep_node",
+    [FLAT_ANCHOR_LINE_BEGIN] = "visit_anchor_line_begin_node",
+    [FLAT_ANCHOR_LINE_END] = "visit_anchor_line_end_node",
+    [FLAT_ANCHOR_POSITION_BEGIN] = "visit_anchor_position_begin_node",
+    [FLAT_ANCHOR_SEMI_END] = "visit_anchor_semi_end_node",
+    [FLAT_ANCHOR_WORD_BOUNDARY] = "visit_anchor_word_boundary_node",
+    [FLAT_ANCHOR_WORD_BOUNDARY_INVERT] = "visit_anchor_word_boundary_invert_node",
+    [FLAT_ANY] = "visit_any_node",
+    [FLAT_BACKREF] = "visit_backref_node",
+    [FLAT_CALL] = "visit_call_node",
+    [FLAT_CCLASS] = "visit_cclass_node",
+    [FLAT_CCLASS_INVERT] = "visit_cclass_invert_node",
+    [FLAT_ENCLOSE_ABSENT] = "visit_enclose_absent_node",
+    [FLAT_ENCLOSE_CONDITION] = "visit_enclose_condition_node",
+    [FLAT_ENCLOSE_MEMORY] = "visit_enclose_memory_node",
+    [FLAT_ENCLOSE_OPTIONS] = "visit_enclose_options_node",
+    [FLAT_ENCLOSE_STOP_BACKTRACK] = "visit_enclose_stop_backtrack_node",
+    [FLAT_LIST] = "visit_list_node",
+    [FLAT_LOOK_AHEAD] = "visit_look_ahead_node",
+    [FLAT_LOOK_AHEAD_INVERT] = "visit_look_ahead_invert_node",
+    [FLAT_LOOK_BEHIND] = "visit_look_behind_node",
+    [FLAT_LOOK_BEHIND_INVERT] = "visit_look_behind_invert_node",
+    [FLAT_QUANTIFIER] = "visit_quantifier_node",
+    [FLAT_STRING] = "visit_string_node",
+    [FLAT_WORD] = "visit_word_node",
+    [FLAT_WORD_INVERT] = "visit_word_invert_node"
+};
+
+// State for a single Onigmo.walk. Only the kinds of node whose visitor method
+// is overridden are reported, and each kind reuses one event object for every
+// callback, so nodes that are not visited never allocate.
+typedef struct {
+    VALUE visitor;
+    VALUE types;
+    VALUE events[FLAT_TYPE_COUNT];
+    ID methods[FLAT_TYPE_COUNT];
+    OnigEncoding encoding;
+    regex_t *regex;
+    Node *root;
+} walk_t;
+
+static void
+walk_event_fields(VALUE event, Node *node, OnigEncoding encoding) {
+    switch (NTYPE(node)) {
+        case NT_STR:
+            rb_ivar_set(event, rb_intern("@value"), rb_enc_str_new((const char *) NSTR(node)->s, NSTR(node)->end - NSTR(node)->s, encoding));
+            break;
+        case NT_CCLASS:
+            rb_ivar_set(event, rb_intern("@characters"), build_bitset(NCCLASS(node)->bs, encoding));
+            rb_ivar_set(event, rb_intern("@ranges"), build_ranges(NCCLASS(node)->mbuf));
+            break;
+        case NT_BREF: {
+            BRefNode *backref_node = NBREF(node);
+            int *backrefs = BACKREFS_P(backref_node);
+
+            VALUE values = rb_ary_new_capa(backref_node->back_num);
+            for (int index = 0; index < backref_node->back_num; index++) {
+                rb_ary_push(values, INT2NUM(backrefs[index]));
+            }
+
+            rb_ivar_set(event, rb_intern("@values"), values);
+            break;
+        }
+        case NT_QTFR:
+            rb_ivar_set(event, rb_intern("@lower"), NQTFR(node)->lower == -1 ? Qnil : INT2NUM(NQTFR(node)->lower));
+            rb_ivar_set(event, rb_intern("@upper"), NQTFR(node)->upper == -1 ? Qnil : INT2NUM(NQTFR(node)->upper));
+            rb_ivar_set(event, rb_intern("@greedy"), NQTFR(node)->greedy ? Qtrue : Qfalse);
+            break;
+        case NT_ENCLOSE:
+            switch (NENCLOSE(node)->type) {
+                case ENCLOSE_OPTION:
+                    rb_ivar_set(event, rb_intern("@options"), build_options(NENCLOSE(node)->option));
+                    break;
+                case ENCLOSE_MEMORY:
+                case ENCLOSE_CONDITION:
+                    rb_ivar_set(event, rb_intern("@number"), INT2NUM(NENCLOSE(node)->regnum));
+                    break;
+            }
+            break;
+        case NT_CALL: {
+            CallNode *call_node = NCALL(node);
+            ptrdiff_t length = call_node->name_end - call_node->name;
+
+            rb_ivar_set(event, rb_intern("@number"), INT2NUM(call_node->group_num));
+            rb_ivar_set(event, rb_intern("@name"), length > 0 ? rb_enc_str_new((const char *) call_node->name, length, encoding) : Qnil);
+            break;
+        }
+    }
+}
+
+static void
+walk_node(walk_t *walk, Node *node, int depth) {
+    flat_type_t type = flat_type(node);
+
+    if (walk->methods[type] != 0) {
+        VALUE event = walk->events[type];
+
+        if (NIL_P(event)) {
+            event = walk->events[type] = rb_obj_alloc(rb_cOnigmoWalkEvent);
+            rb_ivar_set(event, rb_intern("@type"), RARRAY_AREF(walk->types, type));
+        }
+
+        rb_ivar_set(event, rb_intern("@depth"), INT2NUM(depth));
+        walk_event_fields(event, node, walk->encoding);
+        rb_funcall(walk->visitor, walk->methods[type], 1, event);
+    }
+
+    switch (NTYPE(node)) {
+        case NT_QTFR:
+            if (NQTFR(node)->target != NULL) walk_node(walk, NQTFR(node)->target, depth + 1);
+            break;
+        case NT_ENCLOSE:
+            if (NENCLOSE(node)->target != NULL) walk_node(walk, NENCLOSE(node)->target, depth + 1);
+            break;
+        case NT_ANCHOR:
+            if (NANCHOR(node)->target != NULL) walk_node(walk, NANCHOR(node)->target, depth + 1);
+            break;
+        case NT_LIST:
+        case NT_ALT:
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                walk_node(walk, NCAR(cursor), depth + 1);
             }
-            case OP_NOT_WORD: {
-                rb_ary_push(insn, ID2SYM(rb_intern("not_word")));
+            break;
+    }
+}
+
+static VALUE
+walk_run(VALUE data) {
+    walk_t *walk = (walk_t *) data;
+    walk_node(walk, walk->root, 0);
+    return walk->visitor;
+}
+
+static VALUE
+walk_free(VALUE data) {
+    walk_t *walk = (walk_t *) data;
+    onig_node_free(walk->root);
+    onig_free(walk->regex);
+    return Qnil;
+}
+
+// A method only counts as overridden if it does not come from Onigmo::Visitor
+// itself, whose methods only descend into children. The ancestors of the
+// visitor's class are searched for the first one that defines it, which
+// unlike Method#owner does not allocate.
+static bool
+visitor_overrides(VALUE ancestors, ID method_id) {
+    VALUE name = ID2SYM(method_id);
+
+    for (long index = 0; index < RARRAY_LEN(ancestors); index++) {
+        VALUE ancestor = RARRAY_AREF(ancestors, index);
+        if (ancestor == rb_cOnigmoVisitor) return false;
+
+        if (RTEST(rb_funcall(ancestor, rb_intern("method_defined?"), 2, name, Qfalse)) ||
+            RTEST(rb_funcall(ancestor, rb_intern("private_method_defined?"), 2, name, Qfalse))) {
+            return true;
+        }
+    }
+
+    return true;
+}
+
+// The walk visits every child anyway, so methods that are not overridden are
+// never called.
+static void
+walk_methods(walk_t *walk) {
+    VALUE ancestors = rb_mod_ancestors(CLASS_OF(walk->visitor));
+
+    for (int type = 0; type < FLAT_TYPE_COUNT; type++) {
+        ID method_id = rb_intern(walk_method_names[type]);
+        walk->methods[type] = 0;
+        walk->events[type] = Qnil;
+
+        if (rb_respond_to(walk->visitor, method_id) && visitor_overrides(ancestors, method_id)) {
+            walk->methods[type] = method_id;
+        }
+    }
+}
+
+static VALUE
+walk(VALUE self, VALUE source, VALUE visitor) {
+    walk_t walk = {
+        .visitor = visitor,
+        .types = rb_const_get(rb_cOnigmoFlatTree, rb_intern("TYPES"))
+    };
+    walk_methods(&walk);
+
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &walk.encoding, &options);
+    walk.root = parse_native(string, walk.encoding, options, &walk.regex);
+
+    VALUE result = rb_ensure(walk_run, (VALUE) &walk, walk_free, (VALUE) &walk);
+    RB_GC_GUARD(walk.types);
+
+    return result;
+}
+
+// The class of every node type, in the same order as flat_type_t.
+static VALUE node_classes[FLAT_TYPE_COUNT];
+
+// The instance variables of each type of node other than its children.
+static const char *const node_fields[FLAT_TYPE_COUNT][4] = {
+    [FLAT_BACKREF] = { "@values" },
+    [FLAT_CALL] = { "@number", "@name" },
+    [FLAT_CCLASS] = { "@characters", "@ranges" },
+    [FLAT_CCLASS_INVERT] = { "@characters", "@ranges" },
+    [FLAT_ENCLOSE_CONDITION] = { "@number" },
+    [FLAT_ENCLOSE_MEMORY] = { "@number" },
+    [FLAT_ENCLOSE_OPTIONS] = { "@options" },
+    [FLAT_QUANTIFIER] = { "@lower", "@upper", "@greedy" },
+    [FLAT_STRING] = { "@value" }
+};
+
+// The same names, interned at load.
+static ID node_field_ids[FLAT_TYPE_COUNT][4];
+
+// The type of a node, or -1 for anything that is not exactly one of the node
+// classes, which then goes through its Ruby methods instead.
+static int
+node_type(VALUE object) {
+    VALUE klass = rb_obj_class(object);
+
+    for (int type = 0; type < FLAT_TYPE_COUNT; type++) {
+        if (node_classes[type] == klass) return type;
+    }
+
+    return -1;
+}
+
+// Builds the fields of a lazy node if they have not been read yet.
+static void
+node_load(VALUE object) {
+    if (RTEST(rb_ivar_get(object, rb_intern("@tree")))) node_load_children(object);
+}
+
+// Like node_type, but subclasses of the node classes count as their parent
+// type.
+static int
+node_kind(VALUE object) {
+    int type = node_type(object);
+    if (type != -1) return type;
+
+    for (type = 0; type < FLAT_TYPE_COUNT; type++) {
+        if (RTEST(rb_obj_is_kind_of(object, node_classes[type]))) return type;
+    }
+
+    return -1;
+}
+
+// Returns the only child of a node, or Qundef if it has none. Alternations
+// and lists return Qundef and set nodes to their array of children instead.
+static VALUE
+node_children(VALUE object, int type, VALUE *nodes) {
+    *nodes = Qnil;
+
+    switch (type) {
+        case FLAT_ALTERNATION:
+        case FLAT_LIST:
+            node_load(object);
+            *nodes = rb_ivar_get(object, rb_intern("@nodes"));
+            return Qundef;
+        case FLAT_ENCLOSE_ABSENT:
+        case FLAT_ENCLOSE_CONDITION:
+        case FLAT_ENCLOSE_MEMORY:
+        case FLAT_ENCLOSE_OPTIONS:
+        case FLAT_ENCLOSE_STOP_BACKTRACK:
+        case FLAT_LOOK_AHEAD:
+        case FLAT_LOOK_AHEAD_INVERT:
+        case FLAT_LOOK_BEHIND:
+        case FLAT_LOOK_BEHIND_INVERT:
+        case FLAT_QUANTIFIER: {
+            node_load(object);
+            VALUE child = rb_ivar_get(object, rb_intern("@node"));
+            return NIL_P(child) ? Qundef : child;
+        }
+        case -1:
+            *nodes = rb_funcall(object, rb_intern("child_nodes"), 0);
+            return Qundef;
+        default:
+            return Qundef;
+    }
+}
+
+// Yields each child of the node without building an array of them.
+static VALUE
+node_each_child(VALUE self) {
+    RETURN_ENUMERATOR(self, 0, 0);
+
+    VALUE nodes;
+    VALUE child = node_children(self, node_type(self), &nodes);
+
+    if (child != Qundef) {
+        rb_yield(child);
+    } else if (RB_TYPE_P(nodes, T_ARRAY)) {
+        for (long index = 0; index < RARRAY_LEN(nodes); index++) {
+            rb_yield(RARRAY_AREF(nodes, index));
+        }
+    }
+
+    return self;
+}
+
+// Which visit methods a visitor overrides, as one ID per node type that is 0
+// wherever the method comes from Onigmo::Visitor itself. Each type is only
+// looked up the first time a child of that type is reached, once per
+// traversal, so that methods defined since on the visitor or on any module in
+// its ancestors are always seen. The table is registered for the visitor in a
+// fiber-local Hash while the outermost visit_child_nodes runs, so that super
+// calls from overridden visit methods reuse it.
+typedef struct {
+    VALUE visitor;
+    VALUE node;
+    VALUE ancestors;
+    ID methods[FLAT_TYPE_COUNT];
+    bool resolved[FLAT_TYPE_COUNT];
+} visitor_dispatch_t;
+
+static ID visitor_dispatch_key;
+
+static ID
+visitor_dispatch(visitor_dispatch_t *dispatch, int type) {
+    if (!dispatch->resolved[type]) {
+        ID method_id = rb_intern(walk_method_names[type]);
+
+        if (rb_respond_to(dispatch->visitor, method_id)) {
+            if (NIL_P(dispatch->ancestors)) dispatch->ancestors = rb_mod_ancestors(CLASS_OF(dispatch->visitor));
+            dispatch->methods[type] = visitor_overrides(dispatch->ancestors, method_id) ? method_id : 0;
+        } else {
+            dispatch->methods[type] = method_id;
+        }
+
+        dispatch->resolved[type] = true;
+    }
+
+    return dispatch->methods[type];
+}
+
+// Visits a child, and returns true if the visitor would only descend into its
+// children, in which case the caller does that instead of calling back into
+// Ruby.
+static bool
+visitor_visit(visitor_dispatch_t *dispatch, VALUE child) {
+    int type = node_type(child);
+    ID method_id;
+
+    if (type == -1) {
+        rb_funcall(child, rb_intern("accept"), 1, dispatch->visitor);
+    } else if ((method_id = visitor_dispatch(dispatch, type)) != 0) {
+        rb_funcallv(dispatch->visitor, method_id, 1, &child);
+    } else {
+        return true;
+    }
+
+    return false;
+}
+
+// Descends into children whose visit methods are not overridden here rather
+// than through accept, using an explicit stack that is only allocated once a
+// node with more than one child is reached.
+static VALUE
+visitor_descend(visitor_dispatch_t *dispatch, VALUE node) {
+    VALUE stack = Qnil;
+
+    for (;;) {
+        VALUE nodes;
+        VALUE next = node_children(node, node_type(node), &nodes);
+
+        if (RB_TYPE_P(nodes, T_ARRAY) && RARRAY_LEN(nodes) > 0) {
+            if (NIL_P(stack)) stack = rb_ary_new();
+            for (long index = RARRAY_LEN(nodes) - 1; index >= 0; index--) {
+                rb_ary_push(stack, RARRAY_AREF(nodes, index));
+            }
+        }
+
+        for (;;) {
+            if (next == Qundef) {
+                if (NIL_P(stack) || RARRAY_LEN(stack) == 0) return Qnil;
+                next = rb_ary_pop(stack);
+            }
+
+            if (visitor_visit(dispatch, next)) break;
+            next = Qundef;
+        }
+
+        node = next;
+    }
+}
+
+static VALUE
+visitor_descend_outermost(VALUE data) {
+    visitor_dispatch_t *dispatch = (visitor_dispatch_t *) data;
+    return visitor_descend(dispatch, dispatch->node);
+}
+
+static VALUE
+visitor_unregister(VALUE data) {
+    visitor_dispatch_t *dispatch = (visitor_dispatch_t *) data;
+    rb_hash_delete(rb_thread_local_aref(rb_thread_current(), visitor_dispatch_key), dispatch->visitor);
+    return Qnil;
+}
+
+// The default for every visit method.
+static VALUE
+visitor_visit_child_nodes(VALUE self, VALUE node) {
+    VALUE thread = rb_thread_current();
+    VALUE tables = rb_thread_local_aref(thread, visitor_dispatch_key);
+
+    if (NIL_P(tables)) {
+        tables = rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0);
+        rb_thread_local_aset(thread, visitor_dispatch_key, tables);
+    } else {
+        VALUE table = rb_hash_lookup2(tables, self, Qundef);
+        if (table != Qundef) return visitor_descend((visitor_dispatch_t *) NUM2SIZET(table), node);
+    }
+
+    visitor_dispatch_t dispatch = { .visitor = self, .node = node, .ancestors = Qnil };
+    rb_hash_aset(tables, self, SIZET2NUM((size_t) &dispatch));
+
+    VALUE result = rb_ensure(visitor_descend_outermost, (VALUE) &dispatch, visitor_unregister, (VALUE) &dispatch);
+    RB_GC_GUARD(dispatch.ancestors);
+
+    return result;
+}
+
+// Whether a node has neither fields nor children, and so hashes by its type
+// alone.
+static bool
+node_leaf_p(int type) {
+    switch (type) {
+        case FLAT_ALTERNATION:
+        case FLAT_LIST:
+        case FLAT_ENCLOSE_ABSENT:
+        case FLAT_ENCLOSE_CONDITION:
+        case FLAT_ENCLOSE_MEMORY:
+        case FLAT_ENCLOSE_OPTIONS:
+        case FLAT_ENCLOSE_STOP_BACKTRACK:
+        case FLAT_LOOK_AHEAD:
+        case FLAT_LOOK_AHEAD_INVERT:
+        case FLAT_LOOK_BEHIND:
+        case FLAT_LOOK_BEHIND_INVERT:
+        case FLAT_QUANTIFIER:
+            return false;
+        default:
+            return node_fields[type][0] == NULL;
+    }
+}
+
+// Looks up a digest that has already been computed, either memoized on the
+// node itself or, for frozen nodes, in the table for the current computation.
+static bool
+node_digest_lookup(VALUE object, VALUE digests, long *digest) {
+    int type = node_kind(object);
+
+    if (type == -1) {
+        *digest = NUM2LONG(rb_hash(object));
+        return true;
+    }
+
+    if (node_leaf_p(type)) {
+        *digest = (long) (rb_hash_end(rb_hash_start((st_index_t) type)) >> 2);
+        return true;
+    }
+
+    VALUE memo = rb_attr_get(object, rb_intern("digest"));
+    if (NIL_P(memo) && !NIL_P(digests)) memo = rb_hash_lookup(digests, object);
+    if (NIL_P(memo)) return false;
+
+    *digest = FIX2LONG(memo);
+    return true;
+}
+
+// Fields are mostly strings, arrays of pooled strings and numbers, or range
+// sets, which are hashed here directly rather than through Array#hash, which
+// guards against recursion on every call.
+static long
+node_field_hash(VALUE value) {
+    if (RB_TYPE_P(value, T_STRING)) return (long) rb_str_hash(value);
+    if (rb_obj_class(value) == rb_cOnigmoCodepointRangeSet) return node_field_hash(rb_ivar_get(value, rb_intern("@pairs")));
+    if (!RB_TYPE_P(value, T_ARRAY)) return NUM2LONG(rb_hash(value));
+
+    st_index_t hash = rb_hash_start((st_index_t) RARRAY_LEN(value));
+    for (long index = 0; index < RARRAY_LEN(value); index++) {
+        hash = rb_hash_uint(hash, node_field_hash(RARRAY_AREF(value, index)));
+    }
+
+    return (long) rb_hash_end(hash);
+}
+
+// Hashes a node from its type, its fields, and the digests of its children,
+// which have to be computed already.
+static long
+node_digest_compute(VALUE object, int type, VALUE digests) {
+    st_index_t hash = rb_hash_start((st_index_t) type);
+    node_load(object);
+
+    for (int index = 0; index < 4 && node_fields[type][index] != NULL; index++) {
+        hash = rb_hash_uint(hash, node_field_hash(rb_ivar_get(object, node_field_ids[type][index])));
+    }
+
+    VALUE nodes;
+    VALUE child = node_children(object, type, &nodes);
+    long digest;
+
+    if (child != Qundef) {
+        node_digest_lookup(child, digests, &digest);
+        hash = rb_hash_uint(hash, digest);
+    } else if (RB_TYPE_P(nodes, T_ARRAY)) {
+        hash = rb_hash_uint(hash, RARRAY_LEN(nodes));
+        for (long index = 0; index < RARRAY_LEN(nodes); index++) {
+            node_digest_lookup(RARRAY_AREF(nodes, index), digests, &digest);
+            hash = rb_hash_uint(hash, digest);
+        }
+    }
+
+    // Shifted so that every digest fits in a Fixnum.
+    return (long) (rb_hash_end(hash) >> 2);
+}
+
+// A structural hash of the tree below a node. Each digest is memoized on its
+// node the first time it is needed, so later calls only hash what has not
+// been seen yet. Frozen nodes cannot be written to, which is why Node#freeze
+// hashes a node before freezing it. The tree is walked in
+// postorder with an explicit stack, so it can be any depth.
+static long
+node_digest(VALUE root) {
+    long digest;
+    VALUE digests = Qnil;
+    if (node_digest_lookup(root, digests, &digest)) return digest;
+
+    VALUE stack = rb_ary_new_from_args(1, root);
+
+    while (RARRAY_LEN(stack) > 0) {
+        VALUE object = rb_ary_entry(stack, -1);
+        if (node_digest_lookup(object, digests, &digest)) {
+            rb_ary_pop(stack);
+            continue;
+        }
+
+        int type = node_kind(object);
+        long depth = RARRAY_LEN(stack);
+
+        VALUE nodes;
+        VALUE child = node_children(object, type, &nodes);
+
+        if (child != Qundef) {
+            if (!node_digest_lookup(child, digests, &digest)) rb_ary_push(stack, child);
+        } else if (RB_TYPE_P(nodes, T_ARRAY)) {
+            for (long index = RARRAY_LEN(nodes) - 1; index >= 0; index--) {
+                VALUE node = RARRAY_AREF(nodes, index);
+                if (!node_digest_lookup(node, digests, &digest)) rb_ary_push(stack, node);
+            }
+        }
+
+        if (RARRAY_LEN(stack) > depth) continue;
+
+        digest = node_digest_compute(object, type, digests);
+        if (OBJ_FROZEN(object)) {
+            if (NIL_P(digests)) digests = rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0);
+            rb_hash_aset(digests, object, LONG2FIX(digest));
+        } else {
+            rb_ivar_set(object, rb_intern("digest"), LONG2FIX(digest));
+        }
+
+        rb_ary_pop(stack);
+    }
+
+    node_digest_lookup(root, digests, &digest);
+    return digest;
+}
+
+static VALUE
+node_hash(VALUE self) {
+    return LONG2FIX(node_digest(self));
+}
+
+// Fields are mostly arrays of pooled strings or numbers, or range sets of
+// numbers, which are compared here directly rather than through Array#eql?,
+// which guards against recursion on every call.
+static bool
+node_field_eql(VALUE left, VALUE right) {
+    if (left == right) return true;
+
+    if (rb_obj_class(left) == rb_cOnigmoCodepointRangeSet && rb_obj_class(right) == rb_cOnigmoCodepointRangeSet) {
+        ID pairs = rb_intern("@pairs");
+        return node_field_eql(rb_ivar_get(left, pairs), rb_ivar_get(right, pairs));
+    }
+    if (!RB_TYPE_P(left, T_ARRAY) || !RB_TYPE_P(right, T_ARRAY)) return rb_eql(left, right);
+    if (RARRAY_LEN(left) != RARRAY_LEN(right)) return false;
+
+    for (long index = 0; index < RARRAY_LEN(left); index++) {
+        VALUE left_element = RARRAY_AREF(left, index);
+        VALUE right_element = RARRAY_AREF(right, index);
+        if (left_element != right_element && !rb_eql(left_element, right_element)) return false;
+    }
+
+    return true;
+}
+
+// Compares two trees node by node, using an explicit stack of pairs. Digests
+// are compared first, so trees that differ are usually told apart without
+// walking them, and identical subtrees are skipped.
+static VALUE
+node_eql(VALUE self, VALUE other) {
+    if (self == other) return Qtrue;
+    if (rb_obj_class(self) != rb_obj_class(other)) return Qfalse;
+    if (node_digest(self) != node_digest(other)) return Qfalse;
+
+    VALUE stack = rb_ary_new_from_args(2, self, other);
+
+    while (RARRAY_LEN(stack) > 0) {
+        VALUE right = rb_ary_pop(stack);
+        VALUE left = rb_ary_pop(stack);
+
+        if (left == right) continue;
+        if (rb_obj_class(left) != rb_obj_class(right)) return Qfalse;
+
+        int type = node_kind(left);
+        if (type == -1) {
+            if (!rb_eql(left, right)) return Qfalse;
+            continue;
+        }
+
+        node_load(left);
+        node_load(right);
+
+        for (int index = 0; index < 4 && node_fields[type][index] != NULL; index++) {
+            ID name = node_field_ids[type][index];
+            if (!node_field_eql(rb_ivar_get(left, name), rb_ivar_get(right, name))) return Qfalse;
+        }
+
+        VALUE left_nodes, right_nodes;
+        VALUE left_child = node_children(left, type, &left_nodes);
+        VALUE right_child = node_children(right, type, &right_nodes);
+
+        if ((left_child == Qundef) != (right_child == Qundef)) return Qfalse;
+        if (left_child != Qundef) rb_ary_push(rb_ary_push(stack, left_child), right_child);
+
+        if (RB_TYPE_P(left_nodes, T_ARRAY) || RB_TYPE_P(right_nodes, T_ARRAY)) {
+            if (!RB_TYPE_P(left_nodes, T_ARRAY) || !RB_TYPE_P(right_nodes, T_ARRAY)) return Qfalse;
+            if (RARRAY_LEN(left_nodes) != RARRAY_LEN(right_nodes)) return Qfalse;
+
+            for (long index = 0; index < RARRAY_LEN(left_nodes); index++) {
+                rb_ary_push(rb_ary_push(stack, RARRAY_AREF(left_nodes, index)), RARRAY_AREF(right_nodes, index));
+            }
+        }
+    }
+
+    return Qtrue;
+}
+
+static size_t interner_estimate(VALUE value);
+
+static int
+interner_estimate_ivar(ID key, VALUE value, st_data_t data) {
+    *((size_t *) data) += sizeof(VALUE) + interner_estimate(value);
+    return ST_CONTINUE;
+}
+
+// A rough estimate of the bytes a field retains, in the same terms as the
+// cache. Elements of arrays are not counted, since they are either immediates
+// or pooled strings.
+static size_t
+interner_estimate(VALUE value) {
+    if (SPECIAL_CONST_P(value)) return 0;
+
+    size_t size = sizeof(VALUE) * 5;
+
+    switch (BUILTIN_TYPE(value)) {
+        case T_STRING:
+            size += RSTRING_LEN(value);
+            break;
+        case T_ARRAY:
+            size += sizeof(VALUE) * RARRAY_LEN(value);
+            break;
+        case T_OBJECT:
+            rb_ivar_foreach(value, interner_estimate_ivar, (st_data_t) &size);
+            break;
+        default:
+            break;
+    }
+
+    return size;
+}
+
+// The bytes a node retains on its own, not counting its children.
+static size_t
+interner_footprint(VALUE object, int type) {
+    size_t size = sizeof(VALUE) * 5;
+
+    for (int index = 0; index < 4 && node_fields[type][index] != NULL; index++) {
+        size += sizeof(VALUE) + interner_estimate(rb_ivar_get(object, node_field_ids[type][index]));
+    }
+
+    VALUE nodes;
+    if (node_children(object, type, &nodes) != Qundef) {
+        size += sizeof(VALUE);
+    } else if (RB_TYPE_P(nodes, T_ARRAY)) {
+        size += sizeof(VALUE) * (6 + RARRAY_LEN(nodes));
+    }
+
+    return size;
+}
+
+static void
+interner_count(VALUE interner, const char *name, size_t count) {
+    ID id = rb_intern(name);
+    rb_ivar_set(interner, id, rb_funcall(rb_ivar_get(interner, id), '+', 1, SIZET2NUM(count)));
+}
+
+// Swaps every subtree of a freshly built tree for the interner's copy of it,
+// adding the subtrees it has not seen yet. Subtrees are visited in postorder
+// with an explicit stack, so by the time a node is looked up its children are
+// already the shared copies, and comparing it against the table stops at
+// them by identity. Everything in the table is deeply frozen and shareable.
+static VALUE
+interner_intern(VALUE interner, VALUE root) {
+    VALUE table = rb_ivar_get(interner, rb_intern("@table"));
+    if (!RB_TYPE_P(table, T_HASH)) rb_raise(rb_eTypeError, "expected an Onigmo::Interner");
+
+    // Digests are memoized for the whole tree in one pass up front, since the
+    // nodes are frozen as they go into the table.
+    node_digest(root);
+
+    VALUE replaced = rb_funcall(rb_hash_new(), rb_intern("compare_by_identity"), 0);
+    VALUE stack = rb_ary_new_from_args(2, root, Qfalse);
+    size_t nodes = 0, hits = 0, bytes = 0, saved_bytes = 0;
+
+    while (RARRAY_LEN(stack) > 0) {
+        VALUE expanded = rb_ary_pop(stack);
+        VALUE object = rb_ary_pop(stack);
+
+        // Leaves are already shared singletons.
+        int type = node_type(object);
+        if (type == -1 || node_leaf_p(type)) continue;
+
+        VALUE children;
+        VALUE child = node_children(object, type, &children);
+
+        if (!RTEST(expanded)) {
+            rb_ary_push(rb_ary_push(stack, object), Qtrue);
+
+            if (child != Qundef) {
+                rb_ary_push(rb_ary_push(stack, child), Qfalse);
+            } else if (RB_TYPE_P(children, T_ARRAY)) {
+                for (long index = 0; index < RARRAY_LEN(children); index++) {
+                    rb_ary_push(rb_ary_push(stack, RARRAY_AREF(children, index)), Qfalse);
+                }
+            }
+
+            continue;
+        }
+
+        if (child != Qundef) {
+            VALUE shared = rb_hash_lookup2(replaced, child, Qundef);
+            if (shared != Qundef) rb_ivar_set(object, rb_intern("@node"), shared);
+        } else if (RB_TYPE_P(children, T_ARRAY)) {
+            // Arrays of children are frozen, so shared children go into a copy.
+            VALUE copy = Qnil;
+
+            for (long index = 0; index < RARRAY_LEN(children); index++) {
+                VALUE shared = rb_hash_lookup2(replaced, RARRAY_AREF(children, index), Qundef);
+                if (shared == Qundef) continue;
+
+                if (NIL_P(copy)) copy = rb_ary_dup(children);
+                rb_ary_store(copy, index, shared);
+            }
+
+            if (!NIL_P(copy)) rb_ivar_set(object, rb_intern("@nodes"), rb_obj_freeze(copy));
+        }
+
+        size_t size = interner_footprint(object, type);
+        VALUE shared = rb_hash_lookup2(table, object, Qundef);
+        nodes++;
+
+        if (shared != Qundef) {
+            rb_hash_aset(replaced, object, shared);
+            saved_bytes += size;
+            hits++;
+        } else {
+            rb_ractor_make_shareable(object);
+            rb_hash_aset(table, object, object);
+            bytes += size;
+        }
+    }
+
+    interner_count(interner, "@nodes", nodes);
+    interner_count(interner, "@hits", hits);
+    interner_count(interner, "@bytes", bytes);
+    interner_count(interner, "@saved_bytes", saved_bytes);
+
+    VALUE shared = rb_hash_lookup2(replaced, root, Qundef);
+    return shared == Qundef ? root : shared;
+}
+
+// Deeper trees are only analyzed down to this depth, which keeps the
+// recursion below bounded.
+#define REDOS_MAX_DEPTH 4096
+
+// A set of characters, kept as the bytes they can start with. Characters
+// outside of the single byte range only set wide, and two wide sets are
+// assumed to overlap.
+typedef struct {
+    uint32_t bits[SINGLE_BYTE_SIZE / 32];
+    bool wide;
+} redos_set_t;
+
+// State for a single Onigmo.analyze_redos. The ancestors of the node being
+// visited are kept along with each one's index in its parent, which is the
+// path reported for a finding.
+typedef struct {
+    VALUE findings;
+    VALUE source;
+    OnigEncoding encoding;
+    regex_t *regex;
+    Node *root;
+    Node *nodes[REDOS_MAX_DEPTH];
+    int indices[REDOS_MAX_DEPTH];
+    int depth;
+} redos_t;
+
+static void
+redos_set_add(redos_set_t *set, int byte) {
+    set->bits[byte / 32] |= 1U << (byte % 32);
+}
+
+static void
+redos_set_fill(redos_set_t *set) {
+    memset(set->bits, 0xff, sizeof(set->bits));
+    set->wide = true;
+}
+
+static bool
+redos_set_overlaps(const redos_set_t *left, const redos_set_t *right) {
+    if (left->wide && right->wide) return true;
+
+    for (int index = 0; index < SINGLE_BYTE_SIZE / 32; index++) {
+        if (left->bits[index] & right->bits[index]) return true;
+    }
+
+    return false;
+}
+
+static void
+redos_set_cclass(redos_set_t *set, CClassNode *cclass_node) {
+    bool invert = IS_NCCLASS_NOT(cclass_node);
+
+    for (int byte = 0; byte < SINGLE_BYTE_SIZE; byte++) {
+        if ((BITSET_AT(cclass_node->bs, byte) != 0) != invert) redos_set_add(set, byte);
+    }
+
+    if (invert || cclass_node->mbuf != NULL) set->wide = true;
+}
+
+static void
+redos_set_ctype(redos_set_t *set, CtypeNode *ctype_node, OnigEncoding encoding) {
+    int limit = ONIGENC_MBC_MAXLEN(encoding) == 1 ? SINGLE_BYTE_SIZE : 0x80;
+
+    for (int byte = 0; byte < limit; byte++) {
+        if ((ONIGENC_IS_CODE_CTYPE(encoding, byte, ctype_node->ctype) != 0) != (ctype_node->not != 0)) redos_set_add(set, byte);
+    }
+
+    if (limit < SINGLE_BYTE_SIZE) set->wide = true;
+}
+
+// Adds the characters a node can start with to the set, and returns whether
+// it can match the empty string. Anything that cannot be followed, like
+// backreferences and calls, can start with any character.
+static bool
+redos_first(Node *node, OnigEncoding encoding, redos_set_t *set, int depth) {
+    if (depth >= REDOS_MAX_DEPTH) {
+        redos_set_fill(set);
+        return true;
+    }
+
+    switch (NTYPE(node)) {
+        case NT_STR:
+            if (NSTR(node)->s == NSTR(node)->end) return true;
+            redos_set_add(set, *NSTR(node)->s);
+            return false;
+        case NT_CCLASS:
+            redos_set_cclass(set, NCCLASS(node));
+            return false;
+        case NT_CTYPE:
+            redos_set_ctype(set, NCTYPE(node), encoding);
+            return false;
+        case NT_CANY:
+            redos_set_fill(set);
+            return false;
+        case NT_QTFR:
+            if (NQTFR(node)->upper == 0 || NQTFR(node)->target == NULL) return true;
+            return redos_first(NQTFR(node)->target, encoding, set, depth + 1) || NQTFR(node)->lower == 0;
+        case NT_ENCLOSE:
+            if (NENCLOSE(node)->type == ENCLOSE_ABSENT || NENCLOSE(node)->target == NULL) {
+                redos_set_fill(set);
+                return true;
+            }
+            return redos_first(NENCLOSE(node)->target, encoding, set, depth + 1);
+        case NT_ANCHOR:
+            return true;
+        case NT_LIST:
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                if (!redos_first(NCAR(cursor), encoding, set, depth + 1)) return false;
+            }
+            return true;
+        case NT_ALT: {
+            bool nullable = false;
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                if (redos_first(NCAR(cursor), encoding, set, depth + 1)) nullable = true;
+            }
+            return nullable;
+        }
+        default:
+            redos_set_fill(set);
+            return true;
+    }
+}
+
+static bool
+redos_nullable(Node *node, OnigEncoding encoding) {
+    redos_set_t set = { 0 };
+    return redos_first(node, encoding, &set, 0);
+}
+
+// Whether a node always matches exactly one character, looking through
+// groups, in which case the set holds the characters it can match.
+static bool
+redos_single(Node *node, OnigEncoding encoding, redos_set_t *set) {
+    while (NTYPE(node) == NT_ENCLOSE && (NENCLOSE(node)->type == ENCLOSE_MEMORY || NENCLOSE(node)->type == ENCLOSE_OPTION)) {
+        node = NENCLOSE(node)->target;
+        if (node == NULL) return false;
+    }
+
+    switch (NTYPE(node)) {
+        case NT_STR: {
+            StrNode *string_node = NSTR(node);
+            if (string_node->s == string_node->end) return false;
+            if (rb_enc_precise_mbclen((const char *) string_node->s, (const char *) string_node->end, encoding) != string_node->end - string_node->s) return false;
+
+            redos_set_add(set, *string_node->s);
+            return true;
+        }
+        case NT_CCLASS:
+            redos_set_cclass(set, NCCLASS(node));
+            return true;
+        case NT_CTYPE:
+            redos_set_ctype(set, NCTYPE(node), encoding);
+            return true;
+        case NT_CANY:
+            redos_set_fill(set);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether a node is an unbounded quantifier, looking through capture and
+// option groups but not atomic ones, which never backtrack into it.
+static QtfrNode *
+redos_unbounded(Node *node) {
+    while (NTYPE(node) == NT_ENCLOSE && (NENCLOSE(node)->type == ENCLOSE_MEMORY || NENCLOSE(node)->type == ENCLOSE_OPTION)) {
+        node = NENCLOSE(node)->target;
+        if (node == NULL) return NULL;
+    }
+
+    if (NTYPE(node) != NT_QTFR || !IS_REPEAT_INFINITE(NQTFR(node)->upper) || NQTFR(node)->target == NULL) return NULL;
+    return NQTFR(node);
+}
+
+static void
+redos_report(redos_t *redos, const char *kind, const char *severity, int degree, int extra, const int *extra_indices) {
+    VALUE path = rb_ary_new_capa(redos->depth + extra);
+    for (int index = 1; index <= redos->depth; index++) rb_ary_push(path, INT2FIX(redos->indices[index]));
+    for (int index = 0; index < extra; index++) rb_ary_push(path, INT2FIX(extra_indices[index]));
+
+    Node *node = redos->nodes[redos->depth];
+    for (int index = 0; index < extra; index++) {
+        switch (NTYPE(node)) {
+            case NT_LIST:
+            case NT_ALT:
+                for (int skip = 0; skip < extra_indices[index]; skip++) node = NCDR(node);
+                node = NCAR(node);
+                break;
+            case NT_QTFR:
+                node = NQTFR(node)->target;
+                break;
+            default:
+                node = NENCLOSE(node)->target;
+                break;
+        }
+    }
+
+    ID names[] = { rb_intern("@kind"), rb_intern("@severity"), rb_intern("@path"), rb_intern("@type"), rb_intern("@complexity"), rb_intern("@degree") };
+    VALUE values[] = {
+        ID2SYM(rb_intern(kind)),
+        ID2SYM(rb_intern(severity)),
+        rb_obj_freeze(path),
+        node_classes[flat_type(node)],
+        ID2SYM(rb_intern(degree == 0 ? "exponential" : "polynomial")),
+        degree == 0 ? Qnil : INT2FIX(degree)
+    };
+
+    rb_ary_push(redos->findings, rb_obj_freeze(build_object(rb_cOnigmoRedosFinding, 6, names, values)));
+}
+
+// A quantifier that repeats a varying number of times inside an unbounded
+// one, which makes the star height of the pattern above 1 when both are
+// unbounded. It is only ambiguous, and so exponential, if the outer body can
+// match the same input in more than one way: everything else in it has to be
+// nullable, or a single character or an unbounded quantifier over one that
+// overlaps the inner one, like the a in (a+a)+ or the second x+ in (x+x+)+,
+// and no atomic group may sit between them. Otherwise
+// each iteration matches one way, and nothing is reported.
+static void
+redos_nested(redos_t *redos) {
+    int outer = redos->depth - 1;
+    while (outer >= 0 && !(NTYPE(redos->nodes[outer]) == NT_QTFR && IS_REPEAT_INFINITE(NQTFR(redos->nodes[outer])->upper))) outer--;
+    if (outer < 0) return;
+
+    // The characters that the inner quantifier can start with.
+    redos_set_t inner = { 0 };
+    redos_first(NQTFR(redos->nodes[redos->depth])->target, redos->encoding, &inner, 0);
+
+    for (int index = outer + 1; index < redos->depth; index++) {
+        Node *node = redos->nodes[index];
+
+        if (NTYPE(node) == NT_ENCLOSE && NENCLOSE(node)->type != ENCLOSE_MEMORY && NENCLOSE(node)->type != ENCLOSE_OPTION) {
+            return;
+        } else if (NTYPE(node) == NT_LIST) {
+            int position = 0;
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor), position++) {
+                if (position == redos->indices[index + 1] || redos_nullable(NCAR(cursor), redos->encoding)) continue;
+
+                redos_set_t sibling = { 0 };
+                QtfrNode *quantifier = redos_unbounded(NCAR(cursor));
+                bool single = quantifier != NULL ? redos_single(quantifier->target, redos->encoding, &sibling) : redos_single(NCAR(cursor), redos->encoding, &sibling);
+                if (!single || !redos_set_overlaps(&inner, &sibling)) return;
+            }
+        }
+    }
+
+    redos_report(redos, "nested_quantifier", "high", 0, 0, NULL);
+}
+
+// Branches are compared character by character up to this many characters.
+#define REDOS_MAX_SEQUENCE 16
+
+// Whether a node always matches the same number of characters, one after
+// another, like ab or a[bc]. If so, the sets from index length on hold the
+// characters it can match at each position, and the new length is returned.
+// Otherwise -1 is returned.
+static int
+redos_sequence(Node *node, OnigEncoding encoding, redos_set_t *sets, int length, int depth) {
+    if (depth >= REDOS_MAX_DEPTH) return -1;
+
+    switch (NTYPE(node)) {
+        case NT_STR: {
+            StrNode *string_node = NSTR(node);
+            for (const UChar *cursor = string_node->s; cursor < string_node->end; cursor += enclen(encoding, cursor, string_node->end)) {
+                if (length == REDOS_MAX_SEQUENCE) return -1;
+                redos_set_add(&sets[length++], *cursor);
+            }
+            return length;
+        }
+        case NT_CCLASS:
+        case NT_CTYPE:
+        case NT_CANY:
+            if (length == REDOS_MAX_SEQUENCE) return -1;
+            redos_single(node, encoding, &sets[length]);
+            return length + 1;
+        case NT_QTFR: {
+            QtfrNode *quantifier = NQTFR(node);
+            if (quantifier->lower != quantifier->upper || quantifier->target == NULL) return -1;
+
+            for (int count = 0; count < quantifier->lower && length >= 0; count++) {
+                length = redos_sequence(quantifier->target, encoding, sets, length, depth + 1);
+            }
+            return length;
+        }
+        case NT_ENCLOSE:
+            if ((NENCLOSE(node)->type != ENCLOSE_MEMORY && NENCLOSE(node)->type != ENCLOSE_OPTION) || NENCLOSE(node)->target == NULL) return -1;
+            return redos_sequence(NENCLOSE(node)->target, encoding, sets, length, depth + 1);
+        case NT_LIST:
+            for (Node *cursor = node; IS_NOT_NULL(cursor) && length >= 0; cursor = NCDR(cursor)) {
+                length = redos_sequence(NCAR(cursor), encoding, sets, length, depth + 1);
+            }
+            return length;
+        default:
+            return -1;
+    }
+}
+
+// Whether repeating two sequences can match the same input, like a repeated
+// twice and aa, so that an unbounded quantifier over both can split it in more
+// than one way.
+static bool
+redos_sequences_overlap(const redos_set_t *left, int left_length, const redos_set_t *right, int right_length) {
+    int divisor = left_length, remainder = right_length;
+    while (remainder != 0) {
+        int next = divisor % remainder;
+        divisor = remainder;
+        remainder = next;
+    }
+
+    int multiple = left_length / divisor * right_length;
+    for (int index = 0; index < multiple; index++) {
+        if (!redos_set_overlaps(&left[index % left_length], &right[index % right_length])) return false;
+    }
+
+    return true;
+}
+
+// An alternation directly under an unbounded quantifier whose branches can
+// start with the same character. Branches that repeated can match the same
+// input, like (a|a)* or (a|aa)*, split it in exponentially many ways. Others
+// might only share a prefix, like (ab|ac)* or (a|ab)*, so all that is certain
+// is that both get tried, which is reported as polynomial.
+static void
+redos_alternation(redos_t *redos, Node *target) {
+    // The path from the quantifier down to the alternation.
+    int extra[REDOS_MAX_DEPTH];
+    int count = 0;
+
+    while (NTYPE(target) == NT_ENCLOSE && (NENCLOSE(target)->type == ENCLOSE_MEMORY || NENCLOSE(target)->type == ENCLOSE_OPTION)) {
+        target = NENCLOSE(target)->target;
+        if (target == NULL || count == REDOS_MAX_DEPTH) return;
+        extra[count++] = 0;
+    }
+
+    extra[count++] = 0;
+    if (NTYPE(target) != NT_ALT) return;
+
+    bool overlapping = false;
+
+    for (Node *left = target; IS_NOT_NULL(left); left = NCDR(left)) {
+        redos_set_t left_set = { 0 };
+        redos_first(NCAR(left), redos->encoding, &left_set, 0);
+
+        redos_set_t left_sequence[REDOS_MAX_SEQUENCE] = { 0 };
+        int left_length = redos_sequence(NCAR(left), redos->encoding, left_sequence, 0, 0);
+
+        for (Node *right = NCDR(left); IS_NOT_NULL(right); right = NCDR(right)) {
+            redos_set_t right_set = { 0 };
+            redos_first(NCAR(right), redos->encoding, &right_set, 0);
+            if (!redos_set_overlaps(&left_set, &right_set)) continue;
+
+            redos_set_t right_sequence[REDOS_MAX_SEQUENCE] = { 0 };
+            int right_length = redos_sequence(NCAR(right), redos->encoding, right_sequence, 0, 0);
+
+            if (left_length > 0 && right_length > 0 && redos_sequences_overlap(left_sequence, left_length, right_sequence, right_length)) {
+                redos_report(redos, "ambiguous_alternation", "high", 0, count, extra);
+                return;
+            }
+
+            overlapping = true;
+        }
+    }
+
+    if (overlapping) redos_report(redos, "ambiguous_alternation", "medium", 2, count, extra);
+}
+
+// Runs of adjacent unbounded quantifiers over single characters, where each
+// overlaps the one before it, like \d+\d+. A run of k of them can split the
+// same input k ways, which is polynomial of degree k.
+static void
+redos_adjacent(redos_t *redos, Node *list) {
+    redos_set_t previous = { 0 };
+    int run = 0, position = 0, last = 0;
+
+    for (Node *cursor = list; ; cursor = NCDR(cursor), position++) {
+        redos_set_t current = { 0 };
+        QtfrNode *quantifier = IS_NOT_NULL(cursor) ? redos_unbounded(NCAR(cursor)) : NULL;
+        bool single = quantifier != NULL && redos_single(quantifier->target, redos->encoding, &current);
+
+        if (single && run > 0 && redos_set_overlaps(&previous, &current)) {
+            run++;
+            last = position;
+        } else {
+            if (run >= 2) redos_report(redos, "overlapping_quantifiers", run == 2 ? "medium" : "high", run, 1, &last);
+            run = single ? 1 : 0;
+        }
+
+        if (IS_NULL(cursor)) break;
+        previous = current;
+    }
+}
+
+// An unbounded quantifier inside a bounded one that repeats more than once,
+// like (.*a){10}. If the inner quantifier can also match what follows it,
+// either the rest of the outer body or the start of the next iteration, each
+// iteration can end in many places, so a body repeated up to k times can
+// split the input in polynomially many ways of degree k. As with unbounded
+// outer quantifiers, an atomic group or a look-around in between rules it out.
+static void
+redos_bounded(redos_t *redos) {
+    int outer = redos->depth - 1;
+    while (outer >= 0 && NTYPE(redos->nodes[outer]) != NT_QTFR) outer--;
+    if (outer < 0) return;
+
+    QtfrNode *quantifier = NQTFR(redos->nodes[outer]);
+    if (IS_REPEAT_INFINITE(quantifier->upper) || quantifier->upper <= 1) return;
+
+    redos_set_t inner = { 0 };
+    redos_first(NQTFR(redos->nodes[redos->depth])->target, redos->encoding, &inner, 0);
+
+    // The characters that can come right after the inner quantifier.
+    redos_set_t follow = { 0 };
+    bool nullable = true;
+
+    for (int index = redos->depth - 1; index > outer; index--) {
+        Node *node = redos->nodes[index];
+
+        if (NTYPE(node) == NT_ANCHOR || (NTYPE(node) == NT_ENCLOSE && NENCLOSE(node)->type != ENCLOSE_MEMORY && NENCLOSE(node)->type != ENCLOSE_OPTION)) {
+            return;
+        } else if (NTYPE(node) == NT_LIST && nullable) {
+            int position = 0;
+            for (Node *cursor = node; IS_NOT_NULL(cursor) && nullable; cursor = NCDR(cursor), position++) {
+                if (position > redos->indices[index + 1]) nullable = redos_first(NCAR(cursor), redos->encoding, &follow, 0);
+            }
+        }
+    }
+
+    if (nullable) redos_first(quantifier->target, redos->encoding, &follow, 0);
+    if (!redos_set_overlaps(&inner, &follow)) return;
+
+    int degree = quantifier->upper < REDOS_MAX_SEQUENCE ? quantifier->upper : REDOS_MAX_SEQUENCE;
+    redos_report(redos, "nested_quantifier", degree == 2 ? "medium" : "high", degree, 0, NULL);
+}
+
+static void
+redos_visit(redos_t *redos, Node *node, int index) {
+    if (redos->depth + 1 >= REDOS_MAX_DEPTH) return;
+
+    redos->depth++;
+    redos->nodes[redos->depth] = node;
+    redos->indices[redos->depth] = index;
+
+    switch (NTYPE(node)) {
+        case NT_QTFR:
+            if (NQTFR(node)->target == NULL) break;
+
+            if (IS_REPEAT_INFINITE(NQTFR(node)->upper) || NQTFR(node)->upper > NQTFR(node)->lower) redos_nested(redos);
+            if (IS_REPEAT_INFINITE(NQTFR(node)->upper)) redos_bounded(redos);
+            if (IS_REPEAT_INFINITE(NQTFR(node)->upper)) redos_alternation(redos, NQTFR(node)->target);
+
+            redos_visit(redos, NQTFR(node)->target, 0);
+            break;
+        case NT_ENCLOSE:
+            if (NENCLOSE(node)->target != NULL) redos_visit(redos, NENCLOSE(node)->target, 0);
+            break;
+        case NT_ANCHOR:
+            if (NANCHOR(node)->target != NULL) redos_visit(redos, NANCHOR(node)->target, 0);
+            break;
+        case NT_LIST:
+            redos_adjacent(redos, node);
+            /* fallthrough */
+        case NT_ALT: {
+            int position = 0;
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                redos_visit(redos, NCAR(cursor), position++);
+            }
+            break;
+        }
+    }
+
+    redos->depth--;
+}
+
+static VALUE
+redos_run(VALUE data) {
+    redos_t *redos = (redos_t *) data;
+    OnigOptionType options;
+
+    VALUE string = resolve_source(redos->source, &redos->encoding, &options);
+    redos->root = parse_native(string, redos->encoding, options, &redos->regex);
+
+    redos->depth = -1;
+    redos_visit(redos, redos->root, 0);
+
+    return redos->findings;
+}
+
+static VALUE
+redos_free(VALUE data) {
+    redos_t *redos = (redos_t *) data;
+    if (redos->root != NULL) onig_node_free(redos->root);
+    if (redos->regex != NULL) onig_free(redos->regex);
+    xfree(redos);
+    return Qnil;
+}
+
+// The state is too large for the stack, so it is allocated up front and the
+// source is only resolved and parsed inside the ensure.
+static VALUE
+analyze_redos(VALUE self, VALUE source) {
+    VALUE findings = rb_ary_new();
+
+    redos_t *redos = ALLOC(redos_t);
+    redos->findings = findings;
+    redos->source = source;
+    redos->root = NULL;
+    redos->regex = NULL;
+
+    rb_ensure(redos_run, (VALUE) redos, redos_free, (VALUE) redos);
+    RB_GC_GUARD(source);
+
+    return findings;
+}
+
+static const char *const opcode_names[] = {
+    [OP_FINISH] = "finish",
+    [OP_END] = "end",
+    [OP_EXACT1] = "exact1",
+    [OP_EXACT2] = "exact2",
+    [OP_EXACT3] = "exact3",
+    [OP_EXACT4] = "exact4",
+    [OP_EXACT5] = "exact5",
+    [OP_EXACTN] = "exactn",
+    [OP_EXACTMB2N1] = "exactmb2n1",
+    [OP_EXACTMB2N2] = "exactmb2n2",
+    [OP_EXACTMB2N3] = "exactmb2n3",
+    [OP_EXACTMB2N] = "exactmb2n",
+    [OP_EXACTMB3N] = "exactmb3n",
+    [OP_EXACTMBN] = "exactmbn",
+    [OP_EXACT1_IC] = "exact1_ic",
+    [OP_EXACTN_IC] = "exactn_ic",
+    [OP_CCLASS] = "cclass",
+    [OP_CCLASS_MB] = "cclass_mb",
+    [OP_CCLASS_MIX] = "cclass_mix",
+    [OP_CCLASS_NOT] = "cclass_not",
+    [OP_CCLASS_MB_NOT] = "cclass_mb_not",
+    [OP_CCLASS_MIX_NOT] = "cclass_mix_not",
+    [OP_ANYCHAR] = "anychar",
+    [OP_ANYCHAR_ML] = "anychar_ml",
+    [OP_ANYCHAR_STAR] = "anychar_star",
+    [OP_ANYCHAR_ML_STAR] = "anychar_ml_star",
+    [OP_ANYCHAR_STAR_PEEK_NEXT] = "anychar_star_peek_next",
+    [OP_ANYCHAR_ML_STAR_PEEK_NEXT] = "anychar_ml_star_peek_next",
+    [OP_WORD] = "word",
+    [OP_NOT_WORD] = "not_word",
+    [OP_WORD_BOUND] = "word_bound",
+    [OP_NOT_WORD_BOUND] = "not_word_bound",
+    [OP_WORD_BEGIN] = "word_begin",
+    [OP_WORD_END] = "word_end",
+    [OP_ASCII_WORD] = "ascii_word",
+    [OP_NOT_ASCII_WORD] = "not_ascii_word",
+    [OP_ASCII_WORD_BOUND] = "ascii_word_bound",
+    [OP_NOT_ASCII_WORD_BOUND] = "not_ascii_word_bound",
+    [OP_ASCII_WORD_BEGIN] = "ascii_word_begin",
+    [OP_ASCII_WORD_END] = "ascii_word_end",
+    [OP_BEGIN_BUF] = "begin_buf",
+    [OP_END_BUF] = "end_buf",
+    [OP_BEGIN_LINE] = "begin_line",
+    [OP_END_LINE] = "end_line",
+    [OP_SEMI_END_BUF] = "semi_end_buf",
+    [OP_BEGIN_POSITION] = "begin_position",
+    [OP_BACKREF1] = "backref1",
+    [OP_BACKREF2] = "backref2",
+    [OP_BACKREFN] = "backrefn",
+    [OP_BACKREFN_IC] = "backrefn_ic",
+    [OP_BACKREF_MULTI] = "backref_multi",
+    [OP_BACKREF_MULTI_IC] = "backref_multi_ic",
+    [OP_BACKREF_WITH_LEVEL] = "backref_with_level",
+    [OP_MEMORY_START] = "memory_start",
+    [OP_MEMORY_START_PUSH] = "memory_start_push",
+    [OP_MEMORY_END_PUSH] = "memory_end_push",
+    [OP_MEMORY_END_PUSH_REC] = "memory_end_push_rec",
+    [OP_MEMORY_END] = "memory_end",
+    [OP_MEMORY_END_REC] = "memory_end_rec",
+    [OP_KEEP] = "keep",
+    [OP_FAIL] = "fail",
+    [OP_JUMP] = "jump",
+    [OP_PUSH] = "push",
+    [OP_POP] = "pop",
+    [OP_PUSH_OR_JUMP_EXACT1] = "push_or_jump_exact1",
+    [OP_PUSH_IF_PEEK_NEXT] = "push_if_peek_next",
+    [OP_REPEAT] = "repeat",
+    [OP_REPEAT_NG] = "repeat_ng",
+    [OP_REPEAT_INC] = "repeat_inc",
+    [OP_REPEAT_INC_NG] = "repeat_inc_ng",
+    [OP_REPEAT_INC_SG] = "repeat_inc_sg",
+    [OP_REPEAT_INC_NG_SG] = "repeat_inc_ng_sg",
+    [OP_NULL_CHECK_START] = "null_check_start",
+    [OP_NULL_CHECK_END] = "null_check_end",
+    [OP_NULL_CHECK_END_MEMST] = "null_check_end_memst",
+    [OP_NULL_CHECK_END_MEMST_PUSH] = "null_check_end_memst_push",
+    [OP_PUSH_POS] = "push_pos",
+    [OP_POP_POS] = "pop_pos",
+    [OP_PUSH_POS_NOT] = "push_pos_not",
+    [OP_FAIL_POS] = "fail_pos",
+    [OP_PUSH_STOP_BT] = "push_stop_bt",
+    [OP_POP_STOP_BT] = "pop_stop_bt",
+    [OP_LOOK_BEHIND] = "look_behind",
+    [OP_PUSH_LOOK_BEHIND_NOT] = "push_look_behind_not",
+    [OP_FAIL_LOOK_BEHIND_NOT] = "fail_look_behind_not",
+    [OP_PUSH_ABSENT_POS] = "push_absent_pos",
+    [OP_ABSENT] = "absent",
+    [OP_ABSENT_END] = "absent_end",
+    [OP_CALL] = "call",
+    [OP_RETURN] = "return",
+    [OP_CONDITION] = "condition",
+    [OP_STATE_CHECK_PUSH] = "state_check_push",
+    [OP_STATE_CHECK_PUSH_OR_JUMP] = "state_check_push_or_jump",
+    [OP_STATE_CHECK] = "state_check",
+    [OP_STATE_CHECK_ANYCHAR_STAR] = "state_check_anychar_star",
+    [OP_STATE_CHECK_ANYCHAR_ML_STAR] = "state_check_anychar_ml_star",
+    [OP_SET_OPTION_PUSH] = "set_option_push",
+    [OP_SET_OPTION] = "set_option"
+};
+
+#define OPCODE_COUNT ((int) (sizeof(opcode_names) / sizeof(opcode_names[0])))
+
+// Interned once at load time rather than on every decoded instruction.
+static ID opcode_ids[OPCODE_COUNT];
+
+static VALUE
+opcode_symbol(int opcode) {
+    if (opcode < 0 || opcode >= OPCODE_COUNT || opcode_names[opcode] == NULL) {
+        return Qnil;
+    }
+
+    return ID2SYM(opcode_ids[opcode]);
+}
+
+// Each of the readers below advances the cursor past one operand. When an
+// instruction array is given the operand is also decoded and pushed onto it,
+// otherwise it is skipped without allocating anything. Bytecode can come from
+// an untrusted dump, so every reader returns false without reading anything
+// if the operand would run past the end.
+static bool
+read_fits(const unsigned char *cursor, const unsigned char *end, long size) {
+    return size >= 0 && size <= end - cursor;
+}
+
+static bool
+read_memnum(const unsigned char **cursor, const unsigned char *end, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_MEMNUM)) return false;
+
+    MemNumType memnum;
+    GET_MEMNUM_INC(memnum, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, INT2NUM(memnum));
+    return true;
+}
+
+static bool
+read_reladdr(const unsigned char **cursor, const unsigned char *end, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_RELADDR)) return false;
+
+    RelAddrType address;
+    GET_RELADDR_INC(address, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, INT2NUM(address));
+    return true;
+}
+
+static bool
+read_absaddr(const unsigned char **cursor, const unsigned char *end, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_ABSADDR)) return false;
+
+    AbsAddrType address;
+    GET_ABSADDR_INC(address, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, INT2NUM(address));
+    return true;
+}
+
+static bool
+read_exact(const unsigned char **cursor, const unsigned char *end, long length, OnigEncoding encoding, VALUE insn) {
+    if (!read_fits(*cursor, end, length)) return false;
+
+    if (!NIL_P(insn)) rb_ary_push(insn, rb_enc_str_new((const char *) *cursor, length, encoding));
+    *cursor += length;
+    return true;
+}
+
+// Lengths are signed in the bytecode, so a negative one is rejected here and
+// the caller only ever sees a usable count.
+static bool
+read_length(const unsigned char **cursor, const unsigned char *end, VALUE insn, LengthType *length) {
+    if (!read_fits(*cursor, end, SIZE_LENGTH)) return false;
+
+    GET_LENGTH_INC(*length, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, INT2NUM(*length));
+    return *length >= 0;
+}
+
+static bool
+read_bitset(const unsigned char **cursor, const unsigned char *end, OnigEncoding encoding, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_BITSET)) return false;
+
+    if (!NIL_P(insn)) rb_ary_push(insn, build_bitset((BitSetRef) (*cursor), encoding));
+    *cursor += SIZE_BITSET;
+    return true;
+}
+
+static bool
+read_option(const unsigned char **cursor, const unsigned char *end, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_OPTION)) return false;
+
+    OnigOptionType option;
+    GET_OPTION_INC(option, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, build_options(option));
+    return true;
+}
+
+static bool
+read_state_check(const unsigned char **cursor, const unsigned char *end, VALUE insn) {
+    if (!read_fits(*cursor, end, SIZE_STATE_CHECK_NUM)) return false;
+
+    StateCheckNumType state_check;
+    GET_STATE_CHECK_NUM_INC(state_check, *cursor);
+    if (!NIL_P(insn)) rb_ary_push(insn, INT2NUM(state_check));
+    return true;
+}
+
+static bool
+read_codepoint(const unsigned char **cursor, const unsigned char *end, LengthType length, VALUE insn) {
+    if (!read_fits(*cursor, end, length)) return false;
+
+    const unsigned char *buffer = *cursor;
+
+#ifndef PLATFORM_UNALIGNED_WORD_ACCESS
+    ALIGNMENT_RIGHT(buffer);
+#endif
+
+    // The operand starts with the number of ranges that follow it.
+    if (!read_fits(buffer, *cursor + length, SIZE_CODE_POINT)) return false;
+
+    if (!NIL_P(insn)) {
+        OnigCodePoint code;
+        GET_CODE_POINT(code, buffer);
+        rb_ary_push(insn, UINT2NUM(code));
+    }
+
+    *cursor += length;
+    return true;
+}
+
+// Reads each of count memory numbers, as in backref_multi.
+static bool
+read_memnums(const unsigned char **cursor, const unsigned char *end, LengthType count, VALUE insn) {
+    if (!read_fits(*cursor, end, (long) count * SIZE_MEMNUM)) return false;
+
+    for (LengthType index = 0; index < count; index++) read_memnum(cursor, end, insn);
+    return true;
+}
+
+// Reads the instruction at the cursor and returns the position of the next
+// one. If insn is nil then the operands are skipped instead of decoded.
+// Returns NULL for an unknown opcode or an operand that runs past the end,
+// which bytecode that onigmo compiled itself never has.
+static const unsigned char *
+read_insn(const unsigned char *cursor, const unsigned char *end, OnigEncoding encoding, VALUE insn) {
+    if (cursor >= end) return NULL;
+
+    int opcode = *cursor++;
+    VALUE symbol = opcode_symbol(opcode);
+    if (NIL_P(symbol)) return NULL;
+    if (!NIL_P(insn)) rb_ary_push(insn, symbol);
+
+    LengthType length, mb_length, level;
+    bool valid = true;
+
+    switch (opcode) {
+        case OP_EXACT1:
+        case OP_ANYCHAR_STAR_PEEK_NEXT:
+        case OP_ANYCHAR_ML_STAR_PEEK_NEXT:
+            valid = read_exact(&cursor, end, 1, encoding, insn);
+            break;
+        case OP_EXACT2:
+        case OP_EXACTMB2N1:
+            valid = read_exact(&cursor, end, 2, encoding, insn);
+            break;
+        case OP_EXACT3:
+            valid = read_exact(&cursor, end, 3, encoding, insn);
+            break;
+        case OP_EXACT4:
+        case OP_EXACTMB2N2:
+            valid = read_exact(&cursor, end, 4, encoding, insn);
+            break;
+        case OP_EXACT5:
+            valid = read_exact(&cursor, end, 5, encoding, insn);
+            break;
+        case OP_EXACTMB2N3:
+            valid = read_exact(&cursor, end, 6, encoding, insn);
+            break;
+        case OP_EXACTN:
+        case OP_EXACTN_IC:
+            valid = read_length(&cursor, end, insn, &length) && read_exact(&cursor, end, length, encoding, insn);
+            break;
+        case OP_EXACTMB2N:
+            valid = read_length(&cursor, end, insn, &length) && read_exact(&cursor, end, (long) length * 2, encoding, insn);
+            break;
+        case OP_EXACTMB3N:
+            valid = read_length(&cursor, end, insn, &length) && read_exact(&cursor, end, (long) length * 3, encoding, insn);
+            break;
+        case OP_EXACTMBN:
+            valid =
+                read_length(&cursor, end, insn, &mb_length) &&
+                read_length(&cursor, end, insn, &length) &&
+                read_exact(&cursor, end, (long) length * mb_length, encoding, insn);
+            break;
+        case OP_EXACT1_IC:
+            valid = cursor < end && read_exact(&cursor, end, enclen(encoding, cursor, end), encoding, insn);
+            break;
+        case OP_CCLASS:
+        case OP_CCLASS_NOT:
+            valid = read_bitset(&cursor, end, encoding, insn);
+            break;
+        case OP_CCLASS_MB:
+        case OP_CCLASS_MB_NOT:
+            valid = read_length(&cursor, end, insn, &length) && read_codepoint(&cursor, end, length, insn);
+            break;
+        case OP_CCLASS_MIX:
+        case OP_CCLASS_MIX_NOT:
+            valid =
+                read_bitset(&cursor, end, encoding, insn) &&
+                read_length(&cursor, end, insn, &length) &&
+                read_codepoint(&cursor, end, length, insn);
+            break;
+        case OP_BACKREFN:
+        case OP_BACKREFN_IC:
+        case OP_MEMORY_START:
+        case OP_MEMORY_START_PUSH:
+        case OP_MEMORY_END_PUSH:
+        case OP_MEMORY_END_PUSH_REC:
+        case OP_MEMORY_END:
+        case OP_MEMORY_END_REC:
+        case OP_REPEAT_INC:
+        case OP_REPEAT_INC_NG:
+        case OP_REPEAT_INC_SG:
+        case OP_REPEAT_INC_NG_SG:
+        case OP_NULL_CHECK_START:
+        case OP_NULL_CHECK_END:
+        case OP_NULL_CHECK_END_MEMST:
+        case OP_NULL_CHECK_END_MEMST_PUSH:
+            valid = read_memnum(&cursor, end, insn);
+            break;
+        case OP_BACKREF_MULTI:
+        case OP_BACKREF_MULTI_IC:
+            valid = read_length(&cursor, end, insn, &length) && read_memnums(&cursor, end, length, insn);
+            break;
+        case OP_BACKREF_WITH_LEVEL:
+            valid =
+                read_option(&cursor, end, insn) &&
+                read_length(&cursor, end, insn, &level) &&
+                read_length(&cursor, end, insn, &length) &&
+                read_memnums(&cursor, end, length, insn);
+            break;
+        case OP_JUMP:
+        case OP_PUSH:
+        case OP_PUSH_POS_NOT:
+        case OP_ABSENT:
+            valid = read_reladdr(&cursor, end, insn);
+            break;
+        case OP_PUSH_OR_JUMP_EXACT1:
+        case OP_PUSH_IF_PEEK_NEXT:
+            valid = read_reladdr(&cursor, end, insn) && read_exact(&cursor, end, 1, encoding, insn);
+            break;
+        case OP_REPEAT:
+        case OP_REPEAT_NG:
+        case OP_CONDITION:
+            valid = read_memnum(&cursor, end, insn) && read_reladdr(&cursor, end, insn);
+            break;
+        case OP_LOOK_BEHIND:
+            valid = read_length(&cursor, end, insn, &length);
+            break;
+        case OP_PUSH_LOOK_BEHIND_NOT:
+            valid = read_reladdr(&cursor, end, insn) && read_length(&cursor, end, insn, &length);
+            break;
+        case OP_CALL:
+            valid = read_absaddr(&cursor, end, insn);
+            break;
+        case OP_STATE_CHECK_PUSH:
+        case OP_STATE_CHECK_PUSH_OR_JUMP:
+            valid = read_state_check(&cursor, end, insn) && read_reladdr(&cursor, end, insn);
+            break;
+        case OP_STATE_CHECK:
+        case OP_STATE_CHECK_ANYCHAR_STAR:
+        case OP_STATE_CHECK_ANYCHAR_ML_STAR:
+            valid = read_state_check(&cursor, end, insn);
+            break;
+        case OP_SET_OPTION_PUSH:
+        case OP_SET_OPTION:
+            valid = read_option(&cursor, end, insn);
+            break;
+        default:
+            break;
+    }
+
+    return valid ? cursor : NULL;
+}
+
+// Like read_insn, but raises for malformed bytecode, with the offset of the
+// instruction from start.
+static const unsigned char *
+read_insn_checked(const unsigned char *start, const unsigned char *cursor, const unsigned char *end, OnigEncoding encoding, VALUE insn) {
+    const unsigned char *next = read_insn(cursor, end, encoding, insn);
+    if (next == NULL) rb_raise(rb_eArgError, "malformed bytecode at offset %ld", (long) (cursor - start));
+    return next;
+}
+
+// Owns a compiled regex for Onigmo.compile(source, lazy: true). The offset of
+// every instruction is computed up front by skipping over the operands, so
+// that individual instructions can be decoded on demand. Programs built from a
+// Regexp or loaded from a dump have no regex at all, only their own copy of the
+// bytecode or bytes borrowed from their owner.
+typedef struct {
+    regex_t *regex;
+    VALUE owner;
+    const unsigned char *bytecode;
+    unsigned int bytesize;
+    OnigEncoding encoding;
+    bool copied;
+    long size;
+    long capa;
+    unsigned int *offsets;
+} program_t;
+
+static void
+program_mark(void *data) {
+    rb_gc_mark(((program_t *) data)->owner);
+}
+
+static void
+program_free(void *data) {
+    program_t *program = (program_t *) data;
+
+    if (program->regex != NULL) onig_free(program->regex);
+    if (program->copied) xfree((void *) program->bytecode);
+    xfree(program->offsets);
+    xfree(program);
+}
+
+static size_t
+program_memsize(const void *data) {
+    const program_t *program = (const program_t *) data;
+    size_t regex_size = program->regex != NULL ? onig_memsize(program->regex) : 0;
+    size_t bytecode_size = program->copied ? program->bytesize : 0;
+    return sizeof(program_t) + regex_size + bytecode_size + (program->capa * sizeof(unsigned int));
+}
+
+static const rb_data_type_t program_type = {
+    .wrap_struct_name = "Onigmo::Program",
+    .function = {
+        .dmark = program_mark,
+        .dfree = program_free,
+        .dsize = program_memsize
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+program_index_insns(program_t *program) {
+    const unsigned char *cursor = program->bytecode;
+    const unsigned char *end = cursor + program->bytesize;
+
+    while (cursor < end) {
+        if (program->size == program->capa) {
+            program->capa = program->capa == 0 ? 16 : program->capa * 2;
+            REALLOC_N(program->offsets, unsigned int, program->capa);
+        }
+
+        program->offsets[program->size++] = (unsigned int) (cursor - program->bytecode);
+        cursor = read_insn_checked(program->bytecode, cursor, end, program->encoding, Qnil);
+    }
+}
+
+// Takes ownership of the regex, unless it is borrowed from a Regexp. Ruby
+// replaces and frees the regex_t of a Regexp when it is matched against a
+// string in another encoding, so only a copy of its bytecode is kept.
+static VALUE
+build_program(regex_t *regex, bool borrowed) {
+    program_t *program;
+    VALUE object = TypedData_Make_Struct(rb_cOnigmoProgram, program_t, &program_type, program);
+    program->owner = Qnil;
+    program->bytesize = regex->used;
+    program->encoding = regex->enc;
+
+    if (borrowed) {
+        unsigned char *copy = ALLOC_N(unsigned char, program->bytesize);
+        memcpy(copy, regex->p, program->bytesize);
+        program->bytecode = copy;
+        program->copied = true;
+    } else {
+        program->regex = regex;
+        program->bytecode = regex->p;
+    }
+
+    program_index_insns(program);
+    return object;
+}
+
+// Builds a program over bytecode that was previously dumped. The bytes are
+// borrowed when they can neither move nor change, and copied otherwise.
+static VALUE
+program_from_bytecode(VALUE self, VALUE bytecode, VALUE encoding) {
+    StringValue(bytecode);
+
+    program_t *program;
+    VALUE object = TypedData_Make_Struct(rb_cOnigmoProgram, program_t, &program_type, program);
+    program->owner = Qnil;
+    program->bytesize = (unsigned int) RSTRING_LEN(bytecode);
+    program->encoding = rb_to_encoding(encoding);
+
+    if (pattern_borrowable(bytecode)) {
+        program->owner = bytecode;
+        program->bytecode = (const unsigned char *) RSTRING_PTR(bytecode);
+    } else {
+        unsigned char *copy = ALLOC_N(unsigned char, program->bytesize);
+        memcpy(copy, RSTRING_PTR(bytecode), program->bytesize);
+        program->bytecode = copy;
+        program->copied = true;
+    }
+
+    program_index_insns(program);
+    return object;
+}
+
+static program_t *
+program_get(VALUE self) {
+    program_t *program;
+    TypedData_Get_Struct(self, program_t, &program_type, program);
+    return program;
+}
+
+static long
+program_index(program_t *program, VALUE index) {
+    long value = NUM2LONG(index);
+    if (value < 0) value += program->size;
+    return (value < 0 || value >= program->size) ? -1 : value;
+}
+
+static VALUE
+program_insn(program_t *program, long index) {
+    VALUE insn = rb_ary_new();
+    read_insn(program->bytecode + program->offsets[index], program->bytecode + program->bytesize, program->encoding, insn);
+
+    return insn;
+}
+
+static VALUE
+program_size(VALUE self) {
+    return LONG2NUM(program_get(self)->size);
+}
+
+static VALUE
+program_bytesize(VALUE self) {
+    return UINT2NUM(program_get(self)->bytesize);
+}
+
+static VALUE
+program_bytecode(VALUE self) {
+    program_t *program = program_get(self);
+    return rb_str_new((const char *) program->bytecode, program->bytesize);
+}
+
+static VALUE
+program_encoding(VALUE self) {
+    return rb_enc_from_encoding(program_get(self)->encoding);
+}
+
+static VALUE
+program_aref(VALUE self, VALUE index) {
+    program_t *program = program_get(self);
+    long value = program_index(program, index);
+    return value == -1 ? Qnil : program_insn(program, value);
+}
+
+static VALUE
+program_opcode_at(VALUE self, VALUE index) {
+    program_t *program = program_get(self);
+    long value = program_index(program, index);
+    return value == -1 ? Qnil : opcode_symbol(program->bytecode[program->offsets[value]]);
+}
+
+static VALUE
+program_enum_size(VALUE self, VALUE args, VALUE eobj) {
+    return program_size(self);
+}
+
+static VALUE
+program_each(VALUE self) {
+    RETURN_SIZED_ENUMERATOR(self, 0, 0, program_enum_size);
+
+    program_t *program = program_get(self);
+    for (long index = 0; index < program->size; index++) {
+        rb_yield(program_insn(program, index));
+    }
+
+    return self;
+}
+
+static VALUE
+build_insns(regex_t *regex) {
+    VALUE insns = rb_ary_new();
+    const unsigned char *cursor = regex->p;
+    const unsigned char *end = cursor + regex->used;
+
+    while (cursor < end) {
+        VALUE insn = rb_ary_new();
+        cursor = read_insn_checked(regex->p, cursor, end, regex->enc, insn);
+        rb_ary_push(insns, insn);
+    }
+
+    return insns;
+}
+
+// Frees the regex that compile owns even when building the instructions
+// raises.
+static VALUE
+compile_insns(VALUE data) {
+    return build_insns((regex_t *) data);
+}
+
+static VALUE
+compile_free(VALUE data) {
+    onig_free((regex_t *) data);
+    return Qnil;
+}
+
+static VALUE
+compile(int argc, VALUE *argv, VALUE self) {
+    VALUE source, keywords;
+    rb_scan_args(argc, argv, "1:", &source, &keywords);
+
+    bool lazy = false;
+    if (!NIL_P(keywords)) {
+        ID keyword_ids[] = { rb_intern("lazy") };
+        VALUE keyword_values[1];
+        rb_get_kwargs(keywords, keyword_ids, 0, 1, keyword_values);
+        lazy = keyword_values[0] != Qundef && RTEST(keyword_values[0]);
+    }
+
+    OnigEncoding encoding;
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &encoding, &options);
+
+    // A Regexp has already been compiled by Ruby, so its bytecode is read
+    // directly instead of compiling the source again.
+    if (RB_TYPE_P(source, T_REGEXP)) {
+        regex_t *regex = RREGEXP_PTR(source);
+        if (regex == NULL) rb_raise(rb_eTypeError, "uninitialized Regexp");
+
+        return lazy ? build_program(regex, true) : build_insns(regex);
+    }
+
+    const OnigUChar *pattern = (const OnigUChar *) RSTRING_PTR(string);
+    const OnigUChar *pattern_end = pattern + RSTRING_LEN(string);
+
+    VALUE key = Qnil;
+    if (!lazy && cache_enabled()) {
+        key = cache_key(CACHE_KIND_COMPILE, options, encoding, string);
+
+        VALUE cached = cache_fetch(key);
+        if (cached != Qundef) return cached;
+    }
+
+    regex_t *regex;
+    OnigErrorInfo einfo;
+
+    int result = onig_new(&regex, pattern, pattern_end, options, encoding, ONIG_SYNTAX_DEFAULT, &einfo);
+
+    if (result != ONIG_NORMAL) {
+        fail(result, regex, &einfo);
+        return Qnil;
+    }
+
+    if (lazy) {
+        return build_program(regex, false);
+    }
+
+    VALUE insns = rb_ensure(compile_insns, (VALUE) regex, compile_free, (VALUE) regex);
+    return NIL_P(key) ? insns : cache_store(key, insns);
+}
+
+static const char *const optimize_names[] = {
+    [ONIG_OPTIMIZE_NONE] = "none",
+    [ONIG_OPTIMIZE_EXACT] = "exact",
+    [ONIG_OPTIMIZE_EXACT_BM] = "exact_bm",
+    [ONIG_OPTIMIZE_EXACT_BM_NOT_REV] = "exact_bm_not_rev",
+    [ONIG_OPTIMIZE_EXACT_IC] = "exact_ic",
+    [ONIG_OPTIMIZE_MAP] = "map",
+    [ONIG_OPTIMIZE_EXACT_BM_IC] = "exact_bm_ic",
+    [ONIG_OPTIMIZE_EXACT_BM_NOT_REV_IC] = "exact_bm_not_rev_ic"
+};
+
+// Indexed by bit position in the ANCHOR_* flags.
+static const char *const anchor_names[] = {
+    "begin_buf", "begin_line", "begin_position", "end_buf", "semi_end_buf", "end_line",
+    "word_bound", "not_word_bound", "word_begin", "word_end", "prec_read", "prec_read_not",
+    "look_behind", "look_behind_not", "anychar_star", "anychar_star_ml", "keep"
+};
+
+static VALUE
+optimization_anchors(int anchor) {
+    VALUE anchors = rb_ary_new();
+
+    for (size_t bit = 0; bit < sizeof(anchor_names) / sizeof(anchor_names[0]); bit++) {
+        if (anchor & (1 << bit)) rb_ary_push(anchors, ID2SYM(rb_intern(anchor_names[bit])));
+    }
+
+    return rb_ary_freeze(anchors);
+}
+
+static VALUE
+optimization_distance(OnigDistance distance) {
+    return distance == ONIG_INFINITE_DISTANCE ? Qnil : SIZET2NUM(distance);
+}
+
+static VALUE
+build_optimization_info(regex_t *regex) {
+    VALUE info = rb_hash_new();
+    int optimize = regex->optimize;
+
+    VALUE name = Qnil;
+    if (optimize >= 0 && (size_t) optimize < sizeof(optimize_names) / sizeof(optimize_names[0]) && optimize_names[optimize]) {
+        name = ID2SYM(rb_intern(optimize_names[optimize]));
+    }
+
+    // exact is only meaningful for the exact modes, and map is a Boyer-Moore
+    // skip table rather than a set of characters for everything but map.
+    VALUE exact = Qnil;
+    if (optimize != ONIG_OPTIMIZE_NONE && optimize != ONIG_OPTIMIZE_MAP && regex->exact != NULL) {
+        exact = rb_obj_freeze(rb_enc_str_new((const char *) regex->exact, regex->exact_end - regex->exact, regex->enc));
+    }
+
+    VALUE map = Qnil;
+    if (optimize == ONIG_OPTIMIZE_MAP) {
+        map = rb_ary_new();
+
+        for (int byte = 0; byte < ONIG_CHAR_TABLE_SIZE; byte++) {
+            if (regex->map[byte]) {
+                char character = (char) byte;
+                rb_ary_push(map, rb_obj_freeze(rb_enc_str_new(&character, 1, regex->enc)));
+            }
+        }
+
+        rb_ary_freeze(map);
+    }
+
+    rb_hash_aset(info, ID2SYM(rb_intern("optimize")), name);
+    rb_hash_aset(info, ID2SYM(rb_intern("exact")), exact);
+    rb_hash_aset(info, ID2SYM(rb_intern("map")), map);
+    rb_hash_aset(info, ID2SYM(rb_intern("anchor")), optimization_anchors(regex->anchor));
+    rb_hash_aset(info, ID2SYM(rb_intern("anchor_dmin")), optimization_distance(regex->anchor_dmin));
+    rb_hash_aset(info, ID2SYM(rb_intern("anchor_dmax")), optimization_distance(regex->anchor_dmax));
+    rb_hash_aset(info, ID2SYM(rb_intern("sub_anchor")), optimization_anchors(regex->sub_anchor));
+    rb_hash_aset(info, ID2SYM(rb_intern("dmin")), optimization_distance(regex->dmin));
+    rb_hash_aset(info, ID2SYM(rb_intern("dmax")), optimization_distance(regex->dmax));
+    rb_hash_aset(info, ID2SYM(rb_intern("threshold_len")), INT2NUM(regex->threshold_len));
+
+    return rb_hash_freeze(info);
+}
+
+// Like compile, a Regexp is read as it is rather than compiled again.
+static VALUE
+optimization_info(VALUE self, VALUE source) {
+    OnigEncoding encoding;
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &encoding, &options);
+
+    if (RB_TYPE_P(source, T_REGEXP)) {
+        regex_t *regex = RREGEXP_PTR(source);
+        if (regex == NULL) rb_raise(rb_eTypeError, "uninitialized Regexp");
+
+        return build_optimization_info(regex);
+    }
+
+    regex_t *regex;
+    OnigErrorInfo einfo;
+    const OnigUChar *pattern = (const OnigUChar *) RSTRING_PTR(string);
+
+    int result = onig_new(&regex, pattern, pattern + RSTRING_LEN(string), options, encoding, ONIG_SYNTAX_DEFAULT, &einfo);
+    if (result != ONIG_NORMAL) {
+        fail(result, regex, &einfo);
+        return Qnil;
+    }
+
+    VALUE info = build_optimization_info(regex);
+    onig_free(regex);
+    return info;
+}
+
+// An instrumented interpreter for the same bytecode that compile decodes. It
+// follows match_at in onigmo's regexec.c instruction for instruction, except
+// that captures are kept as positions and restored from the stack when
+// backtracking, rather than being indexes into the stack. Every start
+// position is tried in turn, with none of onigmo's search optimizations other
+// than the \A and \G anchors. Subexpression calls, absent groups, and
+// backreferences with a nest level are not supported.
+typedef enum {
+    VM_ALT,
+    VM_POS_NOT,
+    VM_LOOK_BEHIND_NOT,
+    VM_MEM_START,
+    VM_MEM_END,
+    VM_REPEAT,
+    VM_REPEAT_INC,
+    VM_NULL_CHECK_START,
+    VM_POS,
+    VM_STOP_BT,
+    VM_VOID
+} vm_entry_type_t;
+
+// Entries up to VM_LOOK_BEHIND_NOT are the ones that backtracking resumes at.
+#define VM_BACKTRACK_POINT_P(type) ((type) <= VM_LOOK_BEHIND_NOT)
+
+typedef struct {
+    vm_entry_type_t type;
+    // The group, repeat, or null check number. For VM_REPEAT_INC, the index
+    // of the VM_REPEAT entry that it incremented.
+    int number;
+    int count;
+    const UChar *pcode;
+    const UChar *s;
+    const UChar *keep;
+    // The previous bounds of the group, for VM_MEM_START and VM_MEM_END.
+    const UChar *start;
+    const UChar *end;
+} vm_entry_t;
+
+typedef struct {
+    VALUE source;
+    VALUE subject;
+    regex_t *regex;
+    bool owned;
+    const UChar *str;
+    const UChar *end;
+    vm_entry_t *stack;
+    long stack_size;
+    long stack_capa;
+    const UChar **mem_start;
+    const UChar **mem_end;
+    long *repeat_stack;
+    size_t *counts;
+    size_t steps;
+    size_t starts;
+    size_t pushes;
+    size_t pops;
+    size_t max_depth;
+    long match_start;
+    long match_end;
+    // Running out of either budget stops the interpreter before the next
+    // instruction. Pushes past max_stack go to overflow instead, so that the
+    // instruction in progress can finish without growing the stack.
+    size_t max_steps;
+    size_t max_stack;
+    bool exceeded;
+    vm_entry_t overflow;
+} vm_t;
+
+static vm_entry_t *
+vm_push(vm_t *vm, vm_entry_type_t type) {
+    if ((size_t) vm->stack_size >= vm->max_stack) {
+        vm->exceeded = true;
+        return &vm->overflow;
+    }
+
+    if (vm->stack_size == vm->stack_capa) {
+        vm->stack_capa = vm->stack_capa == 0 ? 64 : vm->stack_capa * 2;
+        REALLOC_N(vm->stack, vm_entry_t, vm->stack_capa);
+    }
+
+    vm_entry_t *entry = &vm->stack[vm->stack_size++];
+    entry->type = type;
+
+    if ((size_t) vm->stack_size > vm->max_depth) vm->max_depth = vm->stack_size;
+    return entry;
+}
+
+static void
+vm_push_alt(vm_t *vm, vm_entry_type_t type, const UChar *pcode, const UChar *s, const UChar *keep) {
+    vm_entry_t *entry = vm_push(vm, type);
+    entry->pcode = pcode;
+    entry->s = s;
+    entry->keep = keep;
+    vm->pushes++;
+}
+
+static void
+vm_push_mem(vm_t *vm, vm_entry_type_t type, int number) {
+    vm_entry_t *entry = vm_push(vm, type);
+    entry->number = number;
+    entry->start = vm->mem_start[number];
+    entry->end = vm->mem_end[number];
+}
+
+// Undoes an entry that is popped on the way to a backtrack point.
+static void
+vm_unwind(vm_t *vm, const vm_entry_t *entry) {
+    switch (entry->type) {
+        case VM_MEM_START:
+        case VM_MEM_END:
+            vm->mem_start[entry->number] = entry->start;
+            vm->mem_end[entry->number] = entry->end;
+            break;
+        case VM_REPEAT_INC:
+            vm->stack[entry->number].count--;
+            break;
+        default:
+            break;
+    }
+}
+
+static bool
+vm_backtrack(vm_t *vm, const UChar **p, const UChar **s, const UChar **keep) {
+    while (vm->stack_size > 0) {
+        const vm_entry_t *entry = &vm->stack[--vm->stack_size];
+
+        if (VM_BACKTRACK_POINT_P(entry->type)) {
+            *p = entry->pcode;
+            *s = entry->s;
+            *keep = entry->keep;
+            vm->pops++;
+            return true;
+        }
+
+        vm_unwind(vm, entry);
+    }
+
+    return false;
+}
+
+// Pops everything down to and including the innermost entry of the given
+// type, for when the body of a negative lookaround matches.
+static void
+vm_pop_until(vm_t *vm, vm_entry_type_t type) {
+    while (vm->stack_size > 0) {
+        const vm_entry_t *entry = &vm->stack[--vm->stack_size];
+        if (entry->type == type) return;
+        vm_unwind(vm, entry);
+    }
+}
+
+// Turns the innermost entry of the given type, and every backtrack point and
+// null check above it, into no-ops. This is what makes lookaheads and atomic
+// groups impossible to backtrack into once they have matched.
+static const vm_entry_t *
+vm_void_until(vm_t *vm, vm_entry_type_t type) {
+    for (long index = vm->stack_size - 1; index >= 0; index--) {
+        vm_entry_t *entry = &vm->stack[index];
+
+        if (entry->type == type) {
+            entry->type = VM_VOID;
+            return entry;
+        }
+
+        if (VM_BACKTRACK_POINT_P(entry->type) || entry->type == VM_NULL_CHECK_START) entry->type = VM_VOID;
+    }
+
+    rb_raise(rb_eRuntimeError, "unbalanced bytecode");
+}
+
+static long
+vm_find(const vm_t *vm, vm_entry_type_t type, int number) {
+    for (long index = vm->stack_size - 1; index >= 0; index--) {
+        if (vm->stack[index].type == type && vm->stack[index].number == number) return index;
+    }
+
+    rb_raise(rb_eRuntimeError, "unbalanced bytecode");
+}
+
+static const UChar *
+vm_prev(const vm_t *vm, const UChar *s) {
+    return s == vm->str ? NULL : onigenc_get_prev_char_head(vm->regex->enc, vm->str, s, vm->end);
+}
+
+static bool
+vm_word_p(const vm_t *vm, const UChar *s, bool ascii) {
+    OnigEncoding encoding = vm->regex->enc;
+    return ascii ? ONIGENC_IS_MBC_ASCII_WORD(encoding, s, vm->end) : ONIGENC_IS_MBC_WORD(encoding, s, vm->end);
+}
+
+static bool
+vm_in_ranges(const UChar *ranges, OnigCodePoint code) {
+#ifndef PLATFORM_UNALIGNED_WORD_ACCESS
+    ALIGNMENT_RIGHT(ranges);
+#endif
+    return onig_is_in_code_range(ranges, code);
+}
+
+// Compares length bytes at left with the text at *right, both case folded,
+// and advances *right past the text on success.
+static bool
+vm_fold_equal(const vm_t *vm, const UChar *left, long length, const UChar **right) {
+    OnigEncoding encoding = vm->regex->enc;
+    OnigCaseFoldType flag = vm->regex->case_fold_flag;
+    UChar left_buffer[ONIGENC_MBC_CASE_FOLD_MAXLEN];
+    UChar right_buffer[ONIGENC_MBC_CASE_FOLD_MAXLEN];
+
+    const UChar *left_end = left + length;
+    const UChar *cursor = *right;
+
+    while (left < left_end) {
+        if (cursor >= vm->end) return false;
+
+        int left_length = ONIGENC_MBC_CASE_FOLD(encoding, flag, &left, left_end, left_buffer);
+        int right_length = ONIGENC_MBC_CASE_FOLD(encoding, flag, &cursor, vm->end, right_buffer);
+        if (left_length != right_length || memcmp(left_buffer, right_buffer, left_length) != 0) return false;
+    }
+
+    *right = cursor;
+    return true;
+}
+
+// Matches the text at s against the captured text of a group, advancing s.
+static bool
+vm_backref(const vm_t *vm, int number, bool fold, const UChar **s) {
+    if (number > vm->regex->num_mem || vm->mem_start[number] == NULL || vm->mem_end[number] == NULL) return false;
+
+    const UChar *start = vm->mem_start[number];
+    long length = vm->mem_end[number] - start;
+    if (vm->end - *s < length) return false;
+
+    if (fold) return vm_fold_equal(vm, start, length, s);
+    if (memcmp(start, *s, length) != 0) return false;
+
+    *s += length;
+    return true;
+}
+
+static bool
+vm_match_at(vm_t *vm, const UChar *sstart) {
+    regex_t *regex = vm->regex;
+    OnigEncoding encoding = regex->enc;
+    const UChar *str = vm->str;
+    const UChar *end = vm->end;
+
+    const UChar *p = regex->p;
+    const UChar *s = sstart;
+    const UChar *keep = sstart;
+
+    for (int index = 0; index <= regex->num_mem; index++) {
+        vm->mem_start[index] = NULL;
+        vm->mem_end[index] = NULL;
+    }
+
+    vm->stack_size = 0;
+
+    while (true) {
+        if (vm->exceeded || vm->steps >= vm->max_steps) {
+            vm->exceeded = true;
+            return false;
+        }
+
+        if (vm->counts != NULL) vm->counts[p - regex->p]++;
+        if ((++vm->steps & 0xffff) == 0) rb_thread_check_ints();
+
+        int opcode = *p++;
+        MemNumType mem;
+        RelAddrType addr;
+        LengthType length;
+
+        switch (opcode) {
+            case OP_END:
+                vm->match_start = (keep > s ? s : keep) - str;
+                vm->match_end = s - str;
+                return true;
+            case OP_EXACT1:
+            case OP_EXACT2:
+            case OP_EXACT3:
+            case OP_EXACT4:
+            case OP_EXACT5:
+            case OP_EXACTMB2N1:
+            case OP_EXACTMB2N2:
+            case OP_EXACTMB2N3:
+            case OP_EXACTN:
+            case OP_EXACTMB2N:
+            case OP_EXACTMB3N:
+            case OP_EXACTMBN: {
+                switch (opcode) {
+                    case OP_EXACT1: length = 1; break;
+                    case OP_EXACT2: case OP_EXACTMB2N1: length = 2; break;
+                    case OP_EXACT3: length = 3; break;
+                    case OP_EXACT4: case OP_EXACTMB2N2: length = 4; break;
+                    case OP_EXACT5: length = 5; break;
+                    case OP_EXACTMB2N3: length = 6; break;
+                    case OP_EXACTN: GET_LENGTH_INC(length, p); break;
+                    case OP_EXACTMB2N: GET_LENGTH_INC(length, p); length *= 2; break;
+                    case OP_EXACTMB3N: GET_LENGTH_INC(length, p); length *= 3; break;
+                    default: {
+                        LengthType character_length;
+                        GET_LENGTH_INC(character_length, p);
+                        GET_LENGTH_INC(length, p);
+                        length *= character_length;
+                        break;
+                    }
+                }
+
+                if (end - s < length || memcmp(p, s, length) != 0) goto fail;
+                p += length;
+                s += length;
                 break;
             }
-            case OP_WORD_BOUND: {
-                rb_ary_push(insn, ID2SYM(rb_intern("word_bound")));
+            case OP_EXACT1_IC:
+            case OP_EXACTN_IC: {
+                if (opcode == OP_EXACTN_IC) {
+                    GET_LENGTH_INC(length, p);
+                } else {
+                    length = enclen(encoding, p, regex->p + regex->used);
+                }
+
+                if (!vm_fold_equal(vm, p, length, &s)) goto fail;
+                p += length;
                 break;
             }
-            case OP_NOT_WORD_BOUND: {
-                rb_ary_push(insn, ID2SYM(rb_intern("not_word_bound")));
+            case OP_CCLASS:
+            case OP_CCLASS_NOT:
+                if (s >= end || (BITSET_AT((BitSetRef) p, *s) != 0) != (opcode == OP_CCLASS)) goto fail;
+                p += SIZE_BITSET;
+                s += enclen(encoding, s, end);
                 break;
-            }
-            case OP_WORD_BEGIN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("word_begin")));
+            case OP_CCLASS_MB:
+            case OP_CCLASS_MIX:
+            case OP_CCLASS_MB_NOT:
+            case OP_CCLASS_MIX_NOT: {
+                bool negated = opcode == OP_CCLASS_MB_NOT || opcode == OP_CCLASS_MIX_NOT;
+                bool mixed = opcode == OP_CCLASS_MIX || opcode == OP_CCLASS_MIX_NOT;
+                if (s >= end) goto fail;
+
+                const UChar *bitset = p;
+                if (mixed) p += SIZE_BITSET;
+                GET_LENGTH_INC(length, p);
+
+                const UChar *ranges = p;
+                p += length;
+
+                int character_length = enclen(encoding, s, end);
+                if (character_length == 1) {
+                    // Single byte characters are only in the bitset, and a
+                    // class without one never contains them.
+                    bool found = mixed && BITSET_AT((BitSetRef) bitset, *s);
+                    if (found == negated) goto fail;
+                    s++;
+                } else if (end - s < character_length) {
+                    if (!negated) goto fail;
+                    s = end;
+                } else {
+                    OnigCodePoint code = ONIGENC_MBC_TO_CODE(encoding, s, s + character_length);
+                    if (vm_in_ranges(ranges, code) == negated) goto fail;
+                    s += character_length;
+                }
                 break;
             }
-            case OP_WORD_END: {
-                rb_ary_push(insn, ID2SYM(rb_intern("word_end")));
+            case OP_ANYCHAR:
+            case OP_ANYCHAR_ML: {
+                if (s >= end) goto fail;
+
+                int character_length = enclen(encoding, s, end);
+                if (end - s < character_length) goto fail;
+                if (opcode == OP_ANYCHAR && ONIGENC_IS_MBC_NEWLINE(encoding, s, end)) goto fail;
+                s += character_length;
                 break;
             }
-            case OP_ASCII_WORD: {
-                rb_ary_push(insn, ID2SYM(rb_intern("ascii_word")));
+            case OP_ANYCHAR_STAR:
+            case OP_ANYCHAR_ML_STAR:
+            case OP_ANYCHAR_STAR_PEEK_NEXT:
+            case OP_ANYCHAR_ML_STAR_PEEK_NEXT: {
+                bool multiline = opcode == OP_ANYCHAR_ML_STAR || opcode == OP_ANYCHAR_ML_STAR_PEEK_NEXT;
+                bool peek = opcode == OP_ANYCHAR_STAR_PEEK_NEXT || opcode == OP_ANYCHAR_ML_STAR_PEEK_NEXT;
+                bool failed = false;
+
+                while (s < end && !vm->exceeded) {
+                    if (!peek) {
+                        vm_push_alt(vm, VM_ALT, p, s, keep);
+                    } else if (*p == *s) {
+                        vm_push_alt(vm, VM_ALT, p + 1, s, keep);
+                    }
+
+                    int character_length = enclen(encoding, s, end);
+                    if (end - s < character_length || (!multiline && ONIGENC_IS_MBC_NEWLINE(encoding, s, end))) {
+                        failed = true;
+                        break;
+                    }
+
+                    s += character_length;
+                }
+
+                if (failed) goto fail;
+                if (peek) p++;
                 break;
             }
+            case OP_WORD:
+            case OP_ASCII_WORD:
+            case OP_NOT_WORD:
             case OP_NOT_ASCII_WORD: {
-                rb_ary_push(insn, ID2SYM(rb_intern("not_ascii_word")));
-                break;
-            }
-            case OP_ASCII_WORD_BOUND: {
-                rb_ary_push(insn, ID2SYM(rb_intern("ascii_word_bound")));
+                bool ascii = opcode == OP_ASCII_WORD || opcode == OP_NOT_ASCII_WORD;
+                bool word = opcode == OP_WORD || opcode == OP_ASCII_WORD;
+                if (s >= end || vm_word_p(vm, s, ascii) != word) goto fail;
+                s += enclen(encoding, s, end);
                 break;
             }
+            case OP_WORD_BOUND:
+            case OP_ASCII_WORD_BOUND:
+            case OP_NOT_WORD_BOUND:
             case OP_NOT_ASCII_WORD_BOUND: {
-                rb_ary_push(insn, ID2SYM(rb_intern("not_ascii_word_bound")));
+                bool ascii = opcode == OP_ASCII_WORD_BOUND || opcode == OP_NOT_ASCII_WORD_BOUND;
+                bool before = s > str && vm_word_p(vm, vm_prev(vm, s), ascii);
+                bool after = s < end && vm_word_p(vm, s, ascii);
+                bool bound = (s > str || s < end) && before != after;
+                if (bound != (opcode == OP_WORD_BOUND || opcode == OP_ASCII_WORD_BOUND)) goto fail;
                 break;
             }
+            case OP_WORD_BEGIN:
             case OP_ASCII_WORD_BEGIN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("ascii_word_begin")));
+                bool ascii = opcode == OP_ASCII_WORD_BEGIN;
+                if (s >= end || !vm_word_p(vm, s, ascii)) goto fail;
+                if (s > str && vm_word_p(vm, vm_prev(vm, s), ascii)) goto fail;
                 break;
             }
+            case OP_WORD_END:
             case OP_ASCII_WORD_END: {
-                rb_ary_push(insn, ID2SYM(rb_intern("ascii_word_end")));
+                bool ascii = opcode == OP_ASCII_WORD_END;
+                if (s == str || !vm_word_p(vm, vm_prev(vm, s), ascii)) goto fail;
+                if (s < end && vm_word_p(vm, s, ascii)) goto fail;
                 break;
             }
-            case OP_BEGIN_BUF: {
-                rb_ary_push(insn, ID2SYM(rb_intern("begin_buf")));
+            case OP_BEGIN_BUF:
+            case OP_BEGIN_POSITION:
+                if (s != str) goto fail;
                 break;
-            }
-            case OP_END_BUF: {
-                rb_ary_push(insn, ID2SYM(rb_intern("end_buf")));
+            case OP_END_BUF:
+                if (s != end) goto fail;
+                break;
+            case OP_BEGIN_LINE:
+                if (s != str && (s == end || !ONIGENC_IS_MBC_NEWLINE(encoding, vm_prev(vm, s), end))) goto fail;
+                break;
+            case OP_END_LINE:
+                if (s != end && !ONIGENC_IS_MBC_NEWLINE(encoding, s, end)) goto fail;
+                break;
+            case OP_SEMI_END_BUF:
+                if (s != end && !(ONIGENC_IS_MBC_NEWLINE(encoding, s, end) && s + enclen(encoding, s, end) == end)) goto fail;
+                break;
+            case OP_BACKREF1:
+            case OP_BACKREF2:
+            case OP_BACKREFN:
+            case OP_BACKREFN_IC:
+                if (opcode == OP_BACKREF1 || opcode == OP_BACKREF2) {
+                    mem = opcode == OP_BACKREF1 ? 1 : 2;
+                } else {
+                    GET_MEMNUM_INC(mem, p);
+                }
+
+                if (!vm_backref(vm, mem, opcode == OP_BACKREFN_IC, &s)) goto fail;
+                break;
+            case OP_BACKREF_MULTI:
+            case OP_BACKREF_MULTI_IC: {
+                GET_LENGTH_INC(length, p);
+                const UChar *numbers = p;
+                p += length * SIZE_MEMNUM;
+
+                bool found = false;
+                for (int index = 0; index < length && !found; index++) {
+                    const UChar *cursor = numbers + index * SIZE_MEMNUM;
+                    GET_MEMNUM_INC(mem, cursor);
+                    found = vm_backref(vm, mem, opcode == OP_BACKREF_MULTI_IC, &s);
+                }
+
+                if (!found) goto fail;
                 break;
             }
-            case OP_BEGIN_LINE: {
-                rb_ary_push(insn, ID2SYM(rb_intern("begin_line")));
+            case OP_MEMORY_START:
+                GET_MEMNUM_INC(mem, p);
+                vm->mem_start[mem] = s;
+                vm->mem_end[mem] = NULL;
+                break;
+            case OP_MEMORY_START_PUSH:
+                GET_MEMNUM_INC(mem, p);
+                vm_push_mem(vm, VM_MEM_START, mem);
+                vm->mem_start[mem] = s;
+                vm->mem_end[mem] = NULL;
+                break;
+            case OP_MEMORY_END:
+                GET_MEMNUM_INC(mem, p);
+                vm->mem_end[mem] = s;
+                break;
+            case OP_MEMORY_END_PUSH:
+                GET_MEMNUM_INC(mem, p);
+                vm_push_mem(vm, VM_MEM_END, mem);
+                vm->mem_end[mem] = s;
+                break;
+            case OP_KEEP:
+                keep = s;
+                break;
+            case OP_FAIL:
+                goto fail;
+            case OP_JUMP:
+                GET_RELADDR_INC(addr, p);
+                p += addr;
+                break;
+            case OP_PUSH:
+                GET_RELADDR_INC(addr, p);
+                vm_push_alt(vm, VM_ALT, p + addr, s, keep);
+                break;
+            case OP_POP:
+                vm->stack_size--;
+                break;
+            case OP_PUSH_OR_JUMP_EXACT1:
+                GET_RELADDR_INC(addr, p);
+                if (s < end && *p == *s) {
+                    p++;
+                    vm_push_alt(vm, VM_ALT, p + addr, s, keep);
+                } else {
+                    p += addr + 1;
+                }
+                break;
+            case OP_PUSH_IF_PEEK_NEXT:
+                GET_RELADDR_INC(addr, p);
+                if (s < end && *p == *s) {
+                    p++;
+                    vm_push_alt(vm, VM_ALT, p + addr, s, keep);
+                } else {
+                    p++;
+                }
+                break;
+            case OP_REPEAT:
+            case OP_REPEAT_NG: {
+                GET_MEMNUM_INC(mem, p);
+                GET_RELADDR_INC(addr, p);
+
+                vm->repeat_stack[mem] = vm->stack_size;
+                vm_entry_t *entry = vm_push(vm, VM_REPEAT);
+                entry->number = mem;
+                entry->count = 0;
+                entry->pcode = p;
+
+                if (regex->repeat_range[mem].lower == 0) {
+                    if (opcode == OP_REPEAT) {
+                        vm_push_alt(vm, VM_ALT, p + addr, s, keep);
+                    } else {
+                        vm_push_alt(vm, VM_ALT, p, s, keep);
+                        p += addr;
+                    }
+                }
                 break;
             }
-            case OP_END_LINE: {
-                rb_ary_push(insn, ID2SYM(rb_intern("end_line")));
+            case OP_REPEAT_INC:
+            case OP_REPEAT_INC_SG:
+            case OP_REPEAT_INC_NG:
+            case OP_REPEAT_INC_NG_SG: {
+                GET_MEMNUM_INC(mem, p);
+
+                long index = (opcode == OP_REPEAT_INC || opcode == OP_REPEAT_INC_NG) ? vm->repeat_stack[mem] : vm_find(vm, VM_REPEAT, mem);
+                int count = ++vm->stack[index].count;
+                const UChar *pcode = vm->stack[index].pcode;
+                OnigRepeatRange range = regex->repeat_range[mem];
+
+                if (opcode == OP_REPEAT_INC || opcode == OP_REPEAT_INC_SG) {
+                    if (count >= range.upper) {
+                        // The end of the repeat, so carry on after it.
+                    } else if (count >= range.lower) {
+                        vm_push_alt(vm, VM_ALT, p, s, keep);
+                        p = pcode;
+                    } else {
+                        p = pcode;
+                    }
+
+                    vm_push(vm, VM_REPEAT_INC)->number = (int) index;
+                } else if (count < range.upper) {
+                    vm_push(vm, VM_REPEAT_INC)->number = (int) index;
+
+                    if (count >= range.lower) {
+                        vm_push_alt(vm, VM_ALT, pcode, s, keep);
+                    } else {
+                        p = pcode;
+                    }
+                } else if (count == range.upper) {
+                    vm_push(vm, VM_REPEAT_INC)->number = (int) index;
+                }
                 break;
             }
-            case OP_SEMI_END_BUF: {
-                rb_ary_push(insn, ID2SYM(rb_intern("semi_end_buf")));
+            case OP_NULL_CHECK_START: {
+                GET_MEMNUM_INC(mem, p);
+                vm_entry_t *entry = vm_push(vm, VM_NULL_CHECK_START);
+                entry->number = mem;
+                entry->s = s;
                 break;
             }
-            case OP_BEGIN_POSITION: {
-                rb_ary_push(insn, ID2SYM(rb_intern("begin_position")));
+            case OP_NULL_CHECK_END:
+            case OP_NULL_CHECK_END_MEMST: {
+                GET_MEMNUM_INC(mem, p);
+                long index = vm_find(vm, VM_NULL_CHECK_START, mem);
+
+                int null = vm->stack[index].s == s;
+                if (null && opcode == OP_NULL_CHECK_END_MEMST) {
+                    // An empty iteration still counts if it moved a capture.
+                    for (long cursor = index + 1; cursor < vm->stack_size && null != 0; cursor++) {
+                        const vm_entry_t *entry = &vm->stack[cursor];
+                        if (entry->type != VM_MEM_START) continue;
+
+                        if (entry->end == NULL || entry->start != entry->end) {
+                            null = 0;
+                        } else if (entry->end != s) {
+                            null = -1;
+                        }
+                    }
+                }
+
+                if (null == -1) goto fail;
+                if (null) {
+                    // Skip the instruction that would loop back around.
+                    switch (*p++) {
+                        case OP_JUMP:
+                        case OP_PUSH:
+                            p += SIZE_RELADDR;
+                            break;
+                        case OP_REPEAT_INC:
+                        case OP_REPEAT_INC_NG:
+                        case OP_REPEAT_INC_SG:
+                        case OP_REPEAT_INC_NG_SG:
+                            p += SIZE_MEMNUM;
+                            break;
+                        default:
+                            rb_raise(rb_eRuntimeError, "unexpected bytecode after null check");
+                    }
+                }
                 break;
             }
-            case OP_BACKREF1: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backref1")));
+            case OP_PUSH_POS: {
+                vm_entry_t *entry = vm_push(vm, VM_POS);
+                entry->s = s;
                 break;
             }
-            case OP_BACKREF2: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backref2")));
+            case OP_POP_POS:
+                s = vm_void_until(vm, VM_POS)->s;
+                break;
+            case OP_PUSH_POS_NOT:
+                GET_RELADDR_INC(addr, p);
+                vm_push_alt(vm, VM_POS_NOT, p + addr, s, keep);
+                break;
+            case OP_FAIL_POS:
+                vm_pop_until(vm, VM_POS_NOT);
+                goto fail;
+            case OP_PUSH_STOP_BT:
+                vm_push(vm, VM_STOP_BT);
+                break;
+            case OP_POP_STOP_BT:
+                vm_void_until(vm, VM_STOP_BT);
+                break;
+            case OP_LOOK_BEHIND:
+                GET_LENGTH_INC(length, p);
+                s = onigenc_step_back(encoding, str, s, end, length);
+                if (s == NULL) goto fail;
+                break;
+            case OP_PUSH_LOOK_BEHIND_NOT: {
+                GET_RELADDR_INC(addr, p);
+                GET_LENGTH_INC(length, p);
+
+                const UChar *behind = onigenc_step_back(encoding, str, s, end, length);
+                if (behind == NULL) {
+                    // Too little text before to match, so the lookbehind
+                    // cannot fail.
+                    p += addr;
+                } else {
+                    vm_push_alt(vm, VM_LOOK_BEHIND_NOT, p + addr, s, keep);
+                    s = behind;
+                }
                 break;
             }
-            case OP_BACKREFN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backrefn")));
-                rb_ary_push(insn, read_memnum(&cursor));
+            case OP_FAIL_LOOK_BEHIND_NOT:
+                vm_pop_until(vm, VM_LOOK_BEHIND_NOT);
+                goto fail;
+            case OP_CONDITION:
+                GET_MEMNUM_INC(mem, p);
+                GET_RELADDR_INC(addr, p);
+                if (mem > regex->num_mem || vm->mem_start[mem] == NULL || vm->mem_end[mem] == NULL) p += addr;
                 break;
+            case OP_SET_OPTION:
+            case OP_SET_OPTION_PUSH:
+                p += SIZE_OPTION;
+                break;
+            default: {
+                VALUE name = opcode_symbol(opcode);
+                rb_raise(rb_eNotImpError, "unsupported instruction: %"PRIsVALUE, NIL_P(name) ? INT2FIX(opcode) : name);
             }
-            case OP_BACKREFN_IC: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backrefn_ic")));
-                rb_ary_push(insn, read_memnum(&cursor));
+        }
+
+        continue;
+
+fail:
+        if (!vm_backtrack(vm, &p, &s, &keep)) return false;
+    }
+}
+
+// Compiles the source, even for a Regexp: Ruby may free and replace a
+// Regexp's regex when another thread matches it against a string in a
+// different encoding, and the interpreter checks for interrupts while it runs.
+static regex_t *
+vm_regex(VALUE source) {
+    OnigEncoding encoding;
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &encoding, &options);
+
+    regex_t *regex;
+    OnigErrorInfo einfo;
+    const OnigUChar *pattern = (const OnigUChar *) RSTRING_PTR(string);
+
+    int result = onig_new(&regex, pattern, pattern + RSTRING_LEN(string), options, encoding, ONIG_SYNTAX_DEFAULT, &einfo);
+    if (result != ONIG_NORMAL) fail(result, regex, &einfo);
+
+    return regex;
+}
+
+// Checks that the subject can be matched against the regex the way Ruby
+// would, and allocates the registers for it.
+static void
+vm_prepare(vm_t *vm, bool counted) {
+    rb_encoding *subject_encoding = rb_enc_get(vm->subject);
+    if (subject_encoding != vm->regex->enc && !(rb_enc_asciicompat(vm->regex->enc) && rb_enc_str_asciionly_p(vm->subject))) {
+        rb_raise(rb_eEncCompatError, "incompatible encoding regexp match (%s regexp with %s string)", rb_enc_name(vm->regex->enc), rb_enc_name(subject_encoding));
+    }
+
+    // The interpreter steps through the subject by character length, which
+    // is meaningless over invalid bytes.
+    if (rb_enc_str_coderange(vm->subject) == ENC_CODERANGE_BROKEN) {
+        rb_raise(rb_eArgError, "invalid byte sequence in %s", rb_enc_name(subject_encoding));
+    }
+
+    vm->str = (const UChar *) RSTRING_PTR(vm->subject);
+    vm->end = vm->str + RSTRING_LEN(vm->subject);
+    vm->mem_start = ALLOC_N(const UChar *, vm->regex->num_mem + 1);
+    vm->mem_end = ALLOC_N(const UChar *, vm->regex->num_mem + 1);
+    vm->repeat_stack = ALLOC_N(long, vm->regex->num_repeat + 1);
+    if (counted) vm->counts = ZALLOC_N(size_t, vm->regex->used + 1);
+}
+
+// Tries every start position in turn, like onig_search without its
+// optimizations.
+static bool
+vm_search(vm_t *vm) {
+    bool anchored = (vm->regex->anchor & (ANCHOR_BEGIN_BUF | ANCHOR_BEGIN_POSITION)) != 0;
+    const UChar *s = vm->str;
+
+    while (true) {
+        vm->starts++;
+        if (vm_match_at(vm, s)) return true;
+        if (vm->exceeded || anchored || s >= vm->end) return false;
+
+        s += enclen(vm->regex->enc, s, vm->end);
+    }
+}
+
+static VALUE
+vm_free(VALUE data) {
+    vm_t *vm = (vm_t *) data;
+
+    if (vm->owned) onig_free(vm->regex);
+    xfree(vm->stack);
+    xfree(vm->mem_start);
+    xfree(vm->mem_end);
+    xfree(vm->repeat_stack);
+    xfree(vm->counts);
+    xfree(vm);
+    return Qnil;
+}
+
+static VALUE
+profile_run(VALUE data) {
+    vm_t *vm = (vm_t *) data;
+    vm->regex = vm_regex(vm->source);
+    vm->owned = true;
+    vm_prepare(vm, true);
+
+    bool matched = vm_search(vm);
+    regex_t *regex = vm->regex;
+
+    VALUE counts = rb_ary_new();
+    const UChar *cursor = regex->p;
+    const UChar *end = cursor + regex->used;
+
+    while (cursor < end) {
+        rb_ary_push(counts, SIZET2NUM(vm->counts[cursor - regex->p]));
+        cursor = read_insn_checked(regex->p, cursor, end, regex->enc, Qnil);
+    }
+
+    ID names[] = {
+        rb_intern("@match"), rb_intern("@instructions"), rb_intern("@counts"), rb_intern("@steps"),
+        rb_intern("@starts"), rb_intern("@pushes"), rb_intern("@pops"), rb_intern("@max_stack_depth")
+    };
+    VALUE values[] = {
+        matched ? rb_ary_new_from_args(2, LONG2NUM(vm->match_start), LONG2NUM(vm->match_end)) : Qnil,
+        build_insns(regex),
+        counts,
+        SIZET2NUM(vm->steps),
+        SIZET2NUM(vm->starts),
+        SIZET2NUM(vm->pushes),
+        SIZET2NUM(vm->pops),
+        SIZET2NUM(vm->max_depth)
+    };
+
+    return build_object(rb_cOnigmoProfile, 8, names, values);
+}
+
+// The byte offsets of the match that Ruby's own matcher makes, or nil.
+// MatchData#byteoffset only exists from Ruby 3.2, so the character offset is
+// converted instead.
+static VALUE
+profile_expected_match(VALUE regexp, VALUE subject) {
+    VALUE match = rb_funcall(regexp, rb_intern("match"), 1, subject);
+    if (NIL_P(match)) return Qnil;
+
+    long start = rb_str_offset(subject, NUM2LONG(rb_funcall(match, rb_intern("begin"), 1, INT2FIX(0))));
+    long end = start + RSTRING_LEN(rb_reg_nth_match(0, match));
+
+    return rb_ary_new_from_args(2, LONG2NUM(start), LONG2NUM(end));
+}
+
+// The interpreter is checked against Ruby's own matcher on every call, and
+// the profile records what Ruby matched next to its own answer. Ruby's search
+// optimizations are not always right, so a disagreement is not an error.
+static VALUE
+profile(VALUE self, VALUE source, VALUE subject) {
+    if (!RB_TYPE_P(source, T_REGEXP)) StringValue(source);
+    StringValue(subject);
+    subject = rb_str_new_frozen(subject);
+
+    vm_t *vm = ZALLOC(vm_t);
+    vm->source = source;
+    vm->subject = subject;
+    vm->max_steps = SIZE_MAX;
+    vm->max_stack = SIZE_MAX;
+
+    VALUE result = rb_ensure(profile_run, (VALUE) vm, vm_free, (VALUE) vm);
+
+    VALUE regexp = RB_TYPE_P(source, T_REGEXP) ? source : rb_reg_new_str(source, 0);
+    rb_ivar_set(result, rb_intern("@expected_match"), profile_expected_match(regexp, subject));
+
+    RB_GC_GUARD(subject);
+    return result;
+}
+
+// A compiled pattern that is only ever run by the interpreter above, with a
+// fixed budget of instructions and stack entries for each search. Whether a
+// search runs out depends only on the pattern and the subject, never on the
+// speed or load of the machine.
+typedef struct {
+    regex_t *regex;
+    size_t max_steps;
+    size_t max_stack;
+} safe_regex_t;
+
+static void
+safe_regex_free(void *data) {
+    safe_regex_t *safe_regex = (safe_regex_t *) data;
+
+    if (safe_regex->regex != NULL) onig_free(safe_regex->regex);
+    xfree(safe_regex);
+}
+
+static size_t
+safe_regex_memsize(const void *data) {
+    const safe_regex_t *safe_regex = (const safe_regex_t *) data;
+    return sizeof(safe_regex_t) + (safe_regex->regex != NULL ? onig_memsize(safe_regex->regex) : 0);
+}
+
+static const rb_data_type_t safe_regex_type = {
+    .wrap_struct_name = "Onigmo::SafeRegex",
+    .function = {
+        .dfree = safe_regex_free,
+        .dsize = safe_regex_memsize
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+// Rejects the instructions that the interpreter does not support when the
+// pattern is compiled, rather than partway through a search. The patterns
+// are untrusted input, so this raises a StandardError that a plain rescue
+// catches, unlike the NotImplementedError from profile.
+static void
+safe_regex_check(regex_t *regex) {
+    const UChar *cursor = regex->p;
+    const UChar *end = cursor + regex->used;
+
+    while (cursor < end) {
+        switch (*cursor) {
+            case OP_BACKREF_WITH_LEVEL:
+            case OP_MEMORY_END_PUSH_REC:
+            case OP_MEMORY_END_REC:
+            case OP_NULL_CHECK_END_MEMST_PUSH:
+            case OP_PUSH_ABSENT_POS:
+            case OP_ABSENT:
+            case OP_ABSENT_END:
+            case OP_CALL:
+            case OP_RETURN:
+            case OP_STATE_CHECK_PUSH:
+            case OP_STATE_CHECK_PUSH_OR_JUMP:
+            case OP_STATE_CHECK:
+            case OP_STATE_CHECK_ANYCHAR_STAR:
+            case OP_STATE_CHECK_ANYCHAR_ML_STAR:
+                rb_raise(rb_eOnigmoUnsupportedPattern, "unsupported instruction: %"PRIsVALUE, opcode_symbol(*cursor));
+            default:
+                break;
+        }
+
+        cursor = read_insn_checked(regex->p, cursor, end, regex->enc, Qnil);
+    }
+}
+
+static size_t
+safe_regex_limit(VALUE value, const char *name) {
+    long limit = NUM2LONG(value);
+    if (limit <= 0) rb_raise(rb_eArgError, "%s must be positive", name);
+    return (size_t) limit;
+}
+
+static VALUE
+safe_regex_new(int argc, VALUE *argv, VALUE self) {
+    VALUE source, keywords;
+    rb_scan_args(argc, argv, "1:", &source, &keywords);
+
+    ID keyword_ids[] = { rb_intern("max_steps"), rb_intern("max_stack") };
+    VALUE keyword_values[2];
+    rb_get_kwargs(keywords, keyword_ids, 2, 0, keyword_values);
+
+    safe_regex_t *safe_regex;
+    VALUE object = TypedData_Make_Struct(rb_cOnigmoSafeRegex, safe_regex_t, &safe_regex_type, safe_regex);
+    safe_regex->max_steps = safe_regex_limit(keyword_values[0], "max_steps");
+    safe_regex->max_stack = safe_regex_limit(keyword_values[1], "max_stack");
+
+    // A Regexp is compiled again, so that the object does not depend on it.
+    safe_regex->regex = vm_regex(source);
+    safe_regex_check(safe_regex->regex);
+
+    return object;
+}
+
+typedef struct {
+    vm_t *vm;
+    bool exception;
+} safe_regex_run_t;
+
+static VALUE
+safe_regex_run(VALUE data) {
+    safe_regex_run_t *run = (safe_regex_run_t *) data;
+    vm_t *vm = run->vm;
+    vm_prepare(vm, false);
+
+    if (vm_search(vm)) return rb_ary_new_from_args(2, LONG2NUM(vm->match_start), LONG2NUM(vm->match_end));
+    if (!vm->exceeded) return Qnil;
+
+    if (run->exception) {
+        bool steps = vm->steps >= vm->max_steps;
+        rb_raise(rb_eOnigmoBudgetExceeded, "%s budget of %"PRIuSIZE" exceeded", steps ? "step" : "stack", steps ? vm->max_steps : vm->max_stack);
+    }
+
+    return ID2SYM(rb_intern("budget_exceeded"));
+}
+
+// Returns the byte offsets of the first match as [start, end], nil when
+// there is none, or :budget_exceeded. Passing exception: true raises
+// Onigmo::SafeRegex::BudgetExceeded instead.
+static VALUE
+safe_regex_match(int argc, VALUE *argv, VALUE self) {
+    VALUE subject, keywords;
+    rb_scan_args(argc, argv, "1:", &subject, &keywords);
+
+    bool exception = false;
+    if (!NIL_P(keywords)) {
+        ID keyword_ids[] = { rb_intern("exception") };
+        VALUE keyword_values[1];
+        rb_get_kwargs(keywords, keyword_ids, 0, 1, keyword_values);
+        exception = keyword_values[0] != Qundef && RTEST(keyword_values[0]);
+    }
+
+    safe_regex_t *safe_regex;
+    TypedData_Get_Struct(self, safe_regex_t, &safe_regex_type, safe_regex);
+
+    StringValue(subject);
+    subject = rb_str_new_frozen(subject);
+
+    vm_t *vm = ZALLOC(vm_t);
+    vm->subject = subject;
+    vm->regex = safe_regex->regex;
+    vm->max_steps = safe_regex->max_steps;
+    vm->max_stack = safe_regex->max_stack;
+
+    safe_regex_run_t run = { .vm = vm, .exception = exception };
+    VALUE result = rb_ensure(safe_regex_run, (VALUE) &run, vm_free, (VALUE) vm);
+
+    RB_GC_GUARD(subject);
+    return result;
+}
+
+static VALUE
+safe_regex_max_steps(VALUE self) {
+    safe_regex_t *safe_regex;
+    TypedData_Get_Struct(self, safe_regex_t, &safe_regex_type, safe_regex);
+    return SIZET2NUM(safe_regex->max_steps);
+}
+
+static VALUE
+safe_regex_max_stack(VALUE self) {
+    safe_regex_t *safe_regex;
+    TypedData_Get_Struct(self, safe_regex_t, &safe_regex_type, safe_regex);
+    return SIZET2NUM(safe_regex->max_stack);
+}
+
+// Writes JSON straight into a single buffer, producing the same bytes that the
+// json gem generates for the equivalent Ruby objects. Anything the json gem
+// would have to transcode or reject (strings that are not valid UTF-8, or
+// objects of other types) makes these return false, and the caller falls back
+// to the Ruby implementation.
+static const char *const json_type_names[] = {
+    [FLAT_ALTERNATION] = "alternation",
+    [FLAT_ANCHOR_BUFFER_BEGIN] = "anchorBufferBegin",
+    [FLAT_ANCHOR_BUFFER_END] = "anchorBufferEnd",
+    [FLAT_ANCHOR_KEEP] = "anchorKeep",
+    [FLAT_ANCHOR_LINE_BEGIN] = "anchorLineBegin",
+    [FLAT_ANCHOR_LINE_END] = "anchorLineEnd",
+    [FLAT_ANCHOR_POSITION_BEGIN] = "anchorPositionBegin",
+    [FLAT_ANCHOR_SEMI_END] = "anchorSemiEnd",
+    [FLAT_ANCHOR_WORD_BOUNDARY] = "anchorWordBoundary",
+    [FLAT_ANCHOR_WORD_BOUNDARY_INVERT] = "anchorWordBoundaryInvert",
+    [FLAT_ANY] = "any",
+    [FLAT_BACKREF] = "backref",
+    [FLAT_CALL] = "call",
+    [FLAT_CCLASS] = "cclass",
+    [FLAT_CCLASS_INVERT] = "cclassInvert",
+    [FLAT_ENCLOSE_ABSENT] = "encloseAbsent",
+    [FLAT_ENCLOSE_CONDITION] = "encloseCondition",
+    [FLAT_ENCLOSE_MEMORY] = "encloseMemory",
+    [FLAT_ENCLOSE_OPTIONS] = "encloseOptions",
+    [FLAT_ENCLOSE_STOP_BACKTRACK] = "encloseStopBacktrack",
+    [FLAT_LIST] = "list",
+    [FLAT_LOOK_AHEAD] = "lookAhead",
+    [FLAT_LOOK_AHEAD_INVERT] = "lookAheadInvert",
+    [FLAT_LOOK_BEHIND] = "lookBehind",
+    [FLAT_LOOK_BEHIND_INVERT] = "lookBehindInvert",
+    [FLAT_QUANTIFIER] = "quantifier",
+    [FLAT_STRING] = "string",
+    [FLAT_WORD] = "word",
+    [FLAT_WORD_INVERT] = "wordInvert"
+};
+
+static bool
+json_bytes(VALUE buffer, const char *pointer, long length, OnigEncoding encoding) {
+    static const char hex[] = "0123456789abcdef";
+
+    if (!rb_enc_asciicompat(encoding)) return false;
+
+    bool ascii = true;
+    for (long index = 0; index < length; index++) {
+        if ((unsigned char) pointer[index] >= 0x80) {
+            ascii = false;
+            break;
+        }
+    }
+
+    if (!ascii) {
+        if (encoding != rb_utf8_encoding()) return false;
+        if (rb_enc_str_coderange(rb_enc_str_new(pointer, length, encoding)) != ENC_CODERANGE_VALID) return false;
+    }
+
+    rb_str_cat(buffer, "\"", 1);
+
+    long start = 0;
+    for (long index = 0; index < length; index++) {
+        unsigned char byte = (unsigned char) pointer[index];
+        if (byte >= 0x20 && byte != '"' && byte != '\\') continue;
+
+        rb_str_cat(buffer, pointer + start, index - start);
+        start = index + 1;
+
+        switch (byte) {
+            case '"': rb_str_cat(buffer, "\\\"", 2); break;
+            case '\\': rb_str_cat(buffer, "\\\\", 2); break;
+            case '\b': rb_str_cat(buffer, "\\b", 2); break;
+            case '\f': rb_str_cat(buffer, "\\f", 2); break;
+            case '\n': rb_str_cat(buffer, "\\n", 2); break;
+            case '\r': rb_str_cat(buffer, "\\r", 2); break;
+            case '\t': rb_str_cat(buffer, "\\t", 2); break;
+            default: {
+                char escape[] = { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 0xf] };
+                rb_str_cat(buffer, escape, sizeof(escape));
                 break;
             }
-            case OP_BACKREF_MULTI: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backref_multi")));
+        }
+    }
+
+    rb_str_cat(buffer, pointer + start, length - start);
+    rb_str_cat(buffer, "\"", 1);
+    return true;
+}
+
+// These format into a local buffer first, since rb_str_catf rescans the
+// whole output on every call.
+static void
+json_key(VALUE buffer, const char *key) {
+    char formatted[32];
+    int length = snprintf(formatted, sizeof(formatted), "\"%s\":", key);
+    rb_str_cat(buffer, formatted, length);
+}
+
+static void
+json_type(VALUE buffer, flat_type_t type) {
+    char formatted[48];
+    int length = snprintf(formatted, sizeof(formatted), "\"type\":\"%s\"}", json_type_names[type]);
+    rb_str_cat(buffer, formatted, length);
+}
+
+static void
+json_int(VALUE buffer, long value) {
+    char formatted[24];
+    int length = snprintf(formatted, sizeof(formatted), "%ld", value);
+    rb_str_cat(buffer, formatted, length);
+}
+
+// The json gem's default max_nesting, which both to_json without arguments
+// and as_json.to_json enforce. Raising the same error at the same depth keeps
+// the native writers identical to it, and bounds their recursion.
+#define JSON_MAX_NESTING 100
+
+// Called with the depth of every array and object before it is opened.
+static void
+json_nest(long depth) {
+    if (depth > JSON_MAX_NESTING) {
+        rb_raise(rb_path2class("JSON::NestingError"), "nesting of %ld is too deep", depth - 1);
+    }
+}
+
+static void
+json_ranges(VALUE buffer, BBuf *bbuf, long depth) {
+    json_nest(depth);
+    rb_str_cat(buffer, "[", 1);
+
+    if (bbuf != NULL) {
+        if (bbuf->used > SIZE_CODE_POINT) json_nest(depth + 1);
+        OnigCodePoint *data = (OnigCodePoint *) bbuf->p;
+        OnigCodePoint *end = (OnigCodePoint *) (bbuf->p + bbuf->used);
+
+        for (++data; data < end; data += 2) {
+            if (data != ((OnigCodePoint *) bbuf->p) + 1) rb_str_cat(buffer, ",", 1);
+            char formatted[32];
+            int length = snprintf(formatted, sizeof(formatted), "[%u,%u]", data[0], data[1]);
+            rb_str_cat(buffer, formatted, length);
+        }
+    }
+
+    rb_str_cat(buffer, "]", 1);
+}
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+// The single byte characters of a class, each preceded by a comma once count
+// is positive.
+static bool
+json_characters(VALUE buffer, BitSetRef bs, OnigEncoding encoding, int *count) {
+    for (int index = 0; index < SINGLE_BYTE_SIZE; index++) {
+        if (BITSET_AT(bs, index) != 0) {
+            const char character = (const char) index;
+            if ((*count)++ > 0) rb_str_cat(buffer, ",", 1);
+            if (!json_bytes(buffer, &character, 1, encoding)) return false;
+        }
+    }
 
-                for (int i = 0; i < NUM2INT(length); i++) {
-                    rb_ary_push(insn, read_memnum(&cursor));
-                }
+    return true;
+}
 
-                break;
+// Every codepoint of every range, as CClassNode#values lists them after the
+// characters.
+static void
+json_codepoints(VALUE buffer, BBuf *bbuf, int count) {
+    if (bbuf == NULL) return;
+
+    OnigCodePoint *data = (OnigCodePoint *) bbuf->p;
+    OnigCodePoint *end = (OnigCodePoint *) (bbuf->p + bbuf->used);
+
+    for (++data; data < end; data += 2) {
+        for (OnigCodePoint codepoint = data[0]; codepoint <= data[1]; codepoint++) {
+            if (count++ > 0) rb_str_cat(buffer, ",", 1);
+            json_int(buffer, codepoint);
+            if (codepoint == data[1]) break;
+        }
+    }
+}
+
+static bool
+json_value(VALUE buffer, VALUE value, long depth) {
+    switch (TYPE(value)) {
+        case T_NIL:
+            rb_str_cat(buffer, "null", 4);
+            return true;
+        case T_TRUE:
+            rb_str_cat(buffer, "true", 4);
+            return true;
+        case T_FALSE:
+            rb_str_cat(buffer, "false", 5);
+            return true;
+        case T_FIXNUM:
+            json_int(buffer, FIX2LONG(value));
+            return true;
+        case T_BIGNUM:
+            rb_str_append(buffer, rb_big2str(value, 10));
+            return true;
+        case T_SYMBOL:
+            value = rb_sym2str(value);
+            return json_bytes(buffer, RSTRING_PTR(value), RSTRING_LEN(value), rb_enc_get(value));
+        case T_STRING:
+            return json_bytes(buffer, RSTRING_PTR(value), RSTRING_LEN(value), rb_enc_get(value));
+        case T_ARRAY:
+            json_nest(depth);
+            rb_str_cat(buffer, "[", 1);
+
+            for (long index = 0; index < RARRAY_LEN(value); index++) {
+                if (index > 0) rb_str_cat(buffer, ",", 1);
+                if (!json_value(buffer, RARRAY_AREF(value, index), depth + 1)) return false;
             }
-            case OP_BACKREF_MULTI_IC: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backref_multi_ic")));
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+            rb_str_cat(buffer, "]", 1);
+            return true;
+        case T_OBJECT:
+            if (rb_obj_class(value) == rb_cOnigmoCodepointRangeSet) {
+                VALUE pairs = rb_ivar_get(value, rb_intern("@pairs"));
+                json_nest(depth);
+                rb_str_cat(buffer, "[", 1);
 
-                for (int i = 0; i < NUM2INT(length); i++) {
-                    rb_ary_push(insn, read_memnum(&cursor));
+                for (long index = 0; index + 1 < RARRAY_LEN(pairs); index += 2) {
+                    if (index > 0) rb_str_cat(buffer, ",", 1);
+                    json_nest(depth + 1);
+                    rb_str_cat(buffer, "[", 1);
+                    if (!json_value(buffer, RARRAY_AREF(pairs, index), depth + 2)) return false;
+                    rb_str_cat(buffer, ",", 1);
+                    if (!json_value(buffer, RARRAY_AREF(pairs, index + 1), depth + 2)) return false;
+                    rb_str_cat(buffer, "]", 1);
                 }
 
-                break;
+                rb_str_cat(buffer, "]", 1);
+                return true;
             }
-            case OP_BACKREF_WITH_LEVEL: {
-                rb_ary_push(insn, ID2SYM(rb_intern("backref_with_level")));
+            return false;
+        default:
+            return false;
+    }
+}
 
-                rb_ary_push(insn, read_option(&cursor));
-                rb_ary_push(insn, read_length(&cursor));
+static bool json_node(VALUE buffer, Node *node, OnigEncoding encoding, long depth);
 
-                VALUE length = read_length(&cursor);
-                rb_ary_push(insn, length);
+static bool
+json_child(VALUE buffer, Node *node, OnigEncoding encoding, long depth) {
+    json_key(buffer, "node");
 
-                for (int i = 0; i < NUM2INT(length); i++) {
-                    rb_ary_push(insn, read_memnum(&cursor));
-                }
+    if (node == NULL) {
+        rb_str_cat(buffer, "null", 4);
+        return true;
+    }
 
-                break;
-            }
-            case OP_MEMORY_START:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_start")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+    return json_node(buffer, node, encoding, depth);
+}
 
-            case OP_MEMORY_START_PUSH:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_start_push")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+// Fields are written in the same order as DeconstructVisitor builds them,
+// followed by the type that JSONVisitor merges in. depth is the nesting of
+// this node's object. After a string that cannot be written identically the
+// walk still goes on, so that a tree that is too deep always raises rather
+// than falling back to a Ruby path that would overflow the stack.
+static bool
+json_node(VALUE buffer, Node *node, OnigEncoding encoding, long depth) {
+    flat_type_t type = flat_type(node);
+    bool result = true;
 
-            case OP_MEMORY_END_PUSH:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_end_push")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+    json_nest(depth);
+    rb_str_cat(buffer, "{", 1);
 
-            case OP_MEMORY_END_PUSH_REC:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_end_push_rec")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+    switch (NTYPE(node)) {
+        case NT_STR:
+            json_key(buffer, "value");
+            result = json_bytes(buffer, (const char *) NSTR(node)->s, NSTR(node)->end - NSTR(node)->s, encoding);
+            rb_str_cat(buffer, ",", 1);
+            break;
+        case NT_CCLASS: {
+            int count = 0;
 
-            case OP_MEMORY_END:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_end")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+            json_key(buffer, "values");
+            json_nest(depth + 1);
+            rb_str_cat(buffer, "[", 1);
+            result = json_characters(buffer, NCCLASS(node)->bs, encoding, &count);
+            json_codepoints(buffer, NCCLASS(node)->mbuf, count);
+            rb_str_cat(buffer, "],", 2);
 
-            case OP_MEMORY_END_REC:
-                rb_ary_push(insn, ID2SYM(rb_intern("memory_end_rec")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
+            count = 0;
+            json_key(buffer, "characters");
+            rb_str_cat(buffer, "[", 1);
+            result = json_characters(buffer, NCCLASS(node)->bs, encoding, &count) && result;
+            rb_str_cat(buffer, "],", 2);
+            json_key(buffer, "ranges");
+            json_ranges(buffer, NCCLASS(node)->mbuf, depth + 1);
+            rb_str_cat(buffer, ",", 1);
+            break;
+        }
+        case NT_BREF: {
+            BRefNode *backref_node = NBREF(node);
+            int *backrefs = BACKREFS_P(backref_node);
 
-            case OP_KEEP: {
-                rb_ary_push(insn, ID2SYM(rb_intern("keep")));
-                break;
-            }
-            case OP_FAIL: {
-                rb_ary_push(insn, ID2SYM(rb_intern("fail")));
-                break;
-            }
-            case OP_JUMP: {
-                rb_ary_push(insn, ID2SYM(rb_intern("jump")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_PUSH: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_POP: {
-                rb_ary_push(insn, ID2SYM(rb_intern("pop")));
-                break;
-            }
-            case OP_PUSH_OR_JUMP_EXACT1: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_or_jump_exact1")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                rb_ary_push(insn, read_exact(&cursor, 1, encoding));
-                break;
-            }
-            case OP_PUSH_IF_PEEK_NEXT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_if_peek_next")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                rb_ary_push(insn, read_exact(&cursor, 1, encoding));
-                break;
-            }
-            case OP_REPEAT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_REPEAT_NG: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat_ng")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_REPEAT_INC: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat_inc")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_REPEAT_INC_NG: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat_inc_ng")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_REPEAT_INC_SG: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat_inc_sg")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_REPEAT_INC_NG_SG: {
-                rb_ary_push(insn, ID2SYM(rb_intern("repeat_inc_ng_sg")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_NULL_CHECK_START: {
-                rb_ary_push(insn, ID2SYM(rb_intern("null_check_start")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_NULL_CHECK_END: {
-                rb_ary_push(insn, ID2SYM(rb_intern("null_check_end")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_NULL_CHECK_END_MEMST: {
-                rb_ary_push(insn, ID2SYM(rb_intern("null_check_end_memst")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_NULL_CHECK_END_MEMST_PUSH: {
-                rb_ary_push(insn, ID2SYM(rb_intern("null_check_end_memst_push")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                break;
-            }
-            case OP_PUSH_POS: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_pos")));
-                break;
-            }
-            case OP_POP_POS: {
-                rb_ary_push(insn, ID2SYM(rb_intern("pop_pos")));
-                break;
-            }
-            case OP_PUSH_POS_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_pos_not")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_FAIL_POS: {
-                rb_ary_push(insn, ID2SYM(rb_intern("fail_pos")));
-                break;
-            }
-            case OP_PUSH_STOP_BT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_stop_bt")));
-                break;
-            }
-            case OP_POP_STOP_BT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("pop_stop_bt")));
-                break;
-            }
-            case OP_LOOK_BEHIND: {
-                rb_ary_push(insn, ID2SYM(rb_intern("look_behind")));
-                rb_ary_push(insn, read_length(&cursor));
-                break;
-            }
-            case OP_PUSH_LOOK_BEHIND_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_look_behind_not")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                rb_ary_push(insn, read_length(&cursor));
-                break;
-            }
-            case OP_FAIL_LOOK_BEHIND_NOT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("fail_look_behind_not")));
-                break;
-            }
-            case OP_PUSH_ABSENT_POS: {
-                rb_ary_push(insn, ID2SYM(rb_intern("push_absent_pos")));
-                break;
-            }
-            case OP_ABSENT: {
-                rb_ary_push(insn, ID2SYM(rb_intern("absent")));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
-            }
-            case OP_ABSENT_END: {
-                rb_ary_push(insn, ID2SYM(rb_intern("absent_end")));
-                break;
-            }
-            case OP_CALL: {
-                rb_ary_push(insn, ID2SYM(rb_intern("call")));
-                rb_ary_push(insn, read_absaddr(&cursor));
-                break;
-            }
-            case OP_RETURN: {
-                rb_ary_push(insn, ID2SYM(rb_intern("return")));
-                break;
+            json_key(buffer, "values");
+            json_nest(depth + 1);
+            rb_str_cat(buffer, "[", 1);
+
+            for (int index = 0; index < backref_node->back_num; index++) {
+                if (index > 0) rb_str_cat(buffer, ",", 1);
+                json_int(buffer, backrefs[index]);
             }
-            case OP_CONDITION: {
-                rb_ary_push(insn, ID2SYM(rb_intern("condition")));
-                rb_ary_push(insn, read_memnum(&cursor));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
+
+            rb_str_cat(buffer, "],", 2);
+            break;
+        }
+        case NT_QTFR:
+            json_key(buffer, "lower");
+            if (NQTFR(node)->lower == -1) {
+                rb_str_cat(buffer, "null", 4);
+            } else {
+                json_int(buffer, NQTFR(node)->lower);
             }
-            case OP_STATE_CHECK_PUSH: {
-                rb_ary_push(insn, ID2SYM(rb_intern("state_check_push")));
-                rb_ary_push(insn, read_state_check(&cursor));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
+
+            rb_str_cat(buffer, ",", 1);
+            json_key(buffer, "upper");
+            if (NQTFR(node)->upper == -1) {
+                rb_str_cat(buffer, "null", 4);
+            } else {
+                json_int(buffer, NQTFR(node)->upper);
             }
-            case OP_STATE_CHECK_PUSH_OR_JUMP: {
-                rb_ary_push(insn, ID2SYM(rb_intern("state_check_push_or_jump")));
-                rb_ary_push(insn, read_state_check(&cursor));
-                rb_ary_push(insn, read_reladdr(&cursor));
-                break;
+
+            rb_str_cat(buffer, ",", 1);
+            json_key(buffer, "greedy");
+            rb_str_cat(buffer, NQTFR(node)->greedy ? "true," : "false,", NQTFR(node)->greedy ? 5 : 6);
+
+            result = json_child(buffer, NQTFR(node)->target, encoding, depth + 1);
+            rb_str_cat(buffer, ",", 1);
+            break;
+        case NT_ENCLOSE:
+            switch (NENCLOSE(node)->type) {
+                case ENCLOSE_OPTION:
+                    json_key(buffer, "options");
+                    json_value(buffer, build_options(NENCLOSE(node)->option), depth + 1);
+                    rb_str_cat(buffer, ",", 1);
+                    break;
+                case ENCLOSE_MEMORY:
+                case ENCLOSE_CONDITION:
+                    json_key(buffer, "number");
+                    json_int(buffer, NENCLOSE(node)->regnum);
+                    rb_str_cat(buffer, ",", 1);
+                    break;
             }
-            case OP_STATE_CHECK: {
-                rb_ary_push(insn, ID2SYM(rb_intern("state_check")));
-                rb_ary_push(insn, read_state_check(&cursor));
-                break;
+
+            result = json_child(buffer, NENCLOSE(node)->target, encoding, depth + 1);
+            rb_str_cat(buffer, ",", 1);
+            break;
+        case NT_ANCHOR:
+            if (NANCHOR(node)->target != NULL) {
+                result = json_child(buffer, NANCHOR(node)->target, encoding, depth + 1);
+                rb_str_cat(buffer, ",", 1);
             }
-            case OP_STATE_CHECK_ANYCHAR_STAR: {
-                rb_ary_push(insn, ID2SYM(rb_intern("state_check_anychar_star")));
-                rb_ary_push(insn, read_state_check(&cursor));
-                break;
+            break;
+        case NT_LIST:
+        case NT_ALT:
+            json_key(buffer, "nodes");
+            json_nest(depth + 1);
+            rb_str_cat(buffer, "[", 1);
+
+            for (Node *cursor = node; IS_NOT_NULL(cursor); cursor = NCDR(cursor)) {
+                if (cursor != node) rb_str_cat(buffer, ",", 1);
+                result = json_node(buffer, NCAR(cursor), encoding, depth + 2) && result;
             }
-            case OP_STATE_CHECK_ANYCHAR_ML_STAR: {
-                rb_ary_push(insn, ID2SYM(rb_intern("state_check_anychar_ml_star")));
-                rb_ary_push(insn, read_state_check(&cursor));
-                break;
+
+            rb_str_cat(buffer, "],", 2);
+            break;
+        case NT_CALL: {
+            CallNode *call_node = NCALL(node);
+            ptrdiff_t length = call_node->name_end - call_node->name;
+
+            json_key(buffer, "number");
+            json_int(buffer, call_node->group_num);
+            rb_str_cat(buffer, ",", 1);
+            json_key(buffer, "name");
+
+            if (length > 0) {
+                result = json_bytes(buffer, (const char *) call_node->name, length, encoding);
+            } else {
+                rb_str_cat(buffer, "null", 4);
             }
-            case OP_SET_OPTION_PUSH: {
-                rb_ary_push(insn, ID2SYM(rb_intern("set_option_push")));
-                rb_ary_push(insn, read_option(&cursor));
-                break;
+
+            rb_str_cat(buffer, ",", 1);
+            break;
+        }
+    }
+
+    json_type(buffer, type);
+
+    return result;
+}
+
+static VALUE
+json_buffer(void) {
+    return rb_enc_associate(rb_str_buf_new(256), rb_utf8_encoding());
+}
+
+typedef struct {
+    VALUE buffer;
+    OnigEncoding encoding;
+    regex_t *regex;
+    Node *root;
+} json_parse_t;
+
+static VALUE
+json_parse_run(VALUE data) {
+    json_parse_t *json_parse = (json_parse_t *) data;
+    return json_node(json_parse->buffer, json_parse->root, json_parse->encoding, 1) ? json_parse->buffer : Qnil;
+}
+
+static VALUE
+json_parse_free(VALUE data) {
+    json_parse_t *json_parse = (json_parse_t *) data;
+    onig_node_free(json_parse->root);
+    onig_free(json_parse->regex);
+    return Qnil;
+}
+
+static VALUE
+parse_to_json(VALUE self, VALUE source) {
+    json_parse_t json_parse = { .buffer = json_buffer() };
+
+    OnigOptionType options;
+    VALUE string = resolve_source(source, &json_parse.encoding, &options);
+    json_parse.root = parse_native(string, json_parse.encoding, options, &json_parse.regex);
+
+    VALUE json = rb_ensure(json_parse_run, (VALUE) &json_parse, json_parse_free, (VALUE) &json_parse);
+    if (!NIL_P(json)) return json;
+
+    VALUE node = rb_funcall(self, rb_intern("parse"), 1, source);
+    return rb_funcall(rb_funcall(node, rb_intern("as_json"), 0), rb_intern("to_json"), 0);
+}
+
+static bool
+json_object(VALUE buffer, VALUE object, long depth) {
+    int type = node_type(object);
+    if (type == -1) return false;
+
+    node_load(object);
+
+    bool result = true;
+
+    json_nest(depth);
+    rb_str_cat(buffer, "{", 1);
+
+    if (type == FLAT_CCLASS || type == FLAT_CCLASS_INVERT) {
+        json_key(buffer, "values");
+        result = json_value(buffer, rb_funcall(object, rb_intern("values"), 0), depth + 1);
+        rb_str_cat(buffer, ",", 1);
+    }
+
+    for (int index = 0; index < 4 && node_fields[type][index] != NULL; index++) {
+        json_key(buffer, node_fields[type][index] + 1);
+        result = json_value(buffer, rb_ivar_get(object, node_field_ids[type][index]), depth + 1) && result;
+        rb_str_cat(buffer, ",", 1);
+    }
+
+    switch (type) {
+        case FLAT_ALTERNATION:
+        case FLAT_LIST: {
+            VALUE nodes = rb_ivar_get(object, rb_intern("@nodes"));
+            if (!RB_TYPE_P(nodes, T_ARRAY)) return false;
+
+            json_key(buffer, "nodes");
+            json_nest(depth + 1);
+            rb_str_cat(buffer, "[", 1);
+
+            for (long index = 0; index < RARRAY_LEN(nodes); index++) {
+                if (index > 0) rb_str_cat(buffer, ",", 1);
+                result = json_object(buffer, RARRAY_AREF(nodes, index), depth + 2) && result;
             }
-            case OP_SET_OPTION: {
-                rb_ary_push(insn, ID2SYM(rb_intern("set_option")));
-                rb_ary_push(insn, read_option(&cursor));
-                break;
+
+            rb_str_cat(buffer, "],", 2);
+            break;
+        }
+        case FLAT_ENCLOSE_ABSENT:
+        case FLAT_ENCLOSE_CONDITION:
+        case FLAT_ENCLOSE_MEMORY:
+        case FLAT_ENCLOSE_OPTIONS:
+        case FLAT_ENCLOSE_STOP_BACKTRACK:
+        case FLAT_LOOK_AHEAD:
+        case FLAT_LOOK_AHEAD_INVERT:
+        case FLAT_LOOK_BEHIND:
+        case FLAT_LOOK_BEHIND_INVERT:
+        case FLAT_QUANTIFIER: {
+            VALUE child = rb_ivar_get(object, rb_intern("@node"));
+
+            json_key(buffer, "node");
+            if (NIL_P(child)) {
+                rb_str_cat(buffer, "null", 4);
+            } else {
+                result = json_object(buffer, child, depth + 1) && result;
             }
+
+            rb_str_cat(buffer, ",", 1);
+            break;
         }
+    }
 
-        rb_ary_push(insns, insn);
+    json_type(buffer, type);
+
+    return result;
+}
+
+// The fast path behind Node#to_json, or nil if the Ruby path has to be used.
+static VALUE
+node_native_json(VALUE self) {
+    VALUE buffer = json_buffer();
+    return json_object(buffer, self, 1) ? buffer : Qnil;
+}
+
+typedef struct {
+    VALUE buffer;
+    regex_t *regex;
+} compile_json_t;
+
+// A single instruction array is reused for every instruction, so only the
+// operands themselves are allocated. Returns Qfalse if an operand could not be
+// written natively.
+static VALUE
+compile_json_insns(VALUE data) {
+    compile_json_t *json = (compile_json_t *) data;
+    regex_t *regex = json->regex;
+
+    VALUE insn = rb_ary_new();
+    bool result = true;
+
+    const unsigned char *cursor = regex->p;
+    const unsigned char *end = cursor + regex->used;
+
+    rb_str_cat(json->buffer, "[", 1);
+
+    while (result && cursor < end) {
+        if (cursor != regex->p) rb_str_cat(json->buffer, ",", 1);
+
+        rb_ary_clear(insn);
+        cursor = read_insn_checked(regex->p, cursor, end, regex->enc, insn);
+        result = json_value(json->buffer, insn, 2);
     }
 
-    onig_free(regex);
-    onig_end();
-    return insns;
+    rb_str_cat(json->buffer, "]", 1);
+    return result ? Qtrue : Qfalse;
+}
+
+// Like profile, this compiles its own copy of a Regexp's source, and frees it
+// even when writing an instruction raises.
+static VALUE
+compile_to_json(VALUE self, VALUE source) {
+    compile_json_t json = { .buffer = json_buffer(), .regex = vm_regex(source) };
+    if (RTEST(rb_ensure(compile_json_insns, (VALUE) &json, compile_free, (VALUE) json.regex))) return json.buffer;
+
+    VALUE insns = rb_funcall(self, rb_intern("compile"), 1, source);
+    return rb_funcall(insns, rb_intern("to_json"), 0);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+// A read-only mapping of a dumped file. Slices of it are strings that point
+// straight into the mapping, and each one keeps the mapping alive.
+typedef struct {
+    void *data;
+    size_t length;
+} mapped_file_t;
+
+static void
+mapped_file_free(void *data) {
+    mapped_file_t *mapped_file = (mapped_file_t *) data;
+
+    if (mapped_file->data != NULL) munmap(mapped_file->data, mapped_file->length);
+    xfree(mapped_file);
+}
+
+static size_t
+mapped_file_memsize(const void *data) {
+    return sizeof(mapped_file_t);
+}
+
+static const rb_data_type_t mapped_file_type = {
+    .wrap_struct_name = "Onigmo::MappedFile",
+    .function = {
+        .dfree = mapped_file_free,
+        .dsize = mapped_file_memsize
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+mapped_file_open(VALUE self, VALUE path) {
+    FilePathValue(path);
+
+    mapped_file_t *mapped_file;
+    VALUE object = TypedData_Make_Struct(rb_cOnigmoMappedFile, mapped_file_t, &mapped_file_type, mapped_file);
+
+    int fd = open(StringValueCStr(path), O_RDONLY);
+    if (fd == -1) rb_sys_fail_str(path);
+
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) == -1) {
+        close(fd);
+        rb_sys_fail_str(path);
+    }
+
+    if (stat_buffer.st_size > 0) {
+        void *data = mmap(NULL, (size_t) stat_buffer.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (data == MAP_FAILED) {
+            close(fd);
+            rb_sys_fail_str(path);
+        }
+
+        mapped_file->data = data;
+        mapped_file->length = (size_t) stat_buffer.st_size;
+    }
+
+    close(fd);
+    return object;
+}
+
+static VALUE
+mapped_file_bytesize(VALUE self) {
+    mapped_file_t *mapped_file;
+    TypedData_Get_Struct(self, mapped_file_t, &mapped_file_type, mapped_file);
+    return SIZET2NUM(mapped_file->length);
 }
 
+static VALUE
+mapped_file_slice(VALUE self, VALUE offset, VALUE length) {
+    mapped_file_t *mapped_file;
+    TypedData_Get_Struct(self, mapped_file_t, &mapped_file_type, mapped_file);
+
+    size_t start = NUM2SIZET(offset);
+    size_t size = NUM2SIZET(length);
+
+    if (start > mapped_file->length || size > mapped_file->length - start) {
+        rb_raise(rb_eArgError, "slice out of bounds");
+    }
+
+    if (size == 0) return rb_obj_freeze(rb_str_new(NULL, 0));
+
+    VALUE string = rb_str_new_static((const char *) mapped_file->data + start, (long) size);
+    rb_ivar_set(string, rb_intern("mapped_file"), self);
+    return rb_obj_freeze(string);
+}
+#endif
+
 void
 Init_onigmo(void) {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+    rb_ext_ractor_safe(true);
+#endif
+
     VALUE rb_cOnigmo = rb_define_module("Onigmo");
-    rb_define_singleton_method(rb_cOnigmo, "parse", parse, 1);
-    rb_define_singleton_method(rb_cOnigmo, "compile", compile, 1);
+    rb_define_singleton_method(rb_cOnigmo, "parse", parse, -1);
+    rb_define_singleton_method(rb_cOnigmo, "parse_all", parse_all, -1);
+    rb_define_singleton_method(rb_cOnigmo, "parse_flat", parse_flat, 1);
+    rb_define_singleton_method(rb_cOnigmo, "walk", walk, 2);
+    rb_define_singleton_method(rb_cOnigmo, "analyze_redos", analyze_redos, 1);
+    rb_define_singleton_method(rb_cOnigmo, "compile", compile, -1);
+    rb_define_singleton_method(rb_cOnigmo, "optimization_info", optimization_info, 1);
+    rb_define_singleton_method(rb_cOnigmo, "profile", profile, 2);
+    rb_define_singleton_method(rb_cOnigmo, "parse_to_json", parse_to_json, 1);
+    rb_define_singleton_method(rb_cOnigmo, "compile_to_json", compile_to_json, 1);
+
+    rb_define_singleton_method(rb_cOnigmo, "cache_limit", get_cache_limit, 0);
+    rb_define_singleton_method(rb_cOnigmo, "cache_limit=", set_cache_limit, 1);
+    rb_define_singleton_method(rb_cOnigmo, "cache_stats", cache_stats, 0);
+    rb_define_singleton_method(rb_cOnigmo, "clear_cache", clear_cache, 0);
+
+    cache_entries = rb_hash_new();
+    rb_gc_register_mark_object(cache_entries);
+
+    options_pool_key = rb_ractor_local_storage_value_newkey();
+    characters_pool_key = rb_ractor_local_storage_value_newkey();
+
+    for (int opcode = 0; opcode < OPCODE_COUNT; opcode++) {
+        if (opcode_names[opcode] != NULL) opcode_ids[opcode] = rb_intern(opcode_names[opcode]);
+    }
+
+    cache_ractor_key = rb_ractor_local_storage_value_newkey();
+    rb_ractor_local_storage_value_set(cache_ractor_key, Qtrue);
 
     rb_cOnigmoNode = rb_define_class_under(rb_cOnigmo, "Node", rb_cObject);
+    rb_define_private_method(rb_cOnigmoNode, "load_children", node_load_children, 0);
+    rb_define_private_method(rb_cOnigmoNode, "native_json", node_native_json, 0);
+    rb_define_method(rb_cOnigmoNode, "each_child", node_each_child, 0);
+    rb_define_method(rb_cOnigmoNode, "hash", node_hash, 0);
+    rb_define_method(rb_cOnigmoNode, "eql?", node_eql, 1);
+    rb_define_method(rb_cOnigmoNode, "==", node_eql, 1);
     rb_cOnigmoAlternationNode = rb_define_class_under(rb_cOnigmo, "AlternationNode", rb_cOnigmoNode);
     rb_cOnigmoAnchorBufferBeginNode = rb_define_class_under(rb_cOnigmo, "AnchorBufferBeginNode", rb_cOnigmoNode);
     rb_cOnigmoAnchorBufferEndNode = rb_define_class_under(rb_cOnigmo, "AnchorBufferEndNode", rb_cOnigmoNode);
@@ -982,4 +5281,110 @@ Init_onigmo(void) {
     rb_cOnigmoStringNode = rb_define_class_under(rb_cOnigmo, "StringNode", rb_cOnigmoNode);
     rb_cOnigmoWordNode = rb_define_class_under(rb_cOnigmo, "WordNode", rb_cOnigmoNode);
     rb_cOnigmoWordInvertNode = rb_define_class_under(rb_cOnigmo, "WordInvertNode", rb_cOnigmoNode);
+
+    rb_cOnigmoCodepointRangeSet = rb_define_class_under(rb_cOnigmo, "CodepointRangeSet", rb_cObject);
+
+    rb_cOnigmoTree = rb_define_class_under(rb_cOnigmo, "Tree", rb_cObject);
+    rb_undef_alloc_func(rb_cOnigmoTree);
+
+    rb_cOnigmoProgram = rb_define_class_under(rb_cOnigmo, "Program", rb_cObject);
+    rb_undef_alloc_func(rb_cOnigmoProgram);
+    rb_include_module(rb_cOnigmoProgram, rb_mEnumerable);
+    rb_define_method(rb_cOnigmoProgram, "size", program_size, 0);
+    rb_define_method(rb_cOnigmoProgram, "bytesize", program_bytesize, 0);
+    rb_define_method(rb_cOnigmoProgram, "[]", program_aref, 1);
+    rb_define_method(rb_cOnigmoProgram, "opcode_at", program_opcode_at, 1);
+    rb_define_method(rb_cOnigmoProgram, "each", program_each, 0);
+    rb_define_method(rb_cOnigmoProgram, "bytecode", program_bytecode, 0);
+    rb_define_method(rb_cOnigmoProgram, "encoding", program_encoding, 0);
+    rb_define_singleton_method(rb_cOnigmoProgram, "from_bytecode", program_from_bytecode, 2);
+
+    rb_cOnigmoSafeRegex = rb_define_class_under(rb_cOnigmo, "SafeRegex", rb_cObject);
+    rb_undef_alloc_func(rb_cOnigmoSafeRegex);
+    rb_define_singleton_method(rb_cOnigmoSafeRegex, "new", safe_regex_new, -1);
+    rb_define_method(rb_cOnigmoSafeRegex, "match", safe_regex_match, -1);
+    rb_define_method(rb_cOnigmoSafeRegex, "max_steps", safe_regex_max_steps, 0);
+    rb_define_method(rb_cOnigmoSafeRegex, "max_stack", safe_regex_max_stack, 0);
+    rb_eOnigmoBudgetExceeded = rb_define_class_under(rb_cOnigmoSafeRegex, "BudgetExceeded", rb_eStandardError);
+    rb_eOnigmoUnsupportedPattern = rb_define_class_under(rb_cOnigmoSafeRegex, "UnsupportedPattern", rb_eStandardError);
+
+#ifdef HAVE_SYS_MMAN_H
+    rb_cOnigmoMappedFile = rb_define_class_under(rb_cOnigmo, "MappedFile", rb_cObject);
+    rb_undef_alloc_func(rb_cOnigmoMappedFile);
+    rb_define_singleton_method(rb_cOnigmoMappedFile, "open", mapped_file_open, 1);
+    rb_define_method(rb_cOnigmoMappedFile, "bytesize", mapped_file_bytesize, 0);
+    rb_define_method(rb_cOnigmoMappedFile, "slice", mapped_file_slice, 2);
+#endif
+
+    rb_cOnigmoFlatTree = rb_define_class_under(rb_cOnigmo, "FlatTree", rb_cObject);
+    VALUE flat_types[] = {
+        rb_cOnigmoAlternationNode,
+        rb_cOnigmoAnchorBufferBeginNode,
+        rb_cOnigmoAnchorBufferEndNode,
+        rb_cOnigmoAnchorKeepNode,
+        rb_cOnigmoAnchorLineBeginNode,
+        rb_cOnigmoAnchorLineEndNode,
+        rb_cOnigmoAnchorPositionBeginNode,
+        rb_cOnigmoAnchorSemiEndNode,
+        rb_cOnigmoAnchorWordBoundaryNode,
+        rb_cOnigmoAnchorWordBoundaryInvertNode,
+        rb_cOnigmoAnyNode,
+        rb_cOnigmoBackrefNode,
+        rb_cOnigmoCallNode,
+        rb_cOnigmoCClassNode,
+        rb_cOnigmoCClassInvertNode,
+        rb_cOnigmoEncloseAbsentNode,
+        rb_cOnigmoEncloseConditionNode,
+        rb_cOnigmoEncloseMemoryNode,
+        rb_cOnigmoEncloseOptionsNode,
+        rb_cOnigmoEncloseStopBacktrackNode,
+        rb_cOnigmoListNode,
+        rb_cOnigmoLookAheadNode,
+        rb_cOnigmoLookAheadInvertNode,
+        rb_cOnigmoLookBehindNode,
+        rb_cOnigmoLookBehindInvertNode,
+        rb_cOnigmoQuantifierNode,
+        rb_cOnigmoStringNode,
+        rb_cOnigmoWordNode,
+        rb_cOnigmoWordInvertNode
+    };
+    rb_cOnigmoWalkEvent = rb_define_class_under(rb_cOnigmo, "WalkEvent", rb_cObject);
+    rb_cOnigmoRedosFinding = rb_define_class_under(rb_cOnigmo, "RedosFinding", rb_cObject);
+    rb_cOnigmoProfile = rb_define_class_under(rb_cOnigmo, "Profile", rb_cObject);
+    MEMCPY(node_classes, flat_types, VALUE, FLAT_TYPE_COUNT);
+    for (int type = 0; type < FLAT_TYPE_COUNT; type++) {
+        for (int index = 0; index < 4 && node_fields[type][index] != NULL; index++) {
+            node_field_ids[type][index] = rb_intern(node_fields[type][index]);
+        }
+    }
+
+    rb_cOnigmoVisitor = rb_define_class_under(rb_cOnigmo, "Visitor", rb_cObject);
+    rb_define_method(rb_cOnigmoVisitor, "visit_child_nodes", visitor_visit_child_nodes, 1);
+    visitor_dispatch_key = rb_intern("__onigmo_visitor_dispatch__");
+
+    rb_define_const(rb_cOnigmoFlatTree, "TYPES", rb_obj_freeze(rb_ary_new_from_values(sizeof(flat_types) / sizeof(VALUE), flat_types)));
+
+    flat_type_t leaf_types[] = {
+        FLAT_ANCHOR_BUFFER_BEGIN,
+        FLAT_ANCHOR_BUFFER_END,
+        FLAT_ANCHOR_KEEP,
+        FLAT_ANCHOR_LINE_BEGIN,
+        FLAT_ANCHOR_LINE_END,
+        FLAT_ANCHOR_POSITION_BEGIN,
+        FLAT_ANCHOR_SEMI_END,
+        FLAT_ANCHOR_WORD_BOUNDARY,
+        FLAT_ANCHOR_WORD_BOUNDARY_INVERT,
+        FLAT_ANY,
+        FLAT_WORD,
+        FLAT_WORD_INVERT
+    };
+
+    for (size_t index = 0; index < sizeof(leaf_types) / sizeof(flat_type_t); index++) {
+        VALUE leaf_node = rb_obj_alloc(flat_types[leaf_types[index]]);
+        rb_gc_register_mark_object(leaf_node);
+        leaf_nodes[leaf_types[index]] = rb_ractor_make_shareable(leaf_node);
+    }
+
+    parse_batch_syntax = *ONIG_SYNTAX_DEFAULT;
+    parse_batch_syntax.behavior &= ~(ONIG_SYN_WARN_CC_OP_NOT_ESCAPED | ONIG_SYN_WARN_REDUNDANT_NESTED_REPEAT | ONIG_SYN_WARN_CC_DUP);
 }
@@ -1,11 +1,34 @@
 # frozen_string_literal: true
 
 module Onigmo
+  require "onigmo/codepoint_range_set"
+  require "onigmo/flat_tree"
   require "onigmo/node"
+  require "onigmo/walk_event"
+  require "onigmo/interner"
+  require "onigmo/redos_finding"
+  require "onigmo/profile"
   require "onigmo/onigmo"
+  require "onigmo/artifact"
 
-  autoload :Visitor, "onigmo/visitor"
-  autoload :DeconstructVisitor, "onigmo/deconstruct_visitor"
-  autoload :JSONVisitor, "onigmo/json_visitor"
-  autoload :PrettyPrintVisitor, "onigmo/pretty_print_visitor"
+  # These are required eagerly rather than autoloaded, since autoloading
+  # constants is not allowed from non-main Ractors.
+  require "onigmo/visitor"
+  require "onigmo/deconstruct_visitor"
+  require "onigmo/mutation_visitor"
+  require "onigmo/json_visitor"
+  require "onigmo/pretty_print_visitor"
+
+  # The ReDoS tooling is only loaded once it is used, so it is not available
+  # from non-main Ractors until it has been loaded from the main one.
+  autoload :AttackString, "onigmo/attack_string"
+  autoload :ExampleVisitor, "onigmo/example_visitor"
+
+  # Returns an AttackString for every finding of analyze_redos that an attack
+  # could be built for, each with its pump repeated so that the whole attack
+  # is about length characters long.
+  def self.attack_strings(source, length:)
+    tree = parse(source)
+    analyze_redos(source).filter_map { |finding| AttackString.build(source, tree, finding, length) }
+  end
 end
@@ -0,0 +1,115 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # A versioned binary format for flat trees and programs, so that a corpus
+  # can be parsed or compiled once and loaded elsewhere. Every section is
+  # addressed by offset from the start of the file, so a loaded artifact reads
+  # directly out of the file's bytes (memory-mapped where possible) instead of
+  # being deserialized.
+  #
+  #     magic    "ONIGMO\0\0"
+  #     uint32   version
+  #     uint32   kind (1 for a FlatTree, 2 for a Program)
+  #     uint32   0x01020304 in the writer's byte order
+  #     uint32   section count
+  #     uint32   offset and uint32 length of each section
+  #
+  # Sections are 8-byte aligned. The first section is the encoding name, the
+  # rest are the FlatTree buffers in order or the Program bytecode. Integers
+  # in the sections keep the writer's byte order, and loading an artifact
+  # written with a different byte order raises an error.
+  module Artifact
+    MAGIC = "ONIGMO\0\0".b.freeze
+    VERSION = 1
+    BYTE_ORDER = 0x01020304
+
+    KIND_FLAT_TREE = 1
+    KIND_PROGRAM = 2
+
+    HEADER_SIZE = MAGIC.bytesize + 16
+
+    class << self
+      def dump(object)
+        case object
+        when FlatTree
+          kind = KIND_FLAT_TREE
+          sections = [object.types, object.parents, object.first_children, object.next_siblings, object.payload, object.offsets]
+        when Program
+          kind = KIND_PROGRAM
+          sections = [object.bytecode]
+        else
+          raise TypeError, "cannot dump #{object.class}, expected an Onigmo::FlatTree or Onigmo::Program"
+        end
+
+        sections.unshift(object.encoding.name)
+
+        offset = align(HEADER_SIZE + sections.length * 8)
+        table = sections.map { |section| [offset, section.bytesize].tap { offset = align(offset + section.bytesize) } }
+
+        buffer = MAGIC.dup
+        buffer << [VERSION, kind, BYTE_ORDER, sections.length, *table.flatten].pack("L*")
+
+        sections.each do |section|
+          buffer << "\0" * (align(buffer.bytesize) - buffer.bytesize)
+          buffer << section.b
+        end
+
+        buffer
+      end
+
+      def load(source)
+        data =
+          if source.respond_to?(:read)
+            source.read.b.freeze
+          elsif defined?(MappedFile)
+            MappedFile.open(source)
+          else
+            File.binread(source).freeze
+          end
+
+        raise ArgumentError, "not an onigmo artifact" if data.bytesize < HEADER_SIZE || slice(data, 0, MAGIC.bytesize) != MAGIC
+
+        version, kind, byte_order, count = slice(data, MAGIC.bytesize, 16).unpack("L4")
+        raise ArgumentError, "unsupported artifact version #{version}" if version != VERSION
+        raise ArgumentError, "artifact was written with a different byte order" if byte_order != BYTE_ORDER
+
+        sections = slice(data, HEADER_SIZE, count * 8).unpack("L*").each_slice(2).map { |offset, length| slice(data, offset, length) }
+        encoding = Encoding.find(sections.shift)
+
+        case kind
+        when KIND_FLAT_TREE
+          raise ArgumentError, "malformed flat tree artifact" if sections.length != 6
+          FlatTree.new(*sections, encoding)
+        when KIND_PROGRAM
+          raise ArgumentError, "malformed program artifact" if sections.length != 1
+          Program.from_bytecode(sections.first, encoding)
+        else
+          raise ArgumentError, "unknown artifact kind #{kind}"
+        end
+      end
+
+      private
+
+      def align(offset)
+        (offset + 7) & ~7
+      end
+
+      def slice(data, offset, length)
+        if data.is_a?(String)
+          raise ArgumentError, "slice out of bounds" if offset + length > data.bytesize
+          data.byteslice(offset, length)
+        else
+          data.slice(offset, length)
+        end
+      end
+    end
+  end
+
+  def self.dump(object)
+    Artifact.dump(object)
+  end
+
+  def self.load(source)
+    Artifact.load(source)
+  end
+end
@@ -0,0 +1,164 @@
+# frozen_string_literal: true
+
+require "timeout"
+
+module Onigmo
+  # An input that makes a pattern backtrack as much as possible, found by
+  # Onigmo.attack_strings: a prefix that leads up to an ambiguous part of the
+  # pattern, a pump that the ambiguous part can match in more than one way,
+  # and a suffix that makes the match fail there, so that every way gets
+  # tried.
+  #
+  # * source - the pattern
+  # * finding - the RedosFinding that the attack is built on
+  # * prefix, pump, suffix - the parts of the attack
+  # * pumps - how many times to_s repeats the pump
+  class AttackString
+    # The step counts of the interpreter behind Onigmo.profile are compared at
+    # these pump counts to pick the attack that grows fastest.
+    SHORT_PUMPS = 4
+    LONG_PUMPS = 8
+
+    # How much the step count has to grow between SHORT_PUMPS and LONG_PUMPS
+    # for an attack to show its finding's complexity. Steps are counted with
+    # the pattern anchored at the start of the attack, since retrying every
+    # start position makes almost anything ending in x*$ quadratic, and the
+    # steps without any pumps are subtracted, which leaves linear growth at
+    # exactly LONG_PUMPS / SHORT_PUMPS. Exponential attacks have to reach half
+    # of the 2 ** (LONG_PUMPS - SHORT_PUMPS) they predict. Polynomial ones only
+    # have to grow a quarter faster than linear, since lower order terms still
+    # dominate at so few pumps.
+    def self.min_growth(finding)
+      return 2**(LONG_PUMPS - SHORT_PUMPS) / 2 if finding.complexity == :exponential
+
+      LONG_PUMPS.fdiv(SHORT_PUMPS) * 1.25
+    end
+
+    SUFFIXES = ["!", "", "\n", " ", "0", "a", "_"].freeze
+
+    attr_reader :source, :finding, :prefix, :pump, :suffix, :pumps
+
+    def initialize(source, finding, prefix, pump, suffix, pumps)
+      @source = source
+      @finding = finding
+      @prefix = prefix
+      @pump = pump
+      @suffix = suffix
+      @pumps = pumps
+    end
+
+    # The attack with the pump repeated count times.
+    def pumped(count)
+      "#{prefix}#{pump * count}#{suffix}"
+    end
+
+    def to_s
+      pumped(pumps)
+    end
+
+    # Measures how long Regexp#match? takes on the attack at each of the pump
+    # counts, as [count, seconds] pairs. seconds is nil for a match that ran
+    # past the timeout. Regexp timeouts only exist from Ruby 3.2, so earlier
+    # versions fall back to Timeout.
+    def timings(counts = [1_000, 2_000, 4_000, 8_000], timeout: 1.0)
+      regexp = Regexp.respond_to?(:timeout) ? Regexp.new(source, timeout: timeout) : Regexp.new(source)
+
+      counts.map do |count|
+        subject = pumped(count)
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+        if match_within?(regexp, subject, timeout)
+          [count, Process.clock_gettime(Process::CLOCK_MONOTONIC) - start]
+        else
+          [count, nil]
+        end
+      end
+    end
+
+    private
+
+    def match_within?(regexp, subject, timeout)
+      if regexp.respond_to?(:timeout)
+        regexp.match?(subject)
+      else
+        Timeout.timeout(timeout) { regexp.match?(subject) }
+      end
+
+      true
+    rescue Timeout::Error
+      false
+    rescue Regexp::TimeoutError
+      false
+    end
+
+    class << self
+      # Builds the attack for one finding, or returns nil if none of the
+      # candidates make the interpreter backtrack as the finding predicts.
+      def build(source, tree, finding, length)
+        encoding = source.encoding
+        path = finding.path.each_with_object([tree]) { |index, nodes| nodes << nodes.last.child_nodes[index] }
+
+        prefix = prefix(path, finding.path, ExampleVisitor.new(encoding))
+        pumps = pump_candidates(path, ExampleVisitor.new(encoding, repeat: true))
+
+        anchored = source.is_a?(Regexp) ? Regexp.new("\\A(?:#{source})") : "\\A(?:#{source})"
+        min_growth = min_growth(finding)
+
+        best = nil
+        pumps.product(SUFFIXES) do |pump, suffix|
+          base = steps(anchored, "#{prefix}#{suffix}")
+          short = steps(anchored, "#{prefix}#{pump * SHORT_PUMPS}#{suffix}")
+          long = steps(anchored, "#{prefix}#{pump * LONG_PUMPS}#{suffix}")
+          next if base.nil? || short.nil? || long.nil? || short <= base || long - base < (short - base) * min_growth
+          best = [long, pump, suffix] if best.nil? || long > best[0]
+        end
+
+        return unless best
+
+        _, pump, suffix = best
+        count = [(length - prefix.length - suffix.length) / pump.length, 1].max
+        new(source, finding, prefix, pump, suffix, count)
+      end
+
+      private
+
+      # Everything that has to match before the offending node: the examples
+      # of the earlier siblings of every list along the path.
+      def prefix(path, indices, visitor)
+        path.zip(indices).each_with_object(+"") do |(node, index), prefix|
+          next unless node.is_a?(ListNode) && index
+
+          node.nodes.first(index).each { |child_node| prefix << child_node.accept(visitor) }
+        end
+      end
+
+      # The pieces that the offending node could match in more than one way:
+      # each branch of an alternation, and the body of every quantifier from
+      # the offending node up to the root, along with the quantifiers beside
+      # it in its list.
+      def pump_candidates(path, visitor)
+        node = path.last
+        candidates = []
+
+        candidates.concat(node.nodes) if node.is_a?(AlternationNode)
+        path.reverse_each { |ancestor| candidates << ancestor.node if ancestor.is_a?(QuantifierNode) }
+
+        parent = path[-2]
+        parent.nodes.each { |sibling| candidates << sibling.node if sibling.is_a?(QuantifierNode) } if parent.is_a?(ListNode)
+
+        candidates.map { |candidate| candidate.accept(visitor) }.reject(&:empty?).uniq
+      end
+
+      # The number of steps the interpreter takes to search the subject. A
+      # subject can still match in the end, like an empty match at the end of
+      # the string, after backtracking through every earlier start position.
+      def steps(source, subject)
+        Onigmo.profile(source, subject).steps
+      rescue NotImplementedError, EncodingError
+        nil
+      end
+    end
+
+    private_class_method :new
+  end
+end
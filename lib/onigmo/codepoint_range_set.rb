@@ -0,0 +1,64 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # A sorted set of inclusive codepoint ranges, as stored in the multi-byte
+  # portion of a character class. Ranges are kept as a flat array of
+  # [from, to, from, to, ...] so that large Unicode classes stay compact.
+  class CodepointRangeSet
+    attr_reader :pairs
+
+    def initialize(pairs)
+      @pairs = pairs.freeze
+    end
+
+    def include?(codepoint)
+      codepoint = codepoint.ord if codepoint.is_a?(String)
+      index = (0...(pairs.length / 2)).bsearch { |pair| pairs[pair * 2 + 1] >= codepoint }
+      !index.nil? && pairs[index * 2] <= codepoint
+    end
+
+    def size
+      pairs.each_slice(2).sum { |from, to| to - from + 1 }
+    end
+
+    def empty?
+      pairs.empty?
+    end
+
+    def each_range
+      return enum_for(__method__) { pairs.length / 2 } unless block_given?
+      pairs.each_slice(2) { |from, to| yield from..to }
+    end
+
+    def each_codepoint(&block)
+      return enum_for(__method__) { size } unless block_given?
+      each_range { |range| range.each(&block) }
+    end
+
+    def ==(other)
+      other.is_a?(CodepointRangeSet) && pairs == other.pairs
+    end
+
+    alias eql? ==
+
+    def hash
+      [CodepointRangeSet, pairs].hash
+    end
+
+    def to_a
+      each_range.to_a
+    end
+
+    def as_json
+      pairs.each_slice(2).to_a
+    end
+
+    def to_json(*opts)
+      as_json.to_json(*opts)
+    end
+
+    def pretty_print(q)
+      q.pp(to_a)
+    end
+  end
+end
@@ -55,11 +55,11 @@ module Onigmo
     end
 
     def visit_cclass_node(node)
-      { values: node.values }
+      { values: node.values, characters: node.characters, ranges: node.ranges }
     end
 
     def visit_cclass_invert_node(node)
-      { values: node.values }
+      { values: node.values, characters: node.characters, ranges: node.ranges }
     end
 
     def visit_enclose_absent_node(node)
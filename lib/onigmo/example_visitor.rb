@@ -0,0 +1,87 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # Builds a short string that a node matches. Quantifiers repeat their lower
+  # bound, or once if repeat is set and the lower bound is 0. Anchors,
+  # lookarounds and backreferences contribute nothing, so the result is a
+  # best guess rather than a guaranteed match.
+  class ExampleVisitor < Visitor
+    # Tried in order for classes that are defined by what they exclude.
+    CANDIDATES = ["a", "0", "!", " ", "_"].freeze
+
+    attr_reader :encoding, :repeat
+
+    def initialize(encoding, repeat: false)
+      @encoding = encoding
+      @repeat = repeat
+    end
+
+    def visit_alternation_node(node)
+      visit(node.nodes.first)
+    end
+
+    def visit_anchor_buffer_begin_node(node)
+      +""
+    end
+
+    alias visit_anchor_buffer_end_node visit_anchor_buffer_begin_node
+    alias visit_anchor_keep_node visit_anchor_buffer_begin_node
+    alias visit_anchor_line_begin_node visit_anchor_buffer_begin_node
+    alias visit_anchor_line_end_node visit_anchor_buffer_begin_node
+    alias visit_anchor_position_begin_node visit_anchor_buffer_begin_node
+    alias visit_anchor_semi_end_node visit_anchor_buffer_begin_node
+    alias visit_anchor_word_boundary_node visit_anchor_buffer_begin_node
+    alias visit_anchor_word_boundary_invert_node visit_anchor_buffer_begin_node
+    alias visit_backref_node visit_anchor_buffer_begin_node
+    alias visit_call_node visit_anchor_buffer_begin_node
+    alias visit_enclose_absent_node visit_anchor_buffer_begin_node
+    alias visit_look_ahead_node visit_anchor_buffer_begin_node
+    alias visit_look_ahead_invert_node visit_anchor_buffer_begin_node
+    alias visit_look_behind_node visit_anchor_buffer_begin_node
+    alias visit_look_behind_invert_node visit_anchor_buffer_begin_node
+
+    def visit_any_node(node)
+      +"a"
+    end
+
+    def visit_cclass_node(node)
+      value = node.values.first
+      value.is_a?(Integer) ? value.chr(encoding) : +value.to_s
+    end
+
+    def visit_cclass_invert_node(node)
+      values = node.values
+      +(CANDIDATES.find { |candidate| !values.include?(candidate) && !values.include?(candidate.ord) } || "")
+    end
+
+    def visit_enclose_condition_node(node)
+      visit(node.node)
+    end
+
+    alias visit_enclose_memory_node visit_enclose_condition_node
+    alias visit_enclose_options_node visit_enclose_condition_node
+    alias visit_enclose_stop_backtrack_node visit_enclose_condition_node
+
+    def visit_list_node(node)
+      node.nodes.each_with_object(+"") { |child_node, example| example << visit(child_node) }
+    end
+
+    def visit_quantifier_node(node)
+      count = node.lower
+      count = 1 if repeat && count == 0 && node.upper != 0
+      visit(node.node) * count
+    end
+
+    def visit_string_node(node)
+      +node.value
+    end
+
+    def visit_word_node(node)
+      +"a"
+    end
+
+    def visit_word_invert_node(node)
+      +"!"
+    end
+  end
+end
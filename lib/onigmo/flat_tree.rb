@@ -0,0 +1,189 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # The result of Onigmo.parse_flat. Instead of one object per node, the tree
+  # is stored in preorder across a handful of packed strings:
+  #
+  # * types - one byte per node, an index into TYPES
+  # * parents, first_children, next_siblings - one int32 per node, -1 for none
+  # * payload - the bytes of every node's payload, back to back
+  # * offsets - one int32 per node into payload, plus one for the end
+  #
+  # Walking the tree through a Cursor only allocates when a payload is read
+  # into a String or Array.
+  class FlatTree
+    attr_reader :types, :parents, :first_children, :next_siblings, :payload, :offsets, :encoding
+
+    def initialize(types, parents, first_children, next_siblings, payload, offsets, encoding)
+      @types = types.freeze
+      @parents = parents.freeze
+      @first_children = first_children.freeze
+      @next_siblings = next_siblings.freeze
+      @payload = payload.freeze
+      @offsets = offsets.freeze
+      @encoding = encoding
+    end
+
+    def size
+      types.bytesize
+    end
+
+    def type(index)
+      TYPES[types.getbyte(index)]
+    end
+
+    def parent(index)
+      link(parents, index)
+    end
+
+    def first_child(index)
+      link(first_children, index)
+    end
+
+    def next_sibling(index)
+      link(next_siblings, index)
+    end
+
+    def payload_offset(index)
+      offsets.unpack1("l", offset: index * 4)
+    end
+
+    def payload_bytesize(index)
+      offsets.unpack1("l", offset: (index + 1) * 4) - payload_offset(index)
+    end
+
+    def cursor(index = 0)
+      Cursor.new(self, index)
+    end
+
+    private
+
+    def link(buffer, index)
+      value = buffer.unpack1("l", offset: index * 4)
+      value unless value == -1
+    end
+
+    # A movable position in a FlatTree. The goto_* methods move the cursor in
+    # place and return false, without moving, when there is nowhere to go.
+    class Cursor
+      attr_reader :tree, :index
+
+      def initialize(tree, index = 0)
+        @tree = tree
+        @index = index
+      end
+
+      def type
+        tree.type(index)
+      end
+
+      def goto_parent
+        goto(tree.parent(index))
+      end
+
+      def goto_first_child
+        goto(tree.first_child(index))
+      end
+
+      def goto_next_sibling
+        goto(tree.next_sibling(index))
+      end
+
+      # Yields the index of every node below the cursor in preorder, without
+      # moving the cursor.
+      def each_index
+        return enum_for(__method__) unless block_given?
+
+        current = index
+        loop do
+          yield current
+
+          child = tree.first_child(current)
+          if child
+            current = child
+            next
+          end
+
+          until current == index || (sibling = tree.next_sibling(current))
+            current = tree.parent(current)
+          end
+
+          break if current == index
+          current = sibling
+        end
+      end
+
+      # StringNode#value and the name of a CallNode.
+      def value
+        offset = tree.payload_offset(index)
+        length = tree.payload_bytesize(index)
+
+        if type == CallNode
+          offset += 4
+          length -= 4
+          return nil if length == 0
+        end
+
+        tree.payload.byteslice(offset, length).force_encoding(tree.encoding)
+      end
+
+      # The lower bound of a QuantifierNode.
+      def lower
+        bound = int32(0)
+        bound unless bound == -1
+      end
+
+      # The upper bound of a QuantifierNode, or nil for unbounded.
+      def upper
+        bound = int32(1)
+        bound unless bound == -1
+      end
+
+      def greedy?
+        int32(2) == 1
+      end
+
+      # The group number of an EncloseMemoryNode, EncloseConditionNode or
+      # CallNode.
+      def number
+        int32(0)
+      end
+
+      # The raw option bits of an EncloseOptionsNode.
+      def options
+        int32(0)
+      end
+
+      # The group numbers of a BackrefNode.
+      def values
+        tree.payload.unpack("l#{tree.payload_bytesize(index) / 4}", offset: tree.payload_offset(index))
+      end
+
+      # The single byte characters of a CClassNode or CClassInvertNode.
+      def characters
+        words = tree.payload.unpack("L8", offset: tree.payload_offset(index))
+        256.times.filter_map { |byte| byte.chr.force_encoding(tree.encoding) if words[byte / 32][byte % 32] == 1 }
+      end
+
+      # The multi-byte ranges of a CClassNode or CClassInvertNode.
+      def ranges
+        offset = tree.payload_offset(index) + 32
+        count = (tree.payload_bytesize(index) - 32) / 4
+        CodepointRangeSet.new(tree.payload.unpack("L#{count}", offset: offset))
+      end
+
+      private
+
+      def goto(target)
+        return false unless target
+
+        @index = target
+        true
+      end
+
+      def int32(position)
+        tree.payload.unpack1("l", offset: tree.payload_offset(index) + position * 4)
+      end
+    end
+  end
+end
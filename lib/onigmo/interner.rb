@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # Shares structurally identical subtrees between parses. Passing the same
+  # interner to every call of Onigmo.parse(source, interner:) returns trees
+  # that are deeply frozen, and whose equal subtrees are the same objects, so
+  # a corpus that repeats fragments like [0-9]+ only keeps one copy of each.
+  #
+  # The counters are rough estimates in the same terms as Onigmo.cache_stats:
+  # bytes is what the interner retains, and saved_bytes is what the duplicate
+  # subtrees it replaced would have retained on their own.
+  class Interner
+    attr_reader :nodes, :hits, :bytes, :saved_bytes
+
+    def initialize
+      @table = {}
+      @nodes = 0
+      @hits = 0
+      @bytes = 0
+      @saved_bytes = 0
+    end
+
+    # The number of distinct subtrees held.
+    def size
+      @table.size
+    end
+
+    def stats
+      { nodes: nodes, entries: size, hits: hits, bytes: bytes, saved_bytes: saved_bytes }
+    end
+  end
+end
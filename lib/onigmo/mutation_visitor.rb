@@ -0,0 +1,158 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # A visitor that returns a copy of the tree. By default every method returns
+  # its node as it is unless one of its children was replaced, in which case
+  # the node is copied with the new children. Overriding a method to return a
+  # different node, usually built with copy, therefore only rebuilds the path
+  # from that node up to the root, and every untouched subtree is shared with
+  # the original tree.
+  class MutationVisitor < Visitor
+    def visit_alternation_node(node)
+      visit_nodes(node)
+    end
+
+    def visit_anchor_buffer_begin_node(node)
+      node
+    end
+
+    def visit_anchor_buffer_end_node(node)
+      node
+    end
+
+    def visit_anchor_keep_node(node)
+      node
+    end
+
+    def visit_anchor_line_begin_node(node)
+      node
+    end
+
+    def visit_anchor_line_end_node(node)
+      node
+    end
+
+    def visit_anchor_position_begin_node(node)
+      node
+    end
+
+    def visit_anchor_semi_end_node(node)
+      node
+    end
+
+    def visit_anchor_word_boundary_node(node)
+      node
+    end
+
+    def visit_anchor_word_boundary_invert_node(node)
+      node
+    end
+
+    def visit_any_node(node)
+      node
+    end
+
+    def visit_backref_node(node)
+      node
+    end
+
+    def visit_call_node(node)
+      node
+    end
+
+    def visit_cclass_node(node)
+      node
+    end
+
+    def visit_cclass_invert_node(node)
+      node
+    end
+
+    def visit_enclose_absent_node(node)
+      visit_node(node)
+    end
+
+    def visit_enclose_condition_node(node)
+      visit_node(node)
+    end
+
+    def visit_enclose_memory_node(node)
+      visit_node(node)
+    end
+
+    def visit_enclose_options_node(node)
+      visit_node(node)
+    end
+
+    def visit_enclose_stop_backtrack_node(node)
+      visit_node(node)
+    end
+
+    def visit_list_node(node)
+      visit_nodes(node)
+    end
+
+    def visit_look_ahead_node(node)
+      visit_node(node)
+    end
+
+    def visit_look_ahead_invert_node(node)
+      visit_node(node)
+    end
+
+    def visit_look_behind_node(node)
+      visit_node(node)
+    end
+
+    def visit_look_behind_invert_node(node)
+      visit_node(node)
+    end
+
+    def visit_quantifier_node(node)
+      visit_node(node)
+    end
+
+    def visit_string_node(node)
+      node
+    end
+
+    def visit_word_node(node)
+      node
+    end
+
+    def visit_word_invert_node(node)
+      node
+    end
+
+    private
+
+    def visit_node(node)
+      child_node = node.node
+      return node if child_node.nil?
+
+      visited = visit(child_node)
+      visited.equal?(child_node) ? node : node.copy(node: visited)
+    end
+
+    # The array of children is only duplicated once one of them changes.
+    def visit_nodes(node)
+      child_nodes = node.nodes
+      visited = nil
+
+      index = 0
+      while index < child_nodes.length
+        child_node = child_nodes[index]
+        result = visit(child_node)
+
+        unless result.equal?(child_node)
+          visited ||= child_nodes.dup
+          visited[index] = result
+        end
+
+        index += 1
+      end
+
+      visited ? node.copy(nodes: visited) : node
+    end
+  end
+end
@@ -7,8 +7,27 @@ module Onigmo
       raise NoMethodError, __method__
     end
 
+    # Yields this node and every node below it in depth-first order. This uses
+    # an explicit stack rather than recursion, so it works for trees of any
+    # depth.
+    def each_node
+      return enum_for(__method__) unless block_given?
+
+      stack = [self]
+      while (node = stack.pop)
+        yield node
+        stack.concat(node.child_nodes.reverse)
+      end
+    end
+
+    # Nodes without fields have nothing to match against or replace. Every
+    # other class defines its own through fields.
     def deconstruct_keys(keys)
-      accept(DeconstructVisitor.new)
+      {}
+    end
+
+    def copy
+      self
     end
 
     def pretty_print(q)
@@ -20,20 +39,81 @@ module Onigmo
       accept(JSONVisitor.new)
     end
 
+    # Without generator options the JSON is written natively, falling back to
+    # as_json for anything the native writer cannot produce identically.
     def to_json(*opts)
-      as_json.to_json(*opts)
+      json = native_json if opts.empty?
+      json || as_json.to_json(*opts)
+    end
+
+    # Nodes returned from Onigmo.parse(source, lazy: true) hold on to the
+    # native tree and only build these fields when they are first read.
+    def self.lazy_attr_reader(*names)
+      names.each do |name|
+        class_eval(<<~RUBY, __FILE__, __LINE__ + 1)
+          def #{name}
+            load_children if @tree
+            @#{name}
+          end
+        RUBY
+      end
+    end
+
+    # Lazy nodes build their fields by setting them on themselves, and hash
+    # memoizes its digest the same way, so both happen before the node can no
+    # longer change.
+    def freeze
+      load_children if @tree
+      hash
+      super
+    end
+
+    # Loads the fields of a lazy node first, so that they show up instead of
+    # the native tree they are built from.
+    def inspect
+      load_children if @tree
+      super
+    end
+
+    # Declares the fields of a node class, in the order that initialize takes
+    # them. deconstruct_keys returns only the requested fields, with child
+    # nodes as they are, so they are only deconstructed if the pattern goes on
+    # to match against them. copy returns a new node with some fields
+    # replaced, sharing the rest with this one. Derived fields are computed
+    # from the others, so they can be deconstructed but not replaced.
+    def self.fields(*names, derived: [])
+      exposed = derived + names
+
+      class_eval(<<~RUBY, __FILE__, __LINE__ + 1)
+        def copy(#{names.map { |name| "#{name}: self.#{name}" }.join(", ")})
+          self.class.__send__(:new, #{names.join(", ")})
+        end
+
+        def deconstruct_keys(keys)
+          return { #{exposed.map { |name| "#{name}: #{name}" }.join(", ")} } if keys.nil?
+
+          deconstructed = {}
+          keys.each do |key|
+            case key
+            #{exposed.map { |name| "when :#{name} then deconstructed[:#{name}] = #{name}" }.join("\n")}
+            end
+          end
+          deconstructed
+        end
+      RUBY
     end
 
-    private_class_method :new
+    private_class_method :new, :lazy_attr_reader, :fields
   end
 
   # foo|bar
   # ^^^^^^^
   class AlternationNode < Node
-    attr_reader :nodes
+    lazy_attr_reader :nodes
+    fields :nodes
 
     def initialize(nodes)
-      @nodes = nodes
+      @nodes = nodes.frozen? ? nodes : nodes.dup.freeze
     end
   end
 
@@ -91,6 +171,7 @@ module Onigmo
   # ^^^^^^^^
   class BackrefNode < Node
     attr_reader :values
+    fields :values
 
     def initialize(values)
       @values = values
@@ -101,6 +182,7 @@ module Onigmo
   # ^^^^^^^^
   class CallNode < Node
     attr_reader :number, :name
+    fields :number, :name
 
     def initialize(number, name)
       @number = number
@@ -111,27 +193,42 @@ module Onigmo
   # [a-z]
   # ^^^^^
   class CClassNode < Node
-    attr_reader :values
+    lazy_attr_reader :characters, :ranges
+    fields :characters, :ranges, derived: [:values]
 
-    def initialize(values)
-      @values = values
+    def initialize(characters, ranges)
+      @characters = characters
+      @ranges = ranges
+    end
+
+    def values
+      return [*characters, *ranges.each_codepoint] if frozen?
+      @values ||= [*characters, *ranges.each_codepoint]
     end
   end
 
   # [^a-z]
   # ^^^^^^
   class CClassInvertNode < Node
-    attr_reader :values
+    lazy_attr_reader :characters, :ranges
+    fields :characters, :ranges, derived: [:values]
 
-    def initialize(values)
-      @values = values
+    def initialize(characters, ranges)
+      @characters = characters
+      @ranges = ranges
+    end
+
+    def values
+      return [*characters, *ranges.each_codepoint] if frozen?
+      @values ||= [*characters, *ranges.each_codepoint]
     end
   end
 
   # (?~subexp)
   # ^^^^^^^^^^
   class EncloseAbsentNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -141,7 +238,9 @@ module Onigmo
   # (?(cond)subexp)
   # ^^^^^^^^^^^^^^^
   class EncloseConditionNode < Node
-    attr_reader :number, :node
+    attr_reader :number
+    lazy_attr_reader :node
+    fields :number, :node
 
     def initialize(number, node)
       @number = number
@@ -152,7 +251,9 @@ module Onigmo
   # ()
   # ^^
   class EncloseMemoryNode < Node
-    attr_reader :number, :node
+    attr_reader :number
+    lazy_attr_reader :node
+    fields :number, :node
 
     def initialize(number, node)
       @number = number
@@ -163,7 +264,9 @@ module Onigmo
   # (?options:subexp)
   # ^^^^^^^^^^^^^^^^^
   class EncloseOptionsNode < Node
-    attr_reader :options, :node
+    attr_reader :options
+    lazy_attr_reader :node
+    fields :options, :node
 
     def initialize(options, node)
       @options = options
@@ -174,7 +277,8 @@ module Onigmo
   # (?>subexp)
   # ^^^^^^^^^^
   class EncloseStopBacktrackNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -184,17 +288,19 @@ module Onigmo
   # a.b
   # ^^^
   class ListNode < Node
-    attr_reader :nodes
+    lazy_attr_reader :nodes
+    fields :nodes
 
     def initialize(nodes)
-      @nodes = nodes
+      @nodes = nodes.frozen? ? nodes : nodes.dup.freeze
     end
   end
 
   # (?=subexp)
   # ^^^^^^^^^^
   class LookAheadNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -204,7 +310,8 @@ module Onigmo
   # (?!subexp)
   # ^^^^^^^^^^
   class LookAheadInvertNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -214,7 +321,8 @@ module Onigmo
   # (?<=subexp)
   # ^^^^^^^^^^
   class LookBehindNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -224,7 +332,8 @@ module Onigmo
   # (?<!subexp)
   # ^^^^^^^^^^^
   class LookBehindInvertNode < Node
-    attr_reader :node
+    lazy_attr_reader :node
+    fields :node
 
     def initialize(node)
       @node = node
@@ -234,7 +343,9 @@ module Onigmo
   # a{1,2}
   #  ^^^^^
   class QuantifierNode < Node
-    attr_reader :lower, :upper, :greedy, :node
+    attr_reader :lower, :upper, :greedy
+    lazy_attr_reader :node
+    fields :lower, :upper, :greedy, :node
 
     def initialize(lower, upper, greedy, node)
       @lower = lower
@@ -248,6 +359,7 @@ module Onigmo
   # ^^^
   class StringNode < Node
     attr_reader :value
+    fields :value
 
     def initialize(value)
       @value = value
@@ -97,7 +97,9 @@ module Onigmo
         q.text("cclass(")
         q.nest(2) do
           q.breakable("")
-          q.pp(node.values)
+          q.pp(node.characters)
+          q.comma_breakable
+          q.pp(node.ranges)
         end
         q.breakable("")
         q.text(")")
@@ -109,7 +111,9 @@ module Onigmo
         q.text("cclassInvert(")
         q.nest(2) do
           q.breakable("")
-          q.pp(node.values)
+          q.pp(node.characters)
+          q.comma_breakable
+          q.pp(node.ranges)
         end
         q.breakable("")
         q.text(")")
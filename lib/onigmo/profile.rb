@@ -0,0 +1,42 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # What Onigmo.profile saw while running a pattern's bytecode against a
+  # subject.
+  #
+  # * match - the byte offsets of the match as [start, end], or nil
+  # * instructions - the instructions, as returned by Onigmo.compile
+  # * counts - how many times each instruction ran, by index
+  # * steps - how many instructions ran in total
+  # * starts - how many start positions were tried
+  # * pushes - how many backtrack points were pushed onto the stack
+  # * pops - how many times a failure backtracked to one of them
+  # * max_stack_depth - the most entries the stack held at once
+  # * expected_match - the byte offsets of the match Regexp#match makes, or nil
+  class Profile
+    attr_reader :match, :instructions, :counts, :steps, :starts, :pushes, :pops, :max_stack_depth, :expected_match
+
+    def initialize(match, instructions, counts, steps, starts, pushes, pops, max_stack_depth, expected_match)
+      @match = match
+      @instructions = instructions
+      @counts = counts
+      @steps = steps
+      @starts = starts
+      @pushes = pushes
+      @pops = pops
+      @max_stack_depth = max_stack_depth
+      @expected_match = expected_match
+    end
+
+    # Whether Regexp#match made the same match as the interpreter.
+    def cross_check?
+      match == expected_match
+    end
+
+    # The most executed instructions as [index, instruction, count], busiest
+    # first.
+    def hotspots(limit = 5)
+      counts.each_with_index.max_by(limit) { |count, _| count }.map { |count, index| [index, instructions[index], count] }
+    end
+  end
+end
@@ -0,0 +1,32 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # Something that Onigmo.analyze_redos found could make a pattern backtrack
+  # catastrophically.
+  #
+  # * kind - :nested_quantifier, :ambiguous_alternation, or
+  #   :overlapping_quantifiers
+  # * severity - :high or :medium
+  # * path - the indices into child_nodes that lead from the root of the tree
+  #   returned by Onigmo.parse to the offending node
+  # * type - the class of the offending node
+  # * complexity - :exponential or :polynomial, in the length of the input
+  # * degree - the degree of a polynomial complexity, or nil
+  class RedosFinding
+    attr_reader :kind, :severity, :path, :type, :complexity, :degree
+
+    def initialize(kind, severity, path, type, complexity, degree)
+      @kind = kind
+      @severity = severity
+      @path = path
+      @type = type
+      @complexity = complexity
+      @degree = degree
+    end
+
+    # The offending node in a tree parsed from the same source.
+    def node(root)
+      path.inject(root) { |node, index| node.child_nodes[index] }
+    end
+  end
+end
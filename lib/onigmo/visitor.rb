@@ -291,11 +291,9 @@ module Onigmo
     end
   end
 
+  # visit_child_nodes is defined natively. Children whose visit methods are not
+  # overridden are descended into without calling back into Ruby.
   class Visitor
-    def visit_child_nodes(node)
-      node.child_nodes.each { |child_node| child_node.accept(self) }
-    end
-
     alias visit_alternation_node visit_child_nodes
     alias visit_anchor_buffer_begin_node visit_child_nodes
     alias visit_anchor_buffer_end_node visit_child_nodes
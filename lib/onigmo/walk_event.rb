@@ -0,0 +1,20 @@
+# frozen_string_literal: true
+
+module Onigmo
+  # What Onigmo.walk passes to visitor methods in place of a node. Each kind of
+  # node reuses one event for the whole walk, so an event should not be kept
+  # around after the visitor method returns. Only the fields that belong to
+  # the node's type are set.
+  class WalkEvent
+    # The node class this event stands in for, and how deep it is in the tree.
+    attr_reader :type, :depth
+
+    attr_reader :value, :values, :number, :name, :lower, :upper, :greedy, :options, :characters, :ranges
+
+    # The walk itself descends into every child, so calling super from a
+    # Visitor method has nothing left to do.
+    def child_nodes
+      []
+    end
+  end
+end
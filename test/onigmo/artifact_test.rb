@@ -0,0 +1,81 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+require "stringio"
+require "tempfile"
+
+module Onigmo
+  class ArtifactTest < Test::Unit::TestCase
+    def test_flat_tree
+      tree = Onigmo.parse_flat("a(b|[x-zあ])+\\k<1>")
+      loaded = round_trip(tree)
+
+      assert_kind_of(FlatTree, loaded)
+      assert_equal(tree.encoding, loaded.encoding)
+      assert_equal(
+        [tree.types, tree.parents, tree.first_children, tree.next_siblings, tree.payload, tree.offsets],
+        [loaded.types, loaded.parents, loaded.first_children, loaded.next_siblings, loaded.payload, loaded.offsets]
+      )
+    end
+
+    def test_program
+      program = Onigmo.compile("a(b|c)+\\d{2,}", lazy: true)
+      loaded = round_trip(program)
+
+      assert_kind_of(Program, loaded)
+      assert_equal(program.to_a, loaded.to_a)
+    end
+
+    def test_io
+      program = Onigmo.compile("abc", lazy: true)
+      assert_equal(program.to_a, Onigmo.load(StringIO.new(Onigmo.dump(program))).to_a)
+    end
+
+    def test_invalid
+      assert_raise(TypeError) { Onigmo.dump(Onigmo.parse("a")) }
+      assert_raise(ArgumentError) { Onigmo.load(StringIO.new("not an artifact at all, really")) }
+
+      artifact = Onigmo.dump(Onigmo.parse_flat("a"))
+      artifact[Artifact::MAGIC.bytesize, 4] = [Artifact::VERSION + 1].pack("L")
+      assert_raise(ArgumentError) { Onigmo.load(StringIO.new(artifact)) }
+    end
+
+    def test_malformed_program
+      program = Onigmo.compile("abcdefgh[x-z\u3042](?<a>b)(?<a>c)\\k<a>", lazy: true)
+      bytecode = program.bytecode
+
+      artifact = Onigmo.dump(program)
+      artifact[Artifact::HEADER_SIZE + 12, 4] = [3].pack("L")
+      assert_raise(ArgumentError) { Onigmo.load(StringIO.new(artifact)) }
+
+      exactn = bytecode.getbyte(0)
+      assert_raise(ArgumentError) { Program.from_bytecode([exactn, 0x7fffffff].pack("Cl"), program.encoding) }
+      assert_raise(ArgumentError) { Program.from_bytecode([exactn, -1].pack("Cl"), program.encoding) }
+      assert_raise(ArgumentError) { Program.from_bytecode("\xff".b, program.encoding) }
+
+      # Every truncation and single-byte corruption either loads or is
+      # rejected, without ever reading past the end.
+      bytecode.bytesize.times do |index|
+        [bytecode.byteslice(0, index), bytecode.dup.tap { |garbled| garbled.setbyte(index, 0xff ^ garbled.getbyte(index)) }].each do |candidate|
+          loaded = Program.from_bytecode(candidate, program.encoding)
+          assert_equal(loaded.size, loaded.to_a.length)
+        rescue ArgumentError
+        end
+      end
+    end
+
+    private
+
+    def round_trip(object)
+      Tempfile.create(["onigmo", ".bin"]) do |file|
+        file.binmode
+        file.write(Onigmo.dump(object))
+        file.close
+
+        loaded = Onigmo.load(file.path)
+        GC.start
+        loaded
+      end
+    end
+  end
+end
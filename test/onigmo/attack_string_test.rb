@@ -0,0 +1,59 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class AttackStringTest < Test::Unit::TestCase
+    def test_nested_quantifier
+      attack = Onigmo.attack_strings("(a+)+$", length: 40).first
+
+      assert_equal(:nested_quantifier, attack.finding.kind)
+      assert_equal(["", "a", "!"], [attack.prefix, attack.pump, attack.suffix])
+      assert_equal("#{"a" * 39}!", attack.to_s)
+    end
+
+    def test_prefix
+      attack = Onigmo.attack_strings("x(a+)+y", length: 20).first
+
+      assert_equal("x", attack.prefix)
+      assert_equal("a", attack.pump)
+      assert_operator(attack.to_s.length, :<=, 20)
+      assert_match(/\Axa+[^y]?\z/, attack.to_s)
+    end
+
+    def test_ambiguous_alternation
+      attack = Onigmo.attack_strings("(a|a)*$", length: 10).first
+
+      assert_equal(:ambiguous_alternation, attack.finding.kind)
+      assert_equal("a", attack.pump)
+      assert_equal("aa!", attack.pumped(2))
+    end
+
+    def test_overlapping_quantifiers
+      attack = Onigmo.attack_strings("\\d+\\d+x", length: 10).first
+
+      assert_equal(:overlapping_quantifiers, attack.finding.kind)
+      assert_equal("0", attack.pump)
+    end
+
+    def test_linear_per_start
+      # Only quadratic because every start position gets retried, which is not
+      # what the finding is about.
+      assert_equal([:ambiguous_alternation], Onigmo.analyze_redos("(ab|ac)*$").map(&:kind))
+      assert_empty(Onigmo.attack_strings("(ab|ac)*$", length: 40))
+    end
+
+    def test_no_attacks
+      assert_empty(Onigmo.attack_strings("abc", length: 40))
+      assert_empty(Onigmo.attack_strings("(a+)+", length: 40))
+    end
+
+    def test_timings
+      attack = Onigmo.attack_strings("(a+)+$", length: 40).first
+      timings = attack.timings([1, 2])
+
+      assert_equal([1, 2], timings.map(&:first))
+      timings.each { |_, seconds| assert_kind_of(Float, seconds) }
+    end
+  end
+end
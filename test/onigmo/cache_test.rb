@@ -0,0 +1,57 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class CacheTest < Test::Unit::TestCase
+    def setup
+      Onigmo.clear_cache
+      Onigmo.cache_limit = 1024 * 1024
+    end
+
+    def teardown
+      Onigmo.cache_limit = 0
+      Onigmo.clear_cache
+    end
+
+    def test_parse
+      node = Onigmo.parse("a|b")
+
+      assert_predicate(node, :frozen?)
+      assert_same(node, Onigmo.parse("a|b"))
+      assert_not_same(node, Onigmo.parse("a|b", lazy: true))
+      assert_equal({ hits: 1, misses: 1 }, Onigmo.cache_stats.slice(:hits, :misses))
+    end
+
+    def test_compile
+      insns = Onigmo.compile("a|b")
+
+      assert_predicate(insns, :frozen?)
+      assert_same(insns, Onigmo.compile("a|b"))
+      assert_not_same(Onigmo.parse("a|b"), insns)
+    end
+
+    def test_encoding
+      assert_not_same(Onigmo.parse("abc"), Onigmo.parse("abc".encode("US-ASCII")))
+    end
+
+    def test_eviction
+      first = Onigmo.parse("first")
+      Onigmo.cache_limit = Onigmo.cache_stats[:bytes]
+
+      Onigmo.parse("other")
+      stats = Onigmo.cache_stats
+
+      assert_operator(stats[:bytes], :<=, stats[:limit])
+      assert_equal(1, stats[:evictions])
+      assert_not_same(first, Onigmo.parse("first"))
+    end
+
+    def test_disabled
+      Onigmo.cache_limit = 0
+
+      refute_predicate(Onigmo.parse("a|b"), :frozen?)
+      assert_equal(0, Onigmo.cache_stats[:entries])
+    end
+  end
+end
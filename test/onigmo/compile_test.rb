@@ -11,5 +11,65 @@ module Onigmo
     def test_failure
       assert_raise(ArgumentError) { Onigmo.compile("(?<>)") }
     end
+
+    def test_exactn
+      assert_equal([[:exactn, 8, "abcdefgh"], [:end]], Onigmo.compile("abcdefgh"))
+    end
+
+    def test_nul
+      assert_equal([[:exact3, "a\0b"], [:end]], Onigmo.compile("a\0b"))
+    end
+
+    def test_regexp
+      assert_equal(Onigmo.compile("(a|b)*\\d"), Onigmo.compile(/(a|b)*\d/))
+      assert_equal([[:exact1_ic, "a"], [:end]], Onigmo.compile(/a/i))
+      assert_equal(Onigmo.compile(/a b/x).to_a, Onigmo.compile(/a b/x, lazy: true).to_a)
+    end
+
+    def test_program_outlives_regexp_recompile
+      regexp = Regexp.new("abcdef")
+      insns = Onigmo.compile(regexp)
+      program = Onigmo.compile(regexp, lazy: true)
+
+      # Matching against another encoding replaces the regex_t of the Regexp.
+      regexp =~ "\u3042abcdef".encode("UTF-8")
+      100.times { "x" * 1024 }
+      GC.start
+
+      assert_equal(insns, program.to_a)
+    end
+
+    def test_compile_to_json
+      ["(a|b)*\\1(?i:abcdefgh)", "[\u3042-\u3044]\"", /x+/m].each do |source|
+        assert_equal(Onigmo.compile(source).to_json, Onigmo.compile_to_json(source))
+      end
+    end
+
+    def test_program
+      source = "(a|b)*\\1(?i:abcdefgh)(?<!c)\\g<1>"
+      insns = Onigmo.compile(source)
+      program = Onigmo.compile(source, lazy: true)
+
+      assert_kind_of(Program, program)
+      assert_equal(insns.length, program.size)
+      assert_operator(program.bytesize, :>, program.size)
+      assert_equal(insns, program.each.to_a)
+      assert_equal(insns.last, program[-1])
+      assert_equal(insns[1][0], program.opcode_at(1))
+      assert_nil(program[program.size])
+    end
+
+    def test_optimization_info
+      info = Onigmo.optimization_info("\\Ahello")
+      assert_equal(:exact_bm, info[:optimize])
+      assert_equal("hello", info[:exact])
+      assert_equal([:begin_buf], info[:anchor])
+      assert_true(info.frozen?)
+
+      assert_equal(["a", "b"], Onigmo.optimization_info("a|b")[:map])
+      assert_equal([:end_buf], Onigmo.optimization_info(/abc\z/)[:anchor])
+      assert_equal(:exact_bm_ic, Onigmo.optimization_info(/bar/i)[:optimize])
+      assert_equal(:none, Onigmo.optimization_info("\\d+")[:optimize])
+    end
   end
 end
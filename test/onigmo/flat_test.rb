@@ -0,0 +1,53 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class FlatTest < Test::Unit::TestCase
+    def test_types
+      source = "a(b|[x-z])+\\k<1>(?i:c){2,3}^$.\\w(?=d)"
+      tree = Onigmo.parse_flat(source)
+
+      assert_equal(preorder(Onigmo.parse(source)), tree.cursor.each_index.map { |index| tree.type(index) })
+      assert_equal(tree.size, tree.cursor.each_index.count)
+    end
+
+    def test_cursor
+      cursor = Onigmo.parse_flat("ab|c{2,}").cursor
+      assert_equal(AlternationNode, cursor.type)
+
+      assert_true(cursor.goto_first_child)
+      assert_equal([StringNode, "ab"], [cursor.type, cursor.value])
+
+      assert_true(cursor.goto_next_sibling)
+      assert_equal([QuantifierNode, 2, nil, true], [cursor.type, cursor.lower, cursor.upper, cursor.greedy?])
+      assert_false(cursor.goto_next_sibling)
+
+      assert_true(cursor.goto_first_child)
+      assert_equal("c", cursor.value)
+      assert_false(cursor.goto_first_child)
+
+      assert_true(cursor.goto_parent)
+      assert_true(cursor.goto_parent)
+      assert_false(cursor.goto_parent)
+      assert_equal(0, cursor.index)
+    end
+
+    def test_payloads
+      tree = Onigmo.parse_flat("(a)[b-dあ-う]\\1")
+      cclass = tree.cursor(3)
+
+      assert_equal(1, tree.cursor(1).number)
+      assert_equal(%w[b c d], cclass.characters)
+      assert_equal([0x3042..0x3046], cclass.ranges.to_a)
+      assert_equal([1], tree.cursor(4).values)
+    end
+
+    private
+
+    def preorder(node)
+      children = node.respond_to?(:nodes) ? node.nodes : [node.respond_to?(:node) ? node.node : nil].compact
+      [node.class, *children.flat_map { |child| preorder(child) }]
+    end
+  end
+end
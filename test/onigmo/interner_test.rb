@@ -0,0 +1,30 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class InternerTest < Test::Unit::TestCase
+    def test_parse
+      interner = Interner.new
+      first = Onigmo.parse("foo[0-9]+\\s*", interner: interner)
+      second = Onigmo.parse("bar[0-9]+\\s*", interner: interner)
+
+      assert_true(Ractor.shareable?(first))
+      assert_same(first.nodes[1], second.nodes[1])
+      assert_same(first, Onigmo.parse("foo[0-9]+\\s*", interner: interner))
+      assert_equal(Onigmo.parse("foo[0-9]+\\s*"), first)
+    end
+
+    def test_stats
+      interner = Interner.new
+      2.times { Onigmo.parse("a+b+", interner: interner) }
+
+      assert_equal({ nodes: 10, entries: 5, hits: 5 }, interner.stats.slice(:nodes, :entries, :hits))
+      assert_operator(interner.stats[:saved_bytes], :>, 0)
+    end
+
+    def test_lazy
+      assert_raise(ArgumentError) { Onigmo.parse("a", lazy: true, interner: Interner.new) }
+    end
+  end
+end
@@ -64,6 +64,27 @@ module Onigmo
       assert_parses(CClassInvertNode, "[^a-z]")
     end
 
+    def test_cclass_node_ranges
+      node = Onigmo.parse("[a-c\u{3b1}-\u{3b3}\u{4e00}]")
+
+      assert_equal(%w[a b c], node.characters)
+      assert_equal([0x3b1..0x3b3, 0x4e00..0x4e00], node.ranges.to_a)
+      assert_equal(4, node.ranges.size)
+      assert_equal([*%w[a b c], 0x3b1, 0x3b2, 0x3b3, 0x4e00], node.values)
+
+      assert_include(node.ranges, 0x3b2)
+      assert_include(node.ranges, "\u{4e00}")
+      assert_not_include(node.ranges, 0x3b4)
+
+      case node
+      in CClassNode[values: ["a", "b", "c", 0x3b1, *rest]]
+        assert_equal([0x3b2, 0x3b3, 0x4e00], rest)
+      end
+
+      assert_equal(node.values, node.as_json[:values])
+      assert_equal(node.values, JSON.parse(node.to_json)["values"])
+    end
+
     def test_enclose_absent
       assert_parses(EncloseAbsentNode, "(?~a)")
     end
@@ -124,10 +145,220 @@ module Onigmo
       assert_raise(ArgumentError) { Onigmo.parse("(?<>)") }
     end
 
+    def test_parse_all
+      results = Onigmo.parse_all(["a|b", "(?<>)", "abc"] * 4, threads: 3)
+
+      assert_equal(12, results.length)
+      results.each_slice(3) do |alternation, failure, string|
+        assert_kind_of(AlternationNode, alternation)
+        assert_kind_of(ArgumentError, failure)
+        assert_kind_of(StringNode, string)
+      end
+    end
+
+    def test_parse_error_info
+      parsers = [
+        ->(source) { Onigmo.parse(source) },
+        ->(source) { Onigmo.parse(source, lazy: true) },
+        ->(source) { Onigmo.parse_flat(source) },
+        ->(source) { Onigmo.walk(source, Visitor.new) },
+        ->(source) { Onigmo.parse_to_json(source) }
+      ]
+
+      parsers.each do |parser|
+        error = assert_raise(ArgumentError) { parser.call("\\k<b>") }
+        assert_equal("undefined name <b> reference", error.message)
+      end
+    end
+
+    def test_parse_all_error_info
+      results = Onigmo.parse_all(["a", "\\k<b>", "\\p{Foo}"])
+
+      assert_kind_of(StringNode, results[0])
+      assert_equal("undefined name <b> reference", results[1].message)
+      assert_equal("invalid character property name {Foo}", results[2].message)
+    end
+
+    def test_parse_all_threads
+      assert_raise(ArgumentError) { Onigmo.parse_all(["a"], threads: 0) }
+    end
+
+    def test_parse_all_signal
+      omit("no SIGUSR1") unless Signal.list.key?("USR1")
+
+      trapped = 0
+      previous = trap("USR1") { trapped += 1 }
+      finished = false
+
+      sender = Thread.new do
+        until finished
+          Process.kill("USR1", Process.pid)
+          sleep(0.001)
+        end
+      end
+
+      results = Onigmo.parse_all(["a|b"] * 200_000, threads: 1)
+      finished = true
+      sender.join
+
+      assert_equal(200_000, results.length)
+      assert(results.all?(AlternationNode))
+    ensure
+      trap("USR1", previous) if previous
+    end
+
+    def test_parse_all_invalid_pattern
+      assert_raise(TypeError) { Onigmo.parse_all(["a", "b" * 64, 1]) }
+      assert_kind_of(StringNode, Onigmo.parse_all(["a"]).first)
+    end
+
+    def test_parse_nul
+      assert_equal("a\0b", Onigmo.parse("a\0b").value)
+    end
+
+    def test_parse_utf16
+      node = Onigmo.parse("ab|c".encode("UTF-16LE"))
+
+      assert_kind_of(AlternationNode, node)
+      assert_equal("ab".encode("UTF-16LE"), node.nodes.first.value)
+    end
+
+    def test_parse_regexp
+      assert_equal(Onigmo.parse("ab").as_json, Onigmo.parse(/a b/x).as_json)
+      assert_kind_of(AlternationNode, Onigmo.parse(/a|b/))
+    end
+
+    def test_parse_lazy
+      node = Onigmo.parse("(a|b)*[x-z]", lazy: true)
+
+      assert_kind_of(ListNode, node)
+      assert_equal(Onigmo.parse("(a|b)*[x-z]").as_json, node.as_json)
+    end
+
+    def test_parse_lazy_frozen
+      node = Onigmo.parse("a(b|[c-e])+", lazy: true).freeze
+      cclass = node.nodes.last.node.node.nodes.last
+
+      assert_equal(2, node.nodes.length)
+      assert_equal(%w[c d e], cclass.freeze.values)
+      assert_equal(Onigmo.parse("a(b|[c-e])+").as_json, node.as_json)
+    end
+
+    def test_parse_lazy_inspect
+      node = Onigmo.parse("a|b", lazy: true)
+
+      assert_match(/@nodes=\[#<Onigmo::StringNode:0x\h+ @value="a">/, node.inspect)
+      assert_equal([:@nodes], node.instance_variables)
+    end
+
+    def test_leaf_singletons
+      first, second = Onigmo.parse("\\A.\\w\\A.\\w").nodes.each_slice(3).to_a
+
+      first.zip(second).each do |left, right|
+        assert_same(left, right)
+        assert_predicate(left, :frozen?)
+      end
+
+      assert_not_same(*Onigmo.parse("aa|aa").nodes)
+    end
+
+    def test_constant_pools
+      first = Onigmo.parse("(?m:[[:print:]])")
+      second = Onigmo.parse("(?m:[[:print:]])")
+
+      assert_same(first.options, second.options)
+      assert_same(first.node.characters.first, second.node.characters.first)
+      assert_predicate(first.node.characters.first, :frozen?)
+    end
+
     def test_abstract
       assert_raise(NoMethodError) { Node.send(:new).accept(nil) }
     end
 
+    def test_parse_deep
+      depth = 20_000
+      node = Onigmo.parse("a#{"{1,2}" * depth}")
+
+      assert_equal(depth + 1, node.each_node.count)
+      assert_kind_of(StringNode, node.each_node.to_a.last)
+    end
+
+    def test_each_node
+      assert_equal([ListNode, EncloseMemoryNode, AlternationNode, StringNode, StringNode, StringNode], Onigmo.parse("(a|b)c").each_node.map(&:class))
+    end
+
+    def test_structural_equality
+      node = Onigmo.parse("(?m:a)[b-d\u3042]+\\1{2,3}")
+      same = Onigmo.parse("(?m:\\x61)[\u3042b-d]+\\1{2,3}", lazy: true)
+
+      assert_equal(node, same)
+      assert_equal(node.hash, same.hash)
+      assert_equal(1, [node, same].uniq.size)
+      assert_not_equal(node, Onigmo.parse("(?m:a)[b-d\u3042]+\\1{2,4}"))
+      assert_not_equal(node, Onigmo.parse("(?i:a)[b-d\u3042]+\\1{2,3}"))
+      assert_equal(3, node.nodes.last.upper)
+
+      deep = "a#{"{1,2}" * 100_000}"
+      assert_equal({ Onigmo.parse(deep) => 1 }, { Onigmo.parse(deep) => 1 })
+    end
+
+    def test_equality_frozen
+      node = Onigmo.parse("ab|cd").freeze
+      assert_equal(Onigmo.parse("ab|cd").hash, node.hash)
+      assert_equal(node.hash, Ractor.make_shareable(Onigmo.parse("ab|cd", lazy: true)).hash)
+
+      # Arrays of children are frozen, so memoized digests cannot go stale.
+      assert_true(Onigmo.parse("ab|cd").nodes.frozen?)
+      assert_true(Onigmo.parse("ab|cd", lazy: true).nodes.frozen?)
+      assert_true(Onigmo.parse("a(bc|d)").nodes.last.node.nodes.frozen?)
+      assert_raise(FrozenError) { Onigmo.parse("a|b").nodes[1] = Onigmo.parse("c") }
+
+      nodes = [Onigmo.parse("a"), Onigmo.parse("b")]
+      node = AlternationNode.__send__(:new, nodes)
+      nodes << Onigmo.parse("c")
+      assert_equal(Onigmo.parse("a|b"), node)
+      assert_equal(Onigmo.parse("a|b").hash, node.hash)
+    end
+
+    def test_deconstruct_keys
+      node = Onigmo.parse("a|b{2}")
+
+      case node
+      in { nodes: [StringNode[value: "a"], QuantifierNode[lower: 2, node: { value: }]] }
+        assert_equal("b", value)
+      end
+
+      assert_equal({ lower: 2 }, node.nodes[1].deconstruct_keys([:lower, :unknown]))
+      assert_same(node.nodes[1], node.deconstruct_keys([:nodes])[:nodes][1])
+      assert_equal({}, Onigmo.parse("\\A").deconstruct_keys(nil))
+    end
+
+    def test_parse_to_json
+      ["a(?i:b)[c-e\u3042]\\1{2}\\g<1>", "\"\\\\\n\u0001", /x+/m, "a".encode("UTF-16LE")].each do |source|
+        assert_equal(Onigmo.parse(source).as_json.to_json, Onigmo.parse_to_json(source))
+      end
+    end
+
+    def test_json_quantifier_bounds
+      assert_equal([2, 3], JSON.parse(Onigmo.parse_to_json("a{2,3}")).values_at("lower", "upper"))
+      assert_equal([1, nil], JSON.parse(Onigmo.parse("a+").to_json).values_at("lower", "upper"))
+    end
+
+    def test_json_nesting
+      shallow = "#{"(" * 20}a#{")" * 20}"
+      assert_equal(Onigmo.parse(shallow).as_json.to_json, Onigmo.parse_to_json(shallow))
+
+      # The json gem stops at a nesting of 100, and so do the native writers,
+      # even for trees far too deep for as_json.
+      deep = "a#{"{1,2}" * 150}"
+      assert_raise(JSON::NestingError) { Onigmo.parse(deep).as_json.to_json }
+
+      [deep, "a#{"{1,2}" * 100_000}"].each do |source|
+        assert_raise(JSON::NestingError) { Onigmo.parse_to_json(source) }
+        assert_raise(JSON::NestingError) { Onigmo.parse(source).to_json }
+      end
+    end
+
     private
 
     def assert_parses(kind, source)
@@ -135,9 +366,13 @@ module Onigmo
       node = yield node if block_given?
       assert_kind_of(kind, node)
 
-      assert_kind_of(String, node.to_json)
+      assert_equal(node.as_json.to_json, node.to_json)
       assert_kind_of(String, PP.pp(node, +""))
       assert_kind_of(Hash, node.deconstruct_keys(nil))
+
+      lazy = Onigmo.parse(source, lazy: true)
+      lazy = yield lazy if block_given?
+      assert_equal(node.as_json, lazy.as_json)
     end
   end
 end
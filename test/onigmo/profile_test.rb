@@ -0,0 +1,77 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class ProfileTest < Test::Unit::TestCase
+    def test_match
+      profile = Onigmo.profile("a+b", "xaab")
+
+      assert_equal([1, 4], profile.match)
+      assert_equal(Onigmo.compile("a+b"), profile.instructions)
+      assert_equal(profile.instructions.length, profile.counts.length)
+      assert_equal(profile.steps, profile.counts.sum)
+      assert_equal(2, profile.starts)
+    end
+
+    def test_no_match
+      profile = Onigmo.profile("ab", "aaa")
+
+      assert_nil(profile.match)
+      assert_equal(4, profile.starts)
+      assert_equal(1, Onigmo.profile("\\Aab", "aaa").starts)
+    end
+
+    def test_backtracking
+      short = Onigmo.profile("(a+)+$", "#{"a" * 8}!")
+      long = Onigmo.profile("(a+)+$", "#{"a" * 10}!")
+
+      assert_nil(short.match)
+      assert_equal(short.pushes, short.pops)
+      assert_operator(long.steps, :>, short.steps * 3)
+      assert_equal(:push, short.hotspots(1).first[1].first)
+    end
+
+    def test_regexp
+      assert_equal([1, 4], Onigmo.profile(/b\w+?\b/i, "aBcd e").match)
+      assert_equal([1, 2], Onigmo.profile(/(?<=c)b|a\Kc/, "acb").match)
+    end
+
+    def test_regexp_recompiled_while_running
+      regexp = /(a+)+$/
+      subjects = ["\u3042".encode("EUC-JP"), "\u3042", "\xff".b]
+      matchers = 4.times.map { Thread.new { 200_000.times { |index| regexp =~ subjects[index % 3] } } }
+
+      10.times { assert_nil(Onigmo.profile(regexp, "#{"a" * 18}!").match) }
+    ensure
+      matchers&.each(&:join)
+    end
+
+    def test_cross_check
+      patterns = ["(a|ab)(c|bcd)(d*)", "(?:(a)|b)*\\1", "(?=(\\w+))\\1:", "(?!ab)a\\w", "(?<!a)b+", "(?>a+)b", "(?i)straße", "^\\s*$", "[^あ-ん]+", "a{2,3}?c"]
+      subjects = ["", "abcd", "bab", "aab:", "cb", "aaab", "STRASSE", "x\n  \ny", "aあbc", "aaac"]
+
+      patterns.product(subjects) { |pattern, subject| assert_true(Onigmo.profile(pattern, subject).cross_check?, [pattern, subject].inspect) }
+    end
+
+    def test_cross_check_mismatch
+      profile = Onigmo.profile("(?>(?:(?<=b))*)(?!\\w\\w)a", "aaaa")
+
+      assert_equal([3, 4], profile.match)
+      assert_nil(profile.expected_match)
+      assert_false(profile.cross_check?)
+    end
+
+    def test_expected_match
+      profile = Onigmo.profile("b+", "あbb")
+
+      assert_equal([3, 5], profile.match)
+      assert_equal([3, 5], profile.expected_match)
+    end
+
+    def test_unsupported
+      assert_raise(NotImplementedError) { Onigmo.profile("(?<a>x\\g<a>?)", "xx") }
+      assert_raise(Encoding::CompatibilityError) { Onigmo.profile("a", "\xFFa".b) }
+    end
+  end
+end
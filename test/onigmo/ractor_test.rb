@@ -0,0 +1,30 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class RactorTest < Test::Unit::TestCase
+    def test_parse_and_compile
+      ractors =
+        4.times.map do |index|
+          Ractor.new(index) do |index|
+            [Onigmo.parse("a(b|c)#{index}").as_json, Onigmo.compile("a#{index}").length]
+          end
+        end
+
+      ractors.each_with_index do |ractor, index|
+        assert_equal([Onigmo.parse("a(b|c)#{index}").as_json, Onigmo.compile("a#{index}").length], ractor.take)
+      end
+    end
+
+    def test_shareable
+      node = Ractor.make_shareable(Onigmo.parse("[a-z]+(?<name>foo)"))
+      assert_equal(node.as_json, Ractor.new(node) { |node| node.as_json }.take)
+    end
+
+    def test_cache
+      error = Ractor.new { Onigmo.cache_stats rescue $!.class }.take
+      assert_equal(RuntimeError, error)
+    end
+  end
+end
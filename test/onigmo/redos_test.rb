@@ -0,0 +1,83 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class RedosTest < Test::Unit::TestCase
+    def test_nested_quantifier
+      finding = assert_finding("(a+)+", :nested_quantifier, :high, :exponential, nil)
+      assert_equal(QuantifierNode, finding.type)
+      assert_equal(Onigmo.parse("a+"), finding.node(Onigmo.parse("(a+)+")))
+
+      findings = Onigmo.analyze_redos("(x+x+)+y").select { |finding| finding.kind == :nested_quantifier }
+      assert_equal([[:high, :exponential]] * 2, findings.map { |finding| [finding.severity, finding.complexity] })
+
+      # A single overlapping character beside the inner quantifier is enough.
+      assert_finding("(a+a)+$", :nested_quantifier, :high, :exponential, nil)
+      assert_finding("(\\w+\\w)+$", :nested_quantifier, :high, :exponential, nil)
+      assert_finding("([a-z]+[a-z])+$", :nested_quantifier, :high, :exponential, nil)
+      assert_finding("^(([a-z])+.)+[A-Z]([a-z])+$", :nested_quantifier, :high, :exponential, nil)
+      assert_not_empty(Onigmo.attack_strings("^(([a-z])+.)+[A-Z]([a-z])+$", length: 20))
+    end
+
+    def test_nested_quantifier_bounded
+      finding = assert_finding("(.*a){10}", :nested_quantifier, :high, :polynomial, 10)
+      assert_equal([0, 0, 0], finding.path)
+
+      assert_finding("(a+){2}", :nested_quantifier, :medium, :polynomial, 2)
+      assert_finding("(.*a){100}", :nested_quantifier, :high, :polynomial, 16)
+    end
+
+    def test_ambiguous_alternation
+      finding = assert_finding("(a|a)*", :ambiguous_alternation, :high, :exponential, nil)
+      assert_equal([0, 0], finding.path)
+      assert_equal(AlternationNode, finding.type)
+
+      assert_finding("(ab|ac)*", :ambiguous_alternation, :medium, :polynomial, 2)
+      assert_finding("(a|ab)*c", :ambiguous_alternation, :medium, :polynomial, 2)
+
+      # Repeating one branch can match another, which splits the input in
+      # exponentially many ways.
+      assert_finding("^(a|aa)+$", :ambiguous_alternation, :high, :exponential, nil)
+      assert_finding("(aa|a)*$", :ambiguous_alternation, :high, :exponential, nil)
+      assert_finding("(ab|a[bc]ab)*", :ambiguous_alternation, :high, :exponential, nil)
+    end
+
+    def test_overlapping_quantifiers
+      assert_finding("\\d+\\d+", :overlapping_quantifiers, :medium, :polynomial, 2)
+      assert_finding("\\d+\\w+\\d+x", :overlapping_quantifiers, :high, :polynomial, 3)
+    end
+
+    def test_safe
+      assert_empty(Onigmo.analyze_redos("abc"))
+      assert_empty(Onigmo.analyze_redos("(a|b)*"))
+      assert_empty(Onigmo.analyze_redos(/\d+-\d+/))
+
+      # Nested, but every iteration can only match one way.
+      assert_empty(Onigmo.analyze_redos("(a*b)*"))
+      assert_empty(Onigmo.analyze_redos("(a+b)+"))
+      assert_empty(Onigmo.analyze_redos("(?>a+)+"))
+      assert_empty(Onigmo.analyze_redos("(a*b){10}"))
+      assert_empty(Onigmo.analyze_redos("(?>.*a){10}"))
+      assert_empty(Onigmo.analyze_redos("(.*a){1}"))
+    end
+
+    def test_invalid
+      error = assert_raise(ArgumentError) { Onigmo.analyze_redos("\\k<b>") }
+      assert_equal("undefined name <b> reference", error.message)
+      assert_raise(ArgumentError) { Onigmo.attack_strings("\\p{Foo}", length: 10) }
+    end
+
+    private
+
+    def assert_finding(source, kind, severity, complexity, degree)
+      findings = Onigmo.analyze_redos(source)
+      assert_equal(1, findings.size, source)
+
+      finding = findings.first
+      assert_equal([kind, severity, complexity, degree], [finding.kind, finding.severity, finding.complexity, finding.degree], source)
+      assert_true(finding.frozen?)
+      finding
+    end
+  end
+end
@@ -0,0 +1,50 @@
+# frozen_string_literal: true
+
+require_relative "test_helper"
+
+module Onigmo
+  class SafeRegexTest < Test::Unit::TestCase
+    def test_match
+      regex = SafeRegex.new("b\\w+", max_steps: 1_000, max_stack: 100)
+
+      assert_equal([1, 4], regex.match("abcd"))
+      assert_nil(regex.match("xyz"))
+      assert_equal([1, 2], SafeRegex.new(/B/i, max_steps: 100, max_stack: 10).match("abc"))
+    end
+
+    def test_max_steps
+      steps = Onigmo.profile("(a+)+$", "#{"a" * 10}!").steps
+      subject = "#{"a" * 10}!"
+
+      assert_nil(SafeRegex.new("(a+)+$", max_steps: steps, max_stack: 1_000).match(subject))
+      assert_equal(:budget_exceeded, SafeRegex.new("(a+)+$", max_steps: steps - 1, max_stack: 1_000).match(subject))
+
+      error = assert_raise(SafeRegex::BudgetExceeded) do
+        SafeRegex.new("(a+)+$", max_steps: 100, max_stack: 1_000).match(subject, exception: true)
+      end
+      assert_equal("step budget of 100 exceeded", error.message)
+    end
+
+    def test_max_stack
+      regex = SafeRegex.new("(?:a|b)*c", max_steps: 1_000_000, max_stack: 100)
+
+      assert_equal([0, 21], regex.match("#{"ab" * 10}c"))
+      assert_equal(:budget_exceeded, regex.match("ab" * 100))
+      assert_raise(SafeRegex::BudgetExceeded) { regex.match("ab" * 100, exception: true) }
+    end
+
+    def test_broken_subject
+      regex = SafeRegex.new("[^a]", max_steps: 100, max_stack: 10)
+
+      error = assert_raise(ArgumentError) { regex.match("\xE3") }
+      assert_equal("invalid byte sequence in UTF-8", error.message)
+    end
+
+    def test_invalid
+      assert_raise(ArgumentError) { SafeRegex.new("a") }
+      assert_raise(ArgumentError) { SafeRegex.new("a", max_steps: 0, max_stack: 1) }
+      assert_raise(SafeRegex::UnsupportedPattern) { SafeRegex.new("(?<a>x\\g<a>?)", max_steps: 1, max_stack: 1) }
+      assert_equal(:rescued, (SafeRegex.new("(?~ab)", max_steps: 1, max_stack: 1) rescue :rescued))
+    end
+  end
+end
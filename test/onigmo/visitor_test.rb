@@ -17,17 +17,135 @@ module Onigmo
       end
     end
 
-    def test_visit
-      source =
-        "\\A\\z\\K^$\\G\\Z\\b\\B.\\1\\g<1>\\w\\W" \
-        "[[:print:]][^[:print:]]" \
-        "(a|b|c)(?~)(?(1))(?i)(?>)" \
-        "(?=)(?!)(?<=)(?<!)*"
+    SOURCE =
+      "\\A\\z\\K^$\\G\\Z\\b\\B.\\1\\g<1>\\w\\W" \
+      "[[:print:]][^[:print:]]" \
+      "(a|b|c)(?~)(?(1))(?i)(?>)" \
+      "(?=)(?!)(?<=)(?<!)*"
 
+    def test_visit
       strings = []
-      Onigmo.parse(source).accept(StringVisitor.new(strings))
+      Onigmo.parse(SOURCE).accept(StringVisitor.new(strings))
 
       assert_equal(3, strings.reject(&:empty?).length)
     end
+
+    def test_visit_deep
+      strings = []
+      Onigmo.parse("a#{"{1,2}" * 100_000}").accept(StringVisitor.new(strings))
+
+      assert_equal(["a"], strings)
+    end
+
+    def test_visit_allocations
+      visitor = Class.new(Visitor) { def visit_enclose_memory_node(node) = super }.new
+      shallow = Onigmo.parse("(a)")
+      deep = Onigmo.parse("#{"(" * 100}a#{")" * 100}")
+
+      # Leaves and nodes with a single child allocate nothing, and super calls
+      # from overridden visit methods reuse the outermost call's lookups.
+      assert_equal(allocations { shallow.accept(visitor) }, allocations { deep.accept(visitor) })
+      assert_equal(allocations { shallow.accept(Visitor.new) }, allocations { deep.accept(Visitor.new) })
+    end
+
+    def test_visit_redefined
+      visitor = Class.new(Visitor)
+      node = Onigmo.parse("(a)b")
+      node.accept(visitor.new)
+
+      names = []
+      visitor.define_method(:visit_enclose_memory_node) { |node| names << node.number; super(node) }
+      node.accept(visitor.new)
+
+      assert_equal([1], names)
+    end
+
+    def test_visit_redefined_in_module
+      mixin = Module.new
+      visitor = Class.new(Visitor) { include mixin }
+      node = Onigmo.parse("ab|c")
+      node.accept(visitor.new)
+
+      strings = []
+      mixin.define_method(:visit_string_node) { |node| strings << node.value }
+      node.accept(visitor.new)
+      assert_equal(["ab", "c"], strings)
+
+      nested = Module.new
+      mixin.include(nested)
+      nested.define_method(:visit_alternation_node) { |node| strings << :alternation }
+      strings.clear
+      node.accept(visitor.new)
+      assert_equal([:alternation], strings)
+
+      inner = Module.new
+      outer = Module.new { include inner }
+      visitor = Class.new(Visitor) { include outer }
+      node.accept(visitor.new)
+
+      inner.define_method(:visit_string_node) { |node| strings << node.value }
+      strings.clear
+      node.accept(visitor.new)
+      assert_equal(["ab", "c"], strings)
+    end
+
+    def test_each_child
+      node = Onigmo.parse("a|b{2}", lazy: true)
+
+      assert_equal(node.child_nodes, node.each_child.to_a)
+      assert_equal([node.nodes[1].node], node.nodes[1].each_child.to_a)
+      assert_equal([], node.nodes[0].each_child.to_a)
+    end
+
+    def test_copy
+      node = Onigmo.parse("a{2,3}")
+      copy = node.copy(upper: 5)
+
+      assert_equal([2, 5], [copy.lower, copy.upper])
+      assert_same(node.node, copy.node)
+      assert_same(Onigmo.parse("\\A"), Onigmo.parse("\\A").copy)
+      assert_raise(ArgumentError) { node.copy(value: "a") }
+    end
+
+    def test_mutation_visitor
+      visitor = Class.new(MutationVisitor) { define_method(:visit_string_node) { |node| node.value == "b" ? node.copy(value: "x") : node } }
+      node = Onigmo.parse("(a|b)(c)", interner: Interner.new)
+      result = node.accept(visitor.new)
+
+      assert_equal(Onigmo.parse("(a|x)(c)"), result)
+      assert_same(node.nodes[1], result.nodes[1])
+      assert_same(node.nodes[0].node.nodes[0], result.nodes[0].node.nodes[0])
+      assert_same(node, node.accept(MutationVisitor.new))
+    end
+
+    def test_walk
+      expected = []
+      Onigmo.parse(SOURCE).accept(StringVisitor.new(expected))
+
+      strings = []
+      Onigmo.walk(SOURCE, StringVisitor.new(strings))
+
+      assert_equal(expected, strings)
+    end
+
+    def test_walk_event
+      events = []
+      visitor = Class.new(Visitor) { define_method(:visit_quantifier_node) { |event| events << [event.type, event.depth, event.lower, event.upper, event.greedy] } }
+      Onigmo.walk("a(b{2,3}?)", visitor.new)
+
+      assert_equal([[QuantifierNode, 2, 2, 3, false]], events)
+    end
+
+    private
+
+    # The fewest objects allocated over a few runs, so that warming up method
+    # caches is not counted.
+    def allocations
+      Array.new(3) do
+        before = GC.stat(:total_allocated_objects)
+        yield
+        GC.stat(:total_allocated_objects) - before
+      end.min
+    end
   end
 end